@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "bgio.h"
+#include "sys.h"
+
+/* maximum number of queued jobs, and bytes written per frame. jobs are run
+   on the main thread, one step per frame, so that the file system and the
+   heap are never used by two threads at once */
+#define BGIO_JOB_MAX    4
+#define BGIO_CHUNK      0x4000
+
+struct bgio_job
+{
+  char             *path;
+  const char       *buf;
+  size_t            size;
+  size_t            pos;
+  int               fd;
+  bgio_done_proc    done_proc;
+  void             *done_data;
+};
+
+/* queued jobs, the first one is running */
+static struct bgio_job *bgio_jobs[BGIO_JOB_MAX];
+static int              bgio_n_pending = 0;
+
+/* remove the running job and call its completion callback */
+static void finish_job(int error)
+{
+  struct bgio_job *job = bgio_jobs[0];
+  if (job->fd != -1 && close(job->fd) && error == 0)
+    error = errno;
+  --bgio_n_pending;
+  for (int i = 0; i < bgio_n_pending; ++i)
+    bgio_jobs[i] = bgio_jobs[i + 1];
+  if (job->done_proc)
+    job->done_proc(error, job->done_data);
+  free(job->path);
+  free(job);
+}
+
+/* do the next step of the running job */
+static void run_job(void)
+{
+  struct bgio_job *job = bgio_jobs[0];
+  if (job->fd == -1) {
+    job->fd = creat(job->path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (job->fd == -1) {
+      finish_job(errno);
+      return;
+    }
+    /* reserve contiguous space so that the file is written in one go */
+    int e = posix_fallocate(job->fd, 0, job->size);
+    if (e)
+      finish_job(e);
+    else if (job->size == 0)
+      finish_job(0);
+    return;
+  }
+  size_t n = job->size - job->pos;
+  if (n > BGIO_CHUNK)
+    n = BGIO_CHUNK;
+  if (write(job->fd, (void *)&job->buf[job->pos], n) != n) {
+    finish_job(errno);
+    return;
+  }
+  job->pos += n;
+  if (job->pos == job->size)
+    finish_job(0);
+}
+
+/* write `size` bytes from `buf` to a new file at `path` in the background.
+   `buf` must stay valid until `done_proc` is called */
+int bgio_write_file(const char *path, const void *buf, size_t size,
+                    bgio_done_proc done_proc, void *done_data)
+{
+  if (bgio_n_pending == BGIO_JOB_MAX) {
+    errno = EBUSY;
+    return -1;
+  }
+  struct bgio_job *job = malloc(sizeof(*job));
+  if (!job) {
+    errno = ENOMEM;
+    return -1;
+  }
+  job->path = malloc(strlen(path) + 1);
+  if (!job->path) {
+    free(job);
+    errno = ENOMEM;
+    return -1;
+  }
+  strcpy(job->path, path);
+  job->buf = buf;
+  job->size = size;
+  job->pos = 0;
+  job->fd = -1;
+  job->done_proc = done_proc;
+  job->done_data = done_data;
+  bgio_jobs[bgio_n_pending++] = job;
+  return 0;
+}
+
+/* run a step of the queued jobs, call once per frame */
+void bgio_update(void)
+{
+  if (bgio_n_pending > 0)
+    run_job();
+}
+
+/* run all queued jobs to completion */
+void bgio_sync(void)
+{
+  while (bgio_n_pending > 0)
+    run_job();
+}
+
+_Bool bgio_busy(void)
+{
+  return bgio_n_pending > 0;
+}
+
+/* get the progress of the running job in percent */
+int bgio_progress(void)
+{
+  if (bgio_n_pending == 0 || bgio_jobs[0]->size == 0)
+    return 0;
+  struct bgio_job *job = bgio_jobs[0];
+  return (uint64_t)job->pos * 100 / job->size;
+}
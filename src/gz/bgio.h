@@ -0,0 +1,16 @@
+#ifndef BGIO_H
+#define BGIO_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* called when a job completes, with 0 or an errno value */
+typedef void (*bgio_done_proc)(int error, void *data);
+
+int   bgio_write_file(const char *path, const void *buf, size_t size,
+                      bgio_done_proc done_proc, void *done_data);
+void  bgio_update(void);
+void  bgio_sync(void);
+_Bool bgio_busy(void);
+int   bgio_progress(void);
+
+#endif
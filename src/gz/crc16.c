@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include "crc16.h"
+
+static uint16_t *crc16_table()
+{
+  static uint16_t crc_table[256];
+  static _Bool generate_table = 1;
+  if (generate_table) {
+    const uint16_t p = 0x1021;
+    for (int i = 0; i < 256; ++i) {
+      uint16_t crc = 0;
+      uint16_t c = i;
+      for (int j = 0; j < 8; ++j) {
+        if ((crc ^ (c << 1)) & 0x0100)
+          crc = (crc << 1) ^ p;
+        else
+          crc <<= 1;
+        c <<= 1;
+      }
+      crc_table[i] = crc;
+    }
+    generate_table = 0;
+  }
+  return crc_table;
+}
+
+/* table that spreads the bits of a byte over the 4 data lines, bit n goes
+   to line n % 4. each line gets 2 bits, in the low bits of its own byte */
+static uint32_t *lane_table()
+{
+  static uint32_t lane_table[256];
+  static _Bool generate_table = 1;
+  if (generate_table) {
+    for (int i = 0; i < 256; ++i) {
+      uint32_t w = 0;
+      for (int j = 0; j < 4; ++j) {
+        w |= ((i >> j) & 1) << (8 * j);
+        w |= ((i >> (j + 4)) & 1) << (8 * j + 1);
+      }
+      lane_table[i] = w;
+    }
+    generate_table = 0;
+  }
+  return lane_table;
+}
+
+/* compute the crc16 of each data line of a 4-bit wide sd transfer.
+   `crc` receives the four line crcs interleaved into 16-bit words, in the
+   order they are sent after the data */
+void crc16_wide(const void *data, int size, uint16_t *crc)
+{
+  uint16_t *crc_table = crc16_table();
+  uint32_t *lane = lane_table();
+  const uint8_t *p = data;
+  uint16_t crc_buf[4] = {0, 0, 0, 0};
+  while (size > 0) {
+    /* deserialize lines, one byte per line for every 4 bytes of data */
+    uint32_t w;
+    if (size >= 4)
+      w = (lane[p[0]] << 6) | (lane[p[1]] << 4) | (lane[p[2]] << 2) |
+          lane[p[3]];
+    else {
+      w = 0;
+      for (int i = 0; i < 4; ++i)
+        w |= lane[size > i ? p[i] : 0] << (6 - 2 * i);
+    }
+    for (int i = 0; i < 4; ++i) {
+      uint16_t c = crc_buf[i];
+      crc_buf[i] = crc_table[(c >> 8) ^ ((w >> (8 * i)) & 0xFF)] ^ (c << 8);
+    }
+    p += 4;
+    size -= 4;
+  }
+  /* serialize lines */
+  for (int i = 0; i < 4; i++)
+    crc[i] = 0;
+  for (int i = 0; i < 4 * 16; ++i) {
+    crc[3 - i / 16] >>= 1;
+    crc[3 - i / 16] |= (crc_buf[i % 4] & 1) << 15;
+    crc_buf[i % 4] >>= 1;
+  }
+}
@@ -0,0 +1,7 @@
+#ifndef CRC16_H
+#define CRC16_H
+#include <stdint.h>
+
+void crc16_wide(const void *data, int size, uint16_t *crc);
+
+#endif
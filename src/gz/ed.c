@@ -1,68 +1,52 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "crc16.h"
 #include "ed.h"
 #include "util.h"
 
 #define CMD_RETRY_MAX   16
 #define DATA_RETRY_MAX  16
+#define SPEED_RETRY_MAX 2
+#define PROBE_BLOCKS    16
+#define PROBE_MAX       4
 
 static uint32_t card_type;
+static uint32_t card_rca;
 static uint32_t spi_cfg;
+static struct ed_sd_stats sd_stats;
+static int crc_run;
 
-static uint16_t *crc16_table()
+static uint32_t cpu_count(void)
 {
-  static uint16_t crc_table[256];
-  static _Bool generate_table = 1;
-  if (generate_table) {
-    const uint16_t p = 0x1021;
-    for (int i = 0; i < 256; ++i) {
-      uint16_t crc = 0;
-      uint16_t c = i;
-      for (int j = 0; j < 8; ++j) {
-        if ((crc ^ (c << 1)) & 0x0100)
-          crc = (crc << 1) ^ p;
-        else
-          crc <<= 1;
-        c <<= 1;
-      }
-      crc_table[i] = crc;
-    }
-    generate_table = 0;
-  }
-  return crc_table;
+  uint32_t count;
+  __asm__ volatile ("mfc0    %[count], $9;" : [count] "=r"(count));
+  return count;
 }
 
-static void crc16_wide(void *data, int size, uint16_t *crc)
+/* count blocks transferred since cpu count `start` */
+static void sd_count_blocks(uint32_t n_blocks, uint32_t start)
 {
-  uint16_t *crc_table = crc16_table();
-  uint8_t *p = data;
-  uint16_t crc_buf[4] = {0, 0, 0, 0};
-  while (size > 0) {
-    uint8_t dat[4] = {0, 0, 0, 0};
-    /* deserialize lines */
-    for (int i = 3; i >= 0; --i) {
-      uint8_t d = size > i ? p[i] : 0;
-      for (int j = 0; j < 8; ++j) {
-        dat[j % 4] >>= 1;
-        dat[j % 4] |= (d & 1) << 7;
-        d >>= 1;
-      }
-    }
-    for (int i = 0; i < 4; ++i) {
-      uint16_t c = crc_buf[i];
-      crc_buf[i] = crc_table[(c >> 8) ^ dat[i]] ^ (c << 8);
+  sd_stats.n_block += n_blocks;
+  sd_stats.n_tick += cpu_count() - start;
+}
+
+/* count a failed transfer. repeated crc errors drop the spi clock to the
+   next slower speed */
+static void sd_count_error(enum ed_error e)
+{
+  if (e == ED_ERROR_SD_RD_CRC || e == ED_ERROR_SD_WR_CRC) {
+    ++sd_stats.n_crc_retry;
+    if (++crc_run >= SPEED_RETRY_MAX && sd_stats.speed < ED_SPI_SPEED_25) {
+      ed_spi_speed(sd_stats.speed + 1);
+      ++sd_stats.n_speed_drop;
+      crc_run = 0;
     }
-    p += 4;
-    size -= 4;
   }
-  /* serialize lines */
-  for (int i = 0; i < 4; i++)
-    crc[i] = 0;
-  for (int i = 0; i < 4 * 16; ++i) {
-    crc[3 - i / 16] >>= 1;
-    crc[3 - i / 16] |= (crc_buf[i % 4] & 1) << 15;
-    crc_buf[i % 4] >>= 1;
+  else if (e == ED_ERROR_SD_CMD_TIMEOUT || e == ED_ERROR_SD_CLOSE_TIMEOUT ||
+           e == ED_ERROR_SD_WR_TIMEOUT || e == ED_ERROR_SD_RD_TIMEOUT)
+  {
+    ++sd_stats.n_timeout;
   }
 }
 
@@ -164,10 +148,40 @@ enum ed_error ed_sd_cmd(int cmd, uint32_t arg, void *resp_buf)
   return e;
 }
 
+/* find the fastest spi speed at which the card can be read reliably. if
+   no speed passes, the slowest one is used and transfers rely on retries */
+static void probe_speed(void)
+{
+  enum ed_error e = ED_ERROR_SUCCESS;
+  for (int speed = ED_SPI_SPEED_50; speed <= ED_SPI_SPEED_25; ++speed) {
+    ed_spi_speed(speed);
+    for (int i = 0; i < PROBE_MAX; ++i) {
+      e = ed_sd_read_r(0, PROBE_BLOCKS, NULL, NULL);
+      if (e)
+        break;
+    }
+    if (e == ED_ERROR_SUCCESS) {
+      sd_stats.max_speed = speed;
+      crc_run = 0;
+      return;
+    }
+    /* leave the card in a known state before trying again */
+    if (e == ED_ERROR_SD_RD_TIMEOUT)
+      ed_sd_stop_rw();
+    sd_count_error(e);
+  }
+  ed_spi_speed(ED_SPI_SPEED_25);
+  sd_stats.max_speed = ED_SPI_SPEED_25;
+  crc_run = 0;
+}
+
 enum ed_error ed_sd_init(void)
 {
   enum ed_error e;
   static uint8_t resp[17];
+  /* reset statistics */
+  memset(&sd_stats, 0, sizeof(sd_stats));
+  crc_run = 0;
   /* initialize spi */
   ed_open();
   spi_cfg = 0;
@@ -243,6 +257,7 @@ enum ed_error ed_sd_init(void)
     goto exit;
   uint32_t rca = (resp[1] << 24) | (resp[2] << 16) |
                  (resp[3] << 8) | (resp[4] << 0);
+  card_rca = rca;
   ed_sd_cmd_r(SD_CMD_SELECT_CARD, 0, NULL);
   e = ed_sd_cmd(SD_CMD_SEND_CSD, rca, NULL);
   if (e)
@@ -257,7 +272,7 @@ enum ed_error ed_sd_init(void)
   e = ed_sd_cmd(SD_ACMD_SET_BUS_WIDTH, 2, NULL);
   if (e)
     goto exit;
-  ed_spi_speed(ED_SPI_SPEED_50);
+  probe_speed();
 exit:
   /* restore interrupts */
   set_int(ie);
@@ -426,16 +441,22 @@ enum ed_error ed_sd_read(uint32_t lba, uint32_t n_blocks, void *dst)
   char *p = dst;
   for (int i = 0; i < DATA_RETRY_MAX && n_blocks > 0; ) {
     uint32_t n_read = 0;
+    uint32_t start = cpu_count();
     e = ed_sd_read_r(lba, n_blocks, p, &n_read);
+    sd_count_blocks(n_read, start);
     lba += n_read;
     n_blocks -= n_read;
     p += n_read * 0x200;
+    if (e)
+      sd_count_error(e);
     if (e == ED_ERROR_SD_RD_CRC)
       ++i;
     else if (e)
       return e;
-    else
+    else {
       i = 0;
+      crc_run = 0;
+    }
   }
   return e;
 }
@@ -446,17 +467,23 @@ enum ed_error ed_sd_write(uint32_t lba, uint32_t n_blocks, void *src)
   char *p = src;
   for (int i = 0; i < DATA_RETRY_MAX && n_blocks > 0; ) {
     uint32_t n_write = 0;
+    uint32_t start = cpu_count();
     e = ed_sd_write_r(lba, n_blocks, p, &n_write);
+    sd_count_blocks(n_write, start);
     lba += n_write;
     n_blocks -= n_write;
     if (p)
       p += n_write * 0x200;
+    if (e)
+      sd_count_error(e);
     if (e == ED_ERROR_SD_WR_CRC)
       ++i;
     else if (e)
       return e;
-    else
+    else {
       i = 0;
+      crc_run = 0;
+    }
   }
   return e;
 }
@@ -492,7 +519,7 @@ static void memcpy_from_cart(void *dst, const void *src, uint32_t size)
 
 static void memcpy_to_cart(void *dst, const void *src, uint32_t size)
 {
-  uint32_t dst_addr = (uint32_t)src;
+  uint32_t dst_addr = (uint32_t)dst;
   uint32_t dst_aligned = (dst_addr + 3) & ~3;
   uint32_t pad = dst_addr - dst_aligned;
   uint32_t *p_dst = (void *)dst_aligned;
@@ -530,6 +557,7 @@ enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst)
 {
   const uint32_t cart_addr = 0xB2000000;
   enum ed_error e;
+  uint32_t start = cpu_count();
   /* disable interrupts */
   _Bool ie = enter_dma_section();
   /* send read command */
@@ -538,6 +566,7 @@ enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst)
   e = ed_sd_cmd(SD_CMD_READ_MULTIPLE_BLOCK, lba, NULL);
   if (e) {
     set_int(ie);
+    sd_count_error(e);
     return e;
   }
   /* dma to cart */
@@ -554,11 +583,13 @@ enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst)
   e = ed_sd_stop_rw();
   if (e) {
     set_int(ie);
+    sd_count_error(e);
     return e;
   }
   /* check for dma timeout */
   if (ed_regs.status & ED_STATE_DMA_TOUT) {
     set_int(ie);
+    sd_count_error(ED_ERROR_SD_RD_TIMEOUT);
     return ED_ERROR_SD_RD_TIMEOUT;
   }
   /* dma to ram */
@@ -568,9 +599,142 @@ enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst)
     memcpy_from_cart(dst, (void*)cart_addr, n_blocks * 0x200);
   /* restore interrupts */
   set_int(ie);
+  sd_count_blocks(n_blocks, start);
   return ED_ERROR_SUCCESS;
 }
 
+/* get the number of blocks that the card has accepted from the last write
+   command */
+static enum ed_error sd_num_wr_blocks(uint32_t *n_blocks)
+{
+  enum ed_error e = ed_sd_cmd(SD_CMD_APP_CMD, card_rca, NULL);
+  if (e)
+    return e;
+  e = ed_sd_cmd(SD_ACMD_SEND_NUM_WR_BLOCKS, 0, NULL);
+  if (e)
+    return e;
+  /* wait for start bit */
+  ed_spi_mode(1, 0, 0);
+  _Bool timeout = 1;
+  for (int i = 0; i < 0x10000; i++)
+    if ((ed_spi_transmit(0xFF) & 0xF1) == 0xF0) {
+      timeout = 0;
+      break;
+    }
+  if (timeout)
+    return ED_ERROR_SD_RD_TIMEOUT;
+  /* read the block count, a 4 byte data block */
+  uint8_t data[4];
+  ed_spi_mode(1, 0, 1);
+  for (int i = 0; i < 4; ++i)
+    data[i] = ed_spi_transmit(0xFF);
+  /* verify crc */
+  uint16_t sd_crc[4];
+  uint16_t data_crc[4];
+  for (int i = 0; i < 4; ++i) {
+    uint16_t line_crc = 0;
+    line_crc |= ((ed_spi_transmit(0xFF) & 0xFF) << 8);
+    line_crc |= ((ed_spi_transmit(0xFF) & 0xFF) << 0);
+    sd_crc[i] = line_crc;
+  }
+  crc16_wide(data, sizeof(data), data_crc);
+  for (int i = 0; i < 4; ++i)
+    if (sd_crc[i] != data_crc[i])
+      return ED_ERROR_SD_RD_CRC;
+  *n_blocks = (data[0] << 24) | (data[1] << 16) |
+              (data[2] << 8) | (data[3] << 0);
+  return ED_ERROR_SUCCESS;
+}
+
+/* write blocks with a dma from the cart. the cart generates the crc for
+   each block, but doesn't check the crc status that the card returns, so
+   the number of blocks that were accepted is asked from the card after the
+   transfer */
+static enum ed_error sd_write_dma_r(uint32_t lba, uint32_t n_blocks,
+                                    void *src, uint32_t *n_write)
+{
+  const uint32_t cart_addr = 0xB2000000;
+  enum ed_error e;
+  /* disable interrupts */
+  _Bool ie = enter_dma_section();
+  /* stage data in cart, a null source writes zeros */
+  if (!src) {
+    volatile uint32_t *p = (void*)cart_addr;
+    for (uint32_t i = 0; i < n_blocks * 0x200 / 4; ++i)
+      p[i] = 0;
+  }
+  else if ((uint32_t)src % 0x8 == 0)
+    dma_write(src, cart_addr, n_blocks * 0x200);
+  else
+    memcpy_to_cart((void*)cart_addr, src, n_blocks * 0x200);
+  /* send write command */
+  if (!(card_type & SD_HC))
+    lba *= 512;
+  e = ed_sd_cmd(SD_CMD_WRITE_MULTIPLE_BLOCK, lba, NULL);
+  if (e)
+    goto exit;
+  /* dma from cart */
+  ed_spi_mode(1, 1, 1);
+  ed_regs.cfg;
+  ed_regs.dma_len = n_blocks - 1;
+  ed_regs.cfg;
+  ed_regs.dma_ram_addr = cart_addr / 0x800;
+  ed_regs.cfg;
+  ed_regs.dma_cfg = ED_DMA_RAM_TO_SD;
+  while (ed_regs.status & ED_STATE_DMA_BUSY)
+    ;
+  _Bool dma_timeout = ed_regs.status & ED_STATE_DMA_TOUT;
+  /* stop data transmission and wait for the card to finish programming */
+  e = ed_sd_stop_rw();
+  if (e)
+    goto exit;
+  /* check how many blocks were written */
+  uint32_t n;
+  e = sd_num_wr_blocks(&n);
+  if (e)
+    goto exit;
+  if (n <= n_blocks)
+    *n_write = n;
+  if (dma_timeout)
+    e = ED_ERROR_SD_WR_TIMEOUT;
+  else if (n != n_blocks)
+    e = ED_ERROR_SD_WR_CRC;
+exit:
+  /* restore interrupts */
+  set_int(ie);
+  return e;
+}
+
+enum ed_error ed_sd_write_dma(uint32_t lba, uint32_t n_blocks, void *src)
+{
+  enum ed_error e = ED_ERROR_SUCCESS;
+  char *p = src;
+  for (int i = 0; i < DATA_RETRY_MAX && n_blocks > 0; ) {
+    uint32_t n_write = 0;
+    uint32_t start = cpu_count();
+    e = sd_write_dma_r(lba, n_blocks, p, &n_write);
+    sd_count_blocks(n_write, start);
+    lba += n_write;
+    n_blocks -= n_write;
+    if (p)
+      p += n_write * 0x200;
+    if (e)
+      sd_count_error(e);
+    if (e == ED_ERROR_SD_WR_CRC)
+      ++i;
+    else if (e) {
+      /* the write could not be checked, or the dma failed. write the rest
+         without dma, which checks each block as it goes */
+      return ed_sd_write(lba, n_blocks, p);
+    }
+    else {
+      i = 0;
+      crc_run = 0;
+    }
+  }
+  return e;
+}
+
 enum ed_error ed_sd_stop_rw(void)
 {
   enum ed_error e = ed_sd_cmd(SD_CMD_STOP_TRANSMISSION, 0, NULL);
@@ -589,6 +753,26 @@ enum ed_error ed_sd_stop_rw(void)
   return ED_ERROR_SUCCESS;
 }
 
+void ed_sd_get_stats(struct ed_sd_stats *stats)
+{
+  *stats = sd_stats;
+  if (sd_stats.n_tick > 0)
+    stats->blocks_per_sec = (uint64_t)sd_stats.n_block * OS_CPU_COUNTER /
+                            sd_stats.n_tick;
+  else
+    stats->blocks_per_sec = 0;
+}
+
+/* clear the transfer and error counts, the speeds are kept */
+void ed_sd_reset_stats(void)
+{
+  sd_stats.n_crc_retry = 0;
+  sd_stats.n_timeout = 0;
+  sd_stats.n_speed_drop = 0;
+  sd_stats.n_block = 0;
+  sd_stats.n_tick = 0;
+}
+
 enum ed_error ed_fifo_read(void *dst, uint32_t n_blocks)
 {
   const uint32_t cart_addr = 0xB2000000;
@@ -668,6 +852,7 @@ void ed_spi_mode(_Bool data, _Bool write, _Bool wide)
 
 void ed_spi_speed(int speed)
 {
+  sd_stats.speed = speed;
   spi_cfg &= ~ED_SPI_CFG_SPDMASK;
   spi_cfg |= (speed & ED_SPI_CFG_SPDMASK) << ED_SPI_CFG_SPDSHIFT;
   ed_regs.cfg;
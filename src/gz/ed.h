@@ -46,6 +46,7 @@
 #define SD_CMD_APP_CMD              55
 
 #define SD_ACMD_SET_BUS_WIDTH       6
+#define SD_ACMD_SEND_NUM_WR_BLOCKS  22
 #define SD_ACMD_SD_SEND_OP_COND     41
 
 #define SD_R1                       1
@@ -69,6 +70,21 @@ enum ed_error
   ED_ERROR_FIFO_RD_TIMEOUT,
 };
 
+/* sd card statistics, collected since the last ed_sd_init */
+struct ed_sd_stats
+{
+  /* current and fastest stable spi speed */
+  int           speed;
+  int           max_speed;
+  uint32_t      n_crc_retry;
+  uint32_t      n_timeout;
+  uint32_t      n_speed_drop;
+  /* transferred blocks and the cpu counter ticks spent on them */
+  uint32_t      n_block;
+  uint64_t      n_tick;
+  uint32_t      blocks_per_sec;
+};
+
 typedef struct
 {
   uint32_t cfg;                     /* 0x0000 */
@@ -105,7 +121,10 @@ enum ed_error ed_sd_write_r(uint32_t lba, uint32_t n_blocks,
 enum ed_error ed_sd_read(uint32_t lba, uint32_t n_blocks, void *dst);
 enum ed_error ed_sd_write(uint32_t lba, uint32_t n_blocks, void *src);
 enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst);
+enum ed_error ed_sd_write_dma(uint32_t lba, uint32_t n_blocks, void *src);
 enum ed_error ed_sd_stop_rw(void);
+void          ed_sd_get_stats(struct ed_sd_stats *stats);
+void          ed_sd_reset_stats(void);
 
 enum ed_error ed_fifo_read(void *dst, uint32_t n_blocks);
 enum ed_error ed_fifo_write(void *src, uint32_t n_blocks);
@@ -45,6 +45,20 @@ static _Bool name_comp(const char *a, const char *b)
   return !*a && !*b;
 }
 
+/* case-insensitive fnv-1a hash */
+static uint32_t name_hash(const char *s)
+{
+  uint32_t hash = 0x811C9DC5;
+  while (*s) {
+    char c = *s++;
+    if (c >= 'a' && c <= 'z')
+      c += 'A' - 'a';
+    hash ^= (uint8_t)c;
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
 /* compute the length of a string without trailing spaces and dots */
 static size_t name_trim(const char *s, size_t length)
 {
@@ -305,80 +319,227 @@ static time_t dos2unix(uint16_t dos_date, uint16_t dos_time)
    cache operations
 */
 
+/* read sectors from the device, counting the request */
+static int dev_read(struct fat *fat, uint32_t lba, uint32_t n_sect, void *buf)
+{
+  ++fat->n_read;
+  fat->n_read_sect += n_sect;
+  return fat->read(lba, n_sect, buf);
+}
+
+/* write sectors to the device, counting the request */
+static int dev_write(struct fat *fat, uint32_t lba, uint32_t n_sect,
+                     void *buf)
+{
+  ++fat->n_write;
+  fat->n_write_sect += n_sect;
+  return fat->write(lba, n_sect, buf);
+}
+
+/* write back the dirty sectors of a cache block */
+static int block_flush(struct fat *fat, int index,
+                       struct fat_cache_block *block)
+{
+  for (int i = 0; i < FAT_MAX_CACHE_SECT && block->dirty; ) {
+    if (!(block->dirty & (1 << i))) {
+      ++i;
+      continue;
+    }
+    /* write runs of consecutive dirty sectors in one go */
+    int n = 0;
+    while (i + n < FAT_MAX_CACHE_SECT && (block->dirty & (1 << (i + n))))
+      ++n;
+    if (dev_write(fat, block->load_lba + i, n,
+                  &block->data[fat->n_sect_byte * i]))
+    {
+      errno = EIO;
+      return -1;
+    }
+    block->dirty &= ~(((1 << n) - 1) << i);
+    /* mirror FATs are only written when syncing */
+    if (index == FAT_CACHE_FAT && fat->fat_mirror)
+      block->sync |= ((1 << n) - 1) << i;
+    i += n;
+  }
+  return 0;
+}
+
+/* copy the primary FAT sectors of a cache block to the mirror FATs */
+static int block_sync(struct fat *fat, struct fat_cache_block *block)
+{
+  for (int i = 0; i < FAT_MAX_CACHE_SECT && block->sync; ) {
+    if (!(block->sync & (1 << i))) {
+      ++i;
+      continue;
+    }
+    int n = 0;
+    while (i + n < FAT_MAX_CACHE_SECT && (block->sync & (1 << (i + n))))
+      ++n;
+    for (int j = 1; j < fat->n_fat; ++j) {
+      uint32_t lba = block->load_lba + fat->n_fat_sect * j + i;
+      if (dev_write(fat, lba, n, &block->data[fat->n_sect_byte * i])) {
+        errno = EIO;
+        return -1;
+      }
+    }
+    block->sync &= ~(((1 << n) - 1) << i);
+    i += n;
+  }
+  return 0;
+}
+
 static int cache_flush(struct fat *fat, int index)
 {
   struct fat_cache *cache = &fat->cache[index];
-  if (!cache->valid || !cache->dirty)
-    return 0;
-  if (fat->write(cache->load_lba, cache->n_sect, cache->data)) {
-    errno = EIO;
-    return -1;
+  for (int i = 0; i < FAT_CACHE_SETS * FAT_CACHE_WAYS; ++i) {
+    if (block_flush(fat, index, &cache->block[i]))
+      return -1;
+  }
+  return 0;
+}
+
+/* bring the mirror FATs up to date with the primary FAT */
+static int mirror_sync(struct fat *fat)
+{
+  struct fat_cache *cache = &fat->cache[FAT_CACHE_FAT];
+  for (int i = 0; i < FAT_CACHE_SETS * FAT_CACHE_WAYS; ++i) {
+    if (block_sync(fat, &cache->block[i]))
+      return -1;
   }
-  cache->dirty = 0;
   return 0;
 }
 
+/* write back an evicted block. the FAT is written first, so that the
+   directory entries and data on the card never refer to clusters that
+   aren't allocated there yet */
+static int block_writeback(struct fat *fat, int index,
+                           struct fat_cache_block *block)
+{
+  if (index == FAT_CACHE_DATA && block->dirty) {
+    if (cache_flush(fat, FAT_CACHE_FAT))
+      return -1;
+  }
+  if (block_flush(fat, index, block))
+    return -1;
+  /* the mirrors can't be synced from a block that's being replaced */
+  return block_sync(fat, block);
+}
+
 static void *cache_prep(struct fat *fat, int index, uint32_t lba, _Bool load)
 {
   struct fat_cache *cache = &fat->cache[index];
-  if (cache->valid &&
-      cache->load_lba <= lba &&
-      cache->load_lba + cache->n_sect > lba)
-  {
-    cache->prep_lba = lba;
-    uint32_t offset = fat->n_sect_byte * (cache->prep_lba - cache->load_lba);
-    return &cache->data[offset];
+  uint32_t load_lba = lba / FAT_MAX_CACHE_SECT * FAT_MAX_CACHE_SECT;
+  uint32_t sect = lba - load_lba;
+  /* look up the block in its set, or pick the lru block for replacement */
+  int set = load_lba / FAT_MAX_CACHE_SECT % FAT_CACHE_SETS;
+  struct fat_cache_block *ways = &cache->block[set * FAT_CACHE_WAYS];
+  struct fat_cache_block *block = NULL;
+  struct fat_cache_block *victim = &ways[0];
+  for (int i = 0; i < FAT_CACHE_WAYS; ++i) {
+    struct fat_cache_block *way = &ways[i];
+    if (way->valid && way->load_lba == load_lba) {
+      block = way;
+      break;
+    }
+    if (victim->valid && (!way->valid || way->lru < victim->lru))
+      victim = way;
   }
-  if (cache_flush(fat, index))
-    return NULL;
-  if (load) {
-    cache->n_sect = FAT_MAX_CACHE_SECT;
-    if (lba + cache->n_sect > cache->max_lba)
-      cache->n_sect = cache->max_lba - lba;
-    if (fat->read(lba, cache->n_sect, cache->data)) {
-      cache->valid = 0;
-      errno = EIO;
-      return NULL;
+  if (block && (block->valid & (1 << sect)))
+    ++cache->n_hit;
+  else {
+    ++cache->n_miss;
+    if (!block) {
+      if (block_writeback(fat, index, victim))
+        return NULL;
+      block = victim;
+      block->valid = 0;
+      block->load_lba = load_lba;
     }
+    if (load) {
+      /* write back any pending sectors, then fill the whole block */
+      if (block_flush(fat, index, block))
+        return NULL;
+      int n_sect = FAT_MAX_CACHE_SECT;
+      if (load_lba + n_sect > cache->max_lba)
+        n_sect = cache->max_lba - load_lba;
+      if (dev_read(fat, load_lba, n_sect, block->data)) {
+        block->valid = 0;
+        errno = EIO;
+        return NULL;
+      }
+      block->valid = (1 << n_sect) - 1;
+    }
+    else
+      block->valid |= 1 << sect;
   }
-  else
-    cache->n_sect = 1;
-  cache->valid = 1;
-  cache->dirty = 0;
-  cache->load_lba = lba;
+  block->lru = ++cache->lru_clock;
+  cache->prep_block = block;
   cache->prep_lba = lba;
-  return cache->data;
+  return &block->data[fat->n_sect_byte * sect];
+}
+
+/* return a pointer to the most recently prepped sector */
+static void *cache_data(struct fat *fat, int index)
+{
+  struct fat_cache *cache = &fat->cache[index];
+  struct fat_cache_block *block = cache->prep_block;
+  return &block->data[fat->n_sect_byte * (cache->prep_lba - block->load_lba)];
 }
 
 static void cache_dirty(struct fat *fat, int index)
 {
-  fat->cache[index].dirty = 1;
+  struct fat_cache *cache = &fat->cache[index];
+  struct fat_cache_block *block = cache->prep_block;
+  block->dirty |= 1 << (cache->prep_lba - block->load_lba);
 }
 
 static void cache_inval(struct fat *fat, int index)
 {
-  fat->cache[index].valid = 0;
+  struct fat_cache *cache = &fat->cache[index];
+  for (int i = 0; i < FAT_CACHE_SETS * FAT_CACHE_WAYS; ++i) {
+    cache->block[i].valid = 0;
+    cache->block[i].dirty = 0;
+    cache->block[i].sync = 0;
+  }
+}
+
+/* write back and invalidate the cached sectors in an lba range */
+static int cache_evict(struct fat *fat, int index, uint32_t lba,
+                       uint32_t n_sect)
+{
+  struct fat_cache *cache = &fat->cache[index];
+  for (int i = 0; i < FAT_CACHE_SETS * FAT_CACHE_WAYS; ++i) {
+    struct fat_cache_block *block = &cache->block[i];
+    if (!block->valid ||
+        block->load_lba + FAT_MAX_CACHE_SECT <= lba ||
+        block->load_lba >= lba + n_sect)
+    {
+      continue;
+    }
+    if (block_writeback(fat, index, block))
+      return -1;
+    block->valid = 0;
+  }
+  return 0;
 }
 
 static void cache_read(struct fat *fat, int index, uint32_t offset,
                        void *dst, uint32_t length)
 {
-  struct fat_cache *cache = &fat->cache[index];
-  offset += fat->n_sect_byte * (cache->prep_lba - cache->load_lba);
+  char *data = cache_data(fat, index);
   if (dst)
-    memcpy(dst, &cache->data[offset], length);
+    memcpy(dst, &data[offset], length);
 }
 
 static void cache_write(struct fat *fat, int index, uint32_t offset,
                         const void *src, uint32_t length)
 {
-  struct fat_cache *cache = &fat->cache[index];
-  offset += fat->n_sect_byte * (cache->prep_lba - cache->load_lba);
+  char *data = cache_data(fat, index);
   if (src)
-    memcpy(&cache->data[offset], src, length);
+    memcpy(&data[offset], src, length);
   else
-    memset(&cache->data[offset], 0, length);
-  cache->dirty = 1;
+    memset(&data[offset], 0, length);
+  cache_dirty(fat, index);
 }
 
 static uint32_t get_word(const void *buf, uint32_t offset, int width)
@@ -401,6 +562,13 @@ static void set_word(void *buf, uint32_t offset, int width, uint32_t value)
    cluster operations
 */
 
+/* number of clusters needed to hold `size` bytes, without overflowing for
+   sizes close to 4 GiB */
+static uint32_t size_clust(struct fat *fat, uint32_t size)
+{
+  return size / fat->n_clust_byte + (size % fat->n_clust_byte != 0);
+}
+
 static int get_clust_fat12(struct fat *fat, uint32_t clust, uint32_t *value)
 {
   uint32_t offset = clust / 2 * 3;
@@ -454,13 +622,9 @@ static int set_clust_fat12(struct fat *fat, uint32_t clust, uint32_t value)
     if (!block)
       return -1;
     value |= ((get_word(block, 0, 3 - n) << (8 * n)) & ~mask);
-    set_word(block, offset, 3 - n, value >> (8 * n));
+    set_word(block, 0, 3 - n, value >> (8 * n));
   }
   cache_dirty(fat, FAT_CACHE_FAT);
-  if (clust < fat->free_lb && value == 0)
-    fat->free_lb = clust;
-  else if (clust == fat->free_lb && value != 0)
-    ++fat->free_lb;
   return 0;
 }
 
@@ -488,11 +652,74 @@ static int get_clust(struct fat *fat, uint32_t clust, uint32_t *value)
     *value = get_word(block, offset, 4);
     *value &= 0x0FFFFFFF;
   }
-  if (clust == fat->free_lb && value != 0)
+  if (clust == fat->free_lb && *value != 0)
     ++fat->free_lb;
   return 0;
 }
 
+/* remove a cluster that is being allocated from the free extent summary,
+   or merge a cluster that is being freed into an adjacent extent */
+static void update_free_ext(struct fat *fat, uint32_t clust, _Bool free)
+{
+  for (int i = 0; i < FAT_FREE_EXT_MAX; ++i) {
+    struct fat_free_ext *ext = &fat->free_ext[i];
+    if (ext->length == 0)
+      continue;
+    if (free) {
+      if (clust + 1 == ext->clust) {
+        --ext->clust;
+        ++ext->length;
+        break;
+      }
+      if (clust == ext->clust + ext->length) {
+        ++ext->length;
+        break;
+      }
+    }
+    else if (clust >= ext->clust && clust < ext->clust + ext->length) {
+      /* keep the larger part of a split extent */
+      uint32_t head = clust - ext->clust;
+      uint32_t tail = ext->length - head - 1;
+      if (tail >= head) {
+        ext->clust = clust + 1;
+        ext->length = tail;
+      }
+      else
+        ext->length = head;
+      break;
+    }
+  }
+}
+
+/* update the free space info when a cluster entry changes */
+static void update_free(struct fat *fat, uint32_t clust, uint32_t old_value,
+                        uint32_t value)
+{
+  if (value == 0) {
+    if (clust < fat->free_lb)
+      fat->free_lb = clust;
+    if (old_value != 0) {
+      if (fat->n_free != FAT_FREE_UNKNOWN)
+        ++fat->n_free;
+      update_free_ext(fat, clust, 1);
+      fat->fsis_dirty = 1;
+    }
+  }
+  else {
+    if (clust == fat->free_lb)
+      ++fat->free_lb;
+    if (old_value == 0) {
+      /* a hint that runs out before the volume does was stale */
+      if (fat->n_free == 0)
+        fat->n_free = FAT_FREE_UNKNOWN;
+      else if (fat->n_free != FAT_FREE_UNKNOWN)
+        --fat->n_free;
+      update_free_ext(fat, clust, 0);
+      fat->fsis_dirty = 1;
+    }
+  }
+}
+
 /* set the value of a cluster entry in the FAT */
 static int set_clust(struct fat *fat, uint32_t clust, uint32_t value)
 {
@@ -500,27 +727,77 @@ static int set_clust(struct fat *fat, uint32_t clust, uint32_t value)
     errno = EOVERFLOW;
     return -1;
   }
-  if (fat->type == FAT12)
-    return set_clust_fat12(fat, clust, value);
-  uint32_t ent_size = fat->type == FAT16 ? 2 : 4;
-  uint32_t lba = clust / (fat->n_sect_byte / ent_size);
-  uint32_t offset = clust % (fat->n_sect_byte / ent_size) * ent_size;
-  void *block = cache_prep(fat, FAT_CACHE_FAT, fat->fat_lba + lba, 1);
-  if (!block)
+  uint32_t old_value;
+  if (get_clust(fat, clust, &old_value))
     return -1;
-  if (fat->type == FAT16) {
-    value &= 0x0000FFFF;
-    set_word(block, offset, 2, value);
+  if (fat->type == FAT12) {
+    if (set_clust_fat12(fat, clust, value))
+      return -1;
   }
   else {
-    value &= 0x0FFFFFFF;
-    set_word(block, offset, 4, value);
+    uint32_t ent_size = fat->type == FAT16 ? 2 : 4;
+    uint32_t lba = clust / (fat->n_sect_byte / ent_size);
+    uint32_t offset = clust % (fat->n_sect_byte / ent_size) * ent_size;
+    void *block = cache_prep(fat, FAT_CACHE_FAT, fat->fat_lba + lba, 1);
+    if (!block)
+      return -1;
+    if (fat->type == FAT16) {
+      value &= 0x0000FFFF;
+      set_word(block, offset, 2, value);
+    }
+    else {
+      value &= 0x0FFFFFFF;
+      set_word(block, offset, 4, value);
+    }
+    cache_dirty(fat, FAT_CACHE_FAT);
   }
-  cache_dirty(fat, FAT_CACHE_FAT);
-  if (clust < fat->free_lb && value == 0)
-    fat->free_lb = clust;
-  else if (clust == fat->free_lb && value != 0)
-    ++fat->free_lb;
+  update_free(fat, clust, old_value, value);
+  return 0;
+}
+
+/* write back the cached metadata in dependency order; new allocations,
+   then directory entries and data, then the deferred cluster frees */
+static int meta_commit(struct fat *fat)
+{
+  if (cache_flush(fat, FAT_CACHE_FAT) || cache_flush(fat, FAT_CACHE_DATA))
+    return -1;
+  while (fat->n_free_log > 0) {
+    struct fat_free_ext *ext = &fat->free_log[fat->n_free_log - 1];
+    while (ext->length > 0) {
+      if (set_clust(fat, ext->clust, 0x00000000))
+        return -1;
+      ++ext->clust;
+      --ext->length;
+    }
+    --fat->n_free_log;
+  }
+  return cache_flush(fat, FAT_CACHE_FAT);
+}
+
+/* free a cluster on the next metadata commit. until then the cluster stays
+   allocated, so it can't be reused while the old directory entry that
+   refers to it may still be on the card */
+static int free_clust(struct fat *fat, uint32_t clust)
+{
+  for (int i = 0; i < fat->n_free_log; ++i) {
+    struct fat_free_ext *ext = &fat->free_log[i];
+    if (clust == ext->clust + ext->length) {
+      ++ext->length;
+      return 0;
+    }
+    if (clust + 1 == ext->clust) {
+      --ext->clust;
+      ++ext->length;
+      return 0;
+    }
+  }
+  if (fat->n_free_log == FAT_FREE_LOG_MAX) {
+    if (meta_commit(fat))
+      return -1;
+  }
+  struct fat_free_ext *ext = &fat->free_log[fat->n_free_log++];
+  ext->clust = clust;
+  ext->length = 1;
   return 0;
 }
 
@@ -570,6 +847,116 @@ static uint32_t check_free_chunk_length(struct fat *fat, uint32_t clust,
   }
   return length;
 }
+/* record a run of free clusters in the free extent summary,
+   replacing the smallest recorded extent if the summary is full */
+static void add_free_ext(struct fat *fat, uint32_t clust, uint32_t length)
+{
+  struct fat_free_ext *min_ext = &fat->free_ext[0];
+  for (int i = 1; i < FAT_FREE_EXT_MAX; ++i) {
+    struct fat_free_ext *ext = &fat->free_ext[i];
+    if (ext->length < min_ext->length)
+      min_ext = ext;
+  }
+  if (length > min_ext->length) {
+    min_ext->clust = clust;
+    min_ext->length = length;
+  }
+}
+
+/* scan the entire FAT to count the free clusters and build the free
+   extent summary */
+static int scan_free(struct fat *fat)
+{
+  for (int i = 0; i < FAT_FREE_EXT_MAX; ++i)
+    fat->free_ext[i].length = 0;
+  uint32_t n_free = 0;
+  uint32_t run_clust = 0;
+  uint32_t run_length = 0;
+  uint32_t ent_size = fat->type == FAT16 ? 2 : 4;
+  uint32_t n_sect_ent = fat->n_sect_byte / ent_size;
+  void *block = NULL;
+  for (uint32_t clust = 2; clust <= fat->max_clust; ++clust) {
+    /* treat the end of the FAT as a used cluster to end the last run */
+    uint32_t value = 1;
+    if (clust < fat->max_clust && fat->type == FAT12) {
+      if (get_clust(fat, clust, &value))
+        return -1;
+    }
+    else if (clust < fat->max_clust) {
+      /* read entries directly from the sector, it's a lot faster */
+      uint32_t offset = clust % n_sect_ent;
+      if (!block || offset == 0) {
+        block = cache_prep(fat, FAT_CACHE_FAT,
+                           fat->fat_lba + clust / n_sect_ent, 1);
+        if (!block)
+          return -1;
+      }
+      value = get_word(block, offset * ent_size, ent_size);
+      if (fat->type == FAT32)
+        value &= 0x0FFFFFFF;
+    }
+    if (value == 0) {
+      if (run_length == 0)
+        run_clust = clust;
+      ++run_length;
+      ++n_free;
+    }
+    else if (run_length > 0) {
+      add_free_ext(fat, run_clust, run_length);
+      run_length = 0;
+    }
+  }
+  if (fat->n_free != n_free)
+    fat->fsis_dirty = 1;
+  fat->n_free = n_free;
+  fat->free_scanned = 1;
+  return 0;
+}
+
+/* find a run of free clusters in the free extent summary, preferably the
+   smallest one that has at least `pref_length` clusters, otherwise the
+   largest one. the summary is built on first use. */
+static uint32_t find_free_ext(struct fat *fat, uint32_t pref_length,
+                              uint32_t *length)
+{
+  if (!fat->free_scanned && scan_free(fat))
+    return 0;
+  _Bool rescanned = 0;
+  while (1) {
+    struct fat_free_ext *fit_ext = NULL;
+    for (int i = 0; i < FAT_FREE_EXT_MAX; ++i) {
+      struct fat_free_ext *ext = &fat->free_ext[i];
+      if (ext->length == 0)
+        continue;
+      if (!fit_ext ||
+          (fit_ext->length < pref_length && ext->length > fit_ext->length) ||
+          (ext->length >= pref_length && ext->length < fit_ext->length))
+      {
+        fit_ext = ext;
+      }
+    }
+    if (!fit_ext) {
+      /* all recorded extents have been used up, rebuild the summary if
+         there are any free clusters left */
+      if (rescanned || fat->n_free == 0 || scan_free(fat))
+        return 0;
+      rescanned = 1;
+      continue;
+    }
+    /* validate the extent, it may have been invalidated by
+       changes that the summary doesn't track */
+    uint32_t ext_length = check_free_chunk_length(fat, fit_ext->clust,
+                                                  fit_ext->length);
+    if (ext_length == 0) {
+      fit_ext->length = 0;
+      continue;
+    }
+    fit_ext->length = ext_length;
+    *length = ext_length < pref_length ? ext_length : pref_length;
+    return fit_ext->clust;
+  }
+}
+
 /* find the first free cluster after `clust` (inclusive),
    preferably with at most `pref_length` free clusters chunked in a sequence.
    returns the actual chunk length in `*length` if given. */
@@ -580,7 +967,11 @@ static uint32_t find_free_clust(struct fat *fat, uint32_t clust,
     clust = fat->free_lb;
   uint32_t max_clust = 0;
   uint32_t max_length = 0;
-  while (max_length < pref_length && clust < fat->max_clust) {
+  /* look for a chunk near `clust` first */
+  uint32_t end_clust = clust + FAT_FREE_SCAN_MAX;
+  if (end_clust > fat->max_clust || end_clust < clust)
+    end_clust = fat->max_clust;
+  while (max_length < pref_length && clust < end_clust) {
     uint32_t chunk_length = check_free_chunk_length(fat, clust, pref_length);
     if (chunk_length > max_length) {
       max_clust = clust;
@@ -591,6 +982,15 @@ static uint32_t find_free_clust(struct fat *fat, uint32_t clust,
     else
       ++clust;
   }
+  /* then check the free extent summary */
+  if (max_length < pref_length) {
+    uint32_t ext_length;
+    uint32_t ext_clust = find_free_ext(fat, pref_length, &ext_length);
+    if (ext_clust != 0 && ext_length > max_length) {
+      max_clust = ext_clust;
+      max_length = ext_length;
+    }
+  }
   if (max_length == 0)
     errno = ENOSPC;
   if (length)
@@ -622,18 +1022,51 @@ static int link_clust(struct fat *fat, uint32_t clust, uint32_t next_clust,
   return 0;
 }
 
+/* count free clusters from the lowest known free cluster, stopping when
+   `needed` have been found */
+static int count_free(struct fat *fat, uint32_t needed, uint32_t *n_free)
+{
+  uint32_t n = 0;
+  for (uint32_t clust = fat->free_lb; n < needed && clust < fat->max_clust;
+       ++clust)
+  {
+    uint32_t value;
+    if (get_clust(fat, clust, &value))
+      return -1;
+    if (value == 0)
+      ++n;
+  }
+  *n_free = n;
+  return 0;
+}
+
 /* check if there are at least `needed` free clusters available */
 static int check_free_space(struct fat *fat, uint32_t needed)
 {
-  uint32_t n_free = 0;
-  for (uint32_t i = fat->free_lb; i < fat->max_clust && n_free < needed; ++i) {
-    uint32_t value;
-    if (get_clust(fat, i, &value))
+  /* a count given by the fsinfo sector is only a hint, it goes stale when
+     other systems write to the volume. count free clusters if the count
+     is unknown or claims that there isn't enough space. otherwise, confirm
+     the space once by looking for the needed clusters, and count them all
+     if they can't be found. a confirmed count is kept up to date from then
+     on, and trusted until it proves wrong */
+  if (!fat->free_scanned) {
+    _Bool scan = fat->n_free == FAT_FREE_UNKNOWN || fat->n_free < needed;
+    if (!scan && !fat->free_checked) {
+      uint32_t n_free;
+      if (count_free(fat, needed, &n_free))
+        return -1;
+      scan = n_free < needed;
+      fat->free_checked = !scan;
+    }
+    if (scan && scan_free(fat))
       return -1;
-    if (value == 0x00000000)
-      ++n_free;
   }
-  if (n_free < needed) {
+  /* commit pending frees before giving up */
+  if (fat->n_free < needed && fat->n_free_log > 0) {
+    if (meta_commit(fat))
+      return -1;
+  }
+  if (fat->n_free < needed) {
     errno = ENOSPC;
     return -1;
   }
@@ -676,7 +1109,7 @@ static int resize_clust_chain(struct fat *fat, uint32_t clust, uint32_t n,
       eoc = 1;
     }
     if (i >= n) {
-      if (set_clust(fat, clust, 0x00000000))
+      if (free_clust(fat, clust))
         return -1;
       clust = value;
     }
@@ -690,8 +1123,14 @@ static int resize_clust_chain(struct fat *fat, uint32_t clust, uint32_t n,
         new_clust = find_free_clust(fat, new_clust, n_alloc, &chunk_length);
         if (new_clust == clust)
           new_clust = find_free_clust(fat, clust + 1, n_alloc, &chunk_length);
-        if (new_clust == 0)
+        if (new_clust == 0) {
+          /* end the chain at the last allocated cluster, so that it
+             doesn't lead into free space */
+          int e = errno;
+          set_clust(fat, clust, 0x0FFFFFFF);
+          errno = e;
           return -1;
+        }
         n_alloc -= chunk_length;
       }
       else
@@ -707,6 +1146,135 @@ static int resize_clust_chain(struct fat *fat, uint32_t clust, uint32_t n,
   return 0;
 }
 
+/*
+   extent map operations
+*/
+
+/* map more of the cluster chain of `file`, until at least `n` clusters are
+   mapped or the end of the chain is reached */
+static int extmap_extend(struct fat_file *file, uint32_t n)
+{
+  struct fat *fat = file->fat;
+  struct fat_extmap *extmap = file->extmap;
+  struct vector *extents = &extmap->extents;
+  while (!extmap->complete && extmap->n_clust < n) {
+    struct fat_extent *ext = vector_at(extents, extents->size - 1);
+    if (!ext) {
+      /* start a new map at the first cluster */
+      if (file->clust < 2) {
+        extmap->complete = 1;
+        break;
+      }
+      struct fat_extent first = {0, file->clust, 1};
+      if (!vector_push_back(extents, 1, &first)) {
+        errno = ENOMEM;
+        return -1;
+      }
+      extmap->n_clust = 1;
+      continue;
+    }
+    uint32_t clust = ext->clust + ext->length - 1;
+    int e = advance_clust(fat, &clust);
+    if (e == -1)
+      return -1;
+    if (e == 0)
+      extmap->complete = 1;
+    else if (clust == ext->clust + ext->length)
+      ++ext->length;
+    else {
+      struct fat_extent next = {extmap->n_clust, clust, 1};
+      if (!vector_push_back(extents, 1, &next)) {
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+    if (e == 1)
+      ++extmap->n_clust;
+  }
+  return 0;
+}
+
+/* get the cluster at sequence index `clust_seq` in the extent map of `file`,
+   and optionally the number of consecutive clusters that follow it
+   (inclusive). `n` is a hint for how many clusters will be needed.
+   returns 1 on success, 0 on eof, -1 on error. */
+static int extmap_get(struct fat_file *file, uint32_t clust_seq, uint32_t n,
+                      uint32_t *clust, uint32_t *run)
+{
+  struct fat_extmap *extmap = file->extmap;
+  if (n == 0 || clust_seq + n < clust_seq)
+    n = 1;
+  if (extmap_extend(file, clust_seq + n))
+    return -1;
+  if (clust_seq >= extmap->n_clust)
+    return 0;
+  /* binary search for the extent that contains `clust_seq` */
+  struct vector *extents = &extmap->extents;
+  size_t lo = 0;
+  size_t hi = extents->size;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    struct fat_extent *ext = vector_at(extents, mid);
+    if (ext->clust_seq <= clust_seq)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  struct fat_extent *ext = vector_at(extents, lo);
+  uint32_t ext_off = clust_seq - ext->clust_seq;
+  *clust = ext->clust + ext_off;
+  if (run)
+    *run = ext->length - ext_off;
+  return 1;
+}
+
+/* discard all extents, the chain will be mapped again on demand */
+static void extmap_reset(struct fat_file *file)
+{
+  struct fat_extmap *extmap = file->extmap;
+  vector_clear(&extmap->extents);
+  extmap->n_clust = 0;
+  extmap->complete = 0;
+}
+
+/* truncate the extent map of `file` to its first `n` clusters, which
+   make up the entire cluster chain */
+static void extmap_truncate(struct fat_file *file, uint32_t n)
+{
+  struct fat_extmap *extmap = file->extmap;
+  struct vector *extents = &extmap->extents;
+  if (extmap->n_clust < n) {
+    /* the chain has been extended, pick up the new clusters lazily */
+    extmap->complete = 0;
+    return;
+  }
+  while (extents->size > 0) {
+    struct fat_extent *ext = vector_at(extents, extents->size - 1);
+    if (ext->clust_seq < n) {
+      ext->length = n - ext->clust_seq;
+      break;
+    }
+    vector_erase(extents, extents->size - 1, 1);
+  }
+  extmap->n_clust = n;
+  extmap->complete = 1;
+}
+
+/* initialize an extent map and attach it to `file`.
+   the map is only valid for copies of `file` and must be destroyed with
+   `fat_extmap_destroy`. */
+void fat_extmap_init(struct fat_file *file, struct fat_extmap *extmap)
+{
+  vector_init(&extmap->extents, sizeof(struct fat_extent));
+  file->extmap = extmap;
+  extmap_reset(file);
+}
+
+void fat_extmap_destroy(struct fat_extmap *extmap)
+{
+  vector_destroy(&extmap->extents);
+}
+
 /*
    basic file operations
 */
@@ -733,17 +1301,15 @@ static int file_sect(const struct fat_file *file, _Bool load)
 /* return a pointer to the data cache at the file offset in `file` */
 static void *file_data(const struct fat_file *file)
 {
-  struct fat *fat = file->fat;
-  struct fat_cache *cache = &fat->cache[FAT_CACHE_DATA];
-  uint32_t offset = file->p_sect_off;
-  offset += fat->n_sect_byte * (cache->prep_lba - cache->load_lba);
-  return &cache->data[offset];
+  char *data = cache_data(file->fat, FAT_CACHE_DATA);
+  return &data[file->p_sect_off];
 }
 
 /* point `file` to the beginning of the root directory */
 void fat_root(struct fat *fat, struct fat_file *file)
 {
   file->fat = fat;
+  file->extmap = NULL;
   file->clust = 0;
   if (fat->type == FAT32)
     file->size = 0;
@@ -760,6 +1326,7 @@ void fat_begin(struct fat_entry *entry, struct fat_file *file)
     fat_root(entry->fat, file);
   else {
     file->fat = entry->fat;
+    file->extmap = NULL;
     file->clust = entry->clust;
     file->size = entry->size;
     file->is_dir = entry->attrib & FAT_ATTRIB_DIRECTORY;
@@ -808,24 +1375,55 @@ uint32_t fat_advance(struct fat_file *file, uint32_t n_byte, _Bool *eof)
     uint32_t clust = file->p_clust;
     uint32_t clust_seq = file->p_clust_seq;
     uint32_t new_clust_seq = new_off / fat->n_clust_byte;
-    /* walk cluster chain */
-    while (clust_seq < new_clust_seq) {
-      int e = advance_clust(fat, &clust);
-      if (e == -1) {
-        if (eof)
-          *eof = 0;
-        return 0;
+    /* look up the target cluster in the extent map if there is one */
+    if (file->extmap) {
+      if (clust_seq < new_clust_seq) {
+        uint32_t seq = new_clust_seq;
+        int e = extmap_get(file, seq, 1, &clust, NULL);
+        /* if the end of the cluster chain is reached,
+           advance to the end of the last cluster */
+        if (e == 0) {
+          seq = clust_seq;
+          if (file->extmap->n_clust > 0) {
+            seq = file->extmap->n_clust - 1;
+            if (extmap_get(file, seq, 1, &clust, NULL) == -1)
+              e = -1;
+          }
+        }
+        if (e == -1) {
+          if (eof)
+            *eof = 0;
+          return 0;
+        }
+        p_off += (seq - clust_seq) * fat->n_clust_byte;
+        n_byte -= (seq - clust_seq) * fat->n_clust_byte;
+        clust_seq = seq;
+        if (e == 0) {
+          n_byte = fat->n_clust_byte;
+          ate = 1;
+        }
       }
-      /* if the end of the cluster chain is reached,
-         advance to the end of the last cluster */
-      if (e == 0) {
-        n_byte = fat->n_clust_byte;
-        ate = 1;
-        break;
+    }
+    /* walk cluster chain */
+    else {
+      while (clust_seq < new_clust_seq) {
+        int e = advance_clust(fat, &clust);
+        if (e == -1) {
+          if (eof)
+            *eof = 0;
+          return 0;
+        }
+        /* if the end of the cluster chain is reached,
+           advance to the end of the last cluster */
+        if (e == 0) {
+          n_byte = fat->n_clust_byte;
+          ate = 1;
+          break;
+        }
+        p_off += fat->n_clust_byte;
+        n_byte -= fat->n_clust_byte;
+        ++clust_seq;
       }
-      p_off += fat->n_clust_byte;
-      n_byte -= fat->n_clust_byte;
-      ++clust_seq;
     }
     file->p_clust = clust;
     file->p_clust_seq = clust_seq;
@@ -847,17 +1445,53 @@ uint32_t fat_advance(struct fat_file *file, uint32_t n_byte, _Bool *eof)
   return p_off - old_off;
 }
 
+/* transfer a list of segments, through the vectored interface if the
+   device has one. each segment is counted as a request, since the list is
+   not known to be transferred as one */
+static int dev_rw_v(struct fat *fat, enum fat_rw rw,
+                    const struct fat_iovec *iov, int n_iov)
+{
+  fat_iov_proc proc = rw == FAT_READ ? fat->readv : fat->writev;
+  if (proc) {
+    for (int i = 0; i < n_iov; ++i) {
+      if (rw == FAT_READ) {
+        ++fat->n_read;
+        fat->n_read_sect += iov[i].n_block;
+      }
+      else {
+        ++fat->n_write;
+        fat->n_write_sect += iov[i].n_block;
+      }
+    }
+    return proc(iov, n_iov);
+  }
+  for (int i = 0; i < n_iov; ++i) {
+    int e;
+    if (rw == FAT_READ)
+      e = dev_read(fat, iov[i].lba, iov[i].n_block, iov[i].buf);
+    else
+      e = dev_write(fat, iov[i].lba, iov[i].n_block, iov[i].buf);
+    if (e)
+      return e;
+  }
+  return 0;
+}
+
 /* copy multiple clusters to or from a file and advance.
-   assumes the file is pointed at the start of a cluster. */
+   assumes the file is pointed at the start of a cluster.
+   consecutive cluster chunks are gathered into segment lists of up to
+   FAT_IOV_MAX entries, which are handed to the device together. */
 static uint32_t clust_rw(struct fat_file *file, enum fat_rw rw, void *buf,
                          uint32_t n_clust, _Bool *eof)
 {
   struct fat *fat = file->fat;
   char *p = buf;
-  /* flush and invalidate data cache to prevent conflicts */
-  if (cache_flush(fat, FAT_CACHE_DATA))
-    return 0;
-  cache_inval(fat, FAT_CACHE_DATA);
+  /* pending segment list and the file pointer after it completes */
+  struct fat_iovec iov[FAT_IOV_MAX];
+  int n_iov = 0;
+  struct fat_file next = *file;
+  uint32_t n_next = 0;
+  _Bool ate = 0;
   /* treat reserved clusters as the root directory */
   uint32_t clust = file->p_clust;
   if (clust < 2)
@@ -867,45 +1501,87 @@ static uint32_t clust_rw(struct fat_file *file, enum fat_rw rw, void *buf,
   while (n_clust > 0) {
     uint32_t chunk_start = clust;
     uint32_t chunk_length = 1;
-    /* compute consecutive cluster chunk length */
-    while (1) {
-      uint32_t p_clust = clust;
-      if (get_clust(fat, clust, &clust))
-        return n_copy;
-      if (clust >= 0x0FFFFFF7 || clust != p_clust + 1 ||
-          chunk_length >= n_clust)
+    /* get consecutive cluster chunk from the extent map */
+    if (file->extmap) {
+      uint32_t clust_seq = next.p_clust_seq;
+      if (extmap_get(file, clust_seq, n_clust,
+                     &chunk_start, &chunk_length) != 1)
       {
         break;
       }
-      ++chunk_length;
+      if (chunk_length > n_clust)
+        chunk_length = n_clust;
+      int e = extmap_get(file, clust_seq + chunk_length, 1, &clust, NULL);
+      if (e == -1)
+        break;
+      if (e == 0)
+        clust = 0x0FFFFFFF;
     }
-    /* copy chunk */
+    /* compute consecutive cluster chunk length */
+    else {
+      _Bool err = 0;
+      while (1) {
+        uint32_t p_clust = clust;
+        if (get_clust(fat, clust, &clust)) {
+          err = 1;
+          break;
+        }
+        if (clust >= 0x0FFFFFF7 || clust != p_clust + 1 ||
+            chunk_length >= n_clust)
+        {
+          break;
+        }
+        ++chunk_length;
+      }
+      if (err)
+        break;
+    }
+    /* add chunk to the segment list */
     uint32_t lba = fat->data_lba + fat->n_clust_sect * (chunk_start - 2);
     uint32_t n_block = fat->n_clust_sect * chunk_length;
     uint32_t n_byte = n_block * fat->n_sect_byte;
-    int e;
-    if (rw == FAT_READ)
-      e = fat->read(lba, n_block, p);
-    else
-      e = fat->write(lba, n_block, p);
-    if (e)
+    /* flush and invalidate cached sectors in the chunk to prevent conflicts */
+    if (cache_evict(fat, FAT_CACHE_DATA, lba, n_block))
       break;
+    iov[n_iov].lba = lba;
+    iov[n_iov].n_block = n_block;
+    iov[n_iov].buf = p;
+    ++n_iov;
     n_clust -= chunk_length;
-    n_copy += chunk_length;
-    file->p_off += n_byte;
-    file->p_clust_seq += chunk_length;
+    n_next += chunk_length;
+    next.p_off += n_byte;
     if (clust < 2 || clust >= 0x0FFFFFF7) {
-      file->p_clust_sect = fat->n_clust_sect - 1;
-      file->p_sect_off = fat->n_sect_byte;
-      if (eof)
-        *eof = 1;
-      break;
+      /* point to the end of the last cluster in the chain */
+      next.p_clust = chunk_start + chunk_length - 1;
+      next.p_clust_seq += chunk_length - 1;
+      next.p_clust_sect = fat->n_clust_sect - 1;
+      next.p_sect_off = fat->n_sect_byte;
+      ate = 1;
     }
     else {
-      file->p_clust = clust;
+      next.p_clust = clust;
+      next.p_clust_seq += chunk_length;
       p += n_byte;
     }
+    /* transfer the segment list when it's full or complete */
+    if (n_iov == FAT_IOV_MAX || n_clust == 0 || ate) {
+      if (dev_rw_v(fat, rw, iov, n_iov))
+        return n_copy;
+      *file = next;
+      n_copy += n_next;
+      n_iov = 0;
+      n_next = 0;
+      if (ate)
+        break;
+    }
+  }
+  /* transfer any chunks gathered before an error */
+  if (n_iov > 0 && dev_rw_v(fat, rw, iov, n_iov) == 0) {
+    *file = next;
+    n_copy += n_next;
   }
+  if (ate && eof)
+    *eof = 1;
   return n_copy;
 }
 
@@ -939,8 +1615,9 @@ uint32_t fat_rw(struct fat_file *file, enum fat_rw rw, void *buf,
   char *p = buf;
   uint32_t n_copy = 0;
   while (n_byte > 0) {
-    /* write cluster chunks if possible */
-    if (!no_clust && n_byte >= fat->n_clust_byte &&
+    /* write cluster chunks if possible (a null buffer needs the cache to
+       skip or zero-fill) */
+    if (p && !no_clust && n_byte >= fat->n_clust_byte &&
         pos.p_clust_sect == 0 && pos.p_sect_off == 0)
     {
       uint32_t n_clust = n_byte / fat->n_clust_byte;
@@ -1154,6 +1831,7 @@ static void begin_dir(struct fat *fat, struct fat_file *file, uint32_t clust)
     fat_root(fat, file);
   else {
     file->fat = fat;
+    file->extmap = NULL;
     file->clust = clust;
     file->size = 0;
     file->is_dir = 1;
@@ -1161,25 +1839,138 @@ static void begin_dir(struct fat *fat, struct fat_file *file, uint32_t clust)
   }
 }
 
-/* find a directory entry by name */
-static int dir_find(struct fat *fat, uint32_t clust, const char *name,
-                    struct fat_entry *entry)
+/* get the directory index key for the directory at `clust` */
+static uint32_t dir_key(struct fat *fat, uint32_t clust)
 {
+  if (clust < 2 && fat->type == FAT32)
+    return fat->root_clust;
+  return clust;
+}
+
+/* insert an entry offset into a directory index table */
+static void dir_index_put(struct fat_dir_index *index, uint32_t hash,
+                          uint32_t p_off)
+{
+  uint32_t mask = index->n_slot - 1;
+  uint32_t i = hash & mask;
+  while (index->slot[i].p_off != FAT_DIR_SLOT_EMPTY)
+    i = (i + 1) & mask;
+  index->slot[i].hash = hash;
+  index->slot[i].p_off = p_off;
+}
+
+/* drop the index of the directory at `clust` */
+static void dir_index_inval(struct fat *fat, uint32_t clust)
+{
+  uint32_t key = dir_key(fat, clust);
+  for (int i = 0; i < FAT_DIR_CACHE_MAX; ++i) {
+    struct fat_dir_index *index = &fat->dir_index[i];
+    if (index->slot && index->clust == key) {
+      free(index->slot);
+      index->slot = NULL;
+      index->n_slot = 0;
+    }
+  }
+}
+
+/* get the index of the directory at `clust`, building it if needed.
+   returns null if the index could not be built. */
+static struct fat_dir_index *dir_index_get(struct fat *fat, uint32_t clust)
+{
+  uint32_t key = dir_key(fat, clust);
+  /* look for a cached index, or pick the least recently used one */
+  struct fat_dir_index *index = NULL;
+  for (int i = 0; i < FAT_DIR_CACHE_MAX; ++i) {
+    struct fat_dir_index *i_index = &fat->dir_index[i];
+    if (i_index->slot && i_index->clust == key) {
+      i_index->lru = ++fat->dir_clock;
+      return i_index;
+    }
+    if (!index || !i_index->slot ||
+        (index->slot && i_index->lru < index->lru))
+    {
+      index = i_index;
+    }
+  }
+  /* collect the name hashes of all entries, both lfn and sfn are
+     indexed since lookups can match against either */
+  struct vector ents;
+  vector_init(&ents, sizeof(struct fat_dir_slot));
   struct fat_file pos;
   begin_dir(fat, &pos, clust);
-  _Bool is_sfn = name_is_sfn(name, NULL, NULL);
   struct fat_entry ent;
   int e = errno;
   errno = 0;
   while (fat_dir(&pos, &ent) == 0) {
     if (ent.attrib & FAT_ATTRIB_LABEL)
       continue;
-    _Bool match;
-    if (is_sfn)
-      match = name_comp(name, ent.short_name);
-    else
-      match = name_comp(name, ent.name);
-    if (match) {
+    struct fat_dir_slot slot;
+    slot.hash = name_hash(ent.short_name);
+    slot.p_off = ent.first.p_off;
+    if (!vector_push_back(&ents, 1, &slot))
+      goto error;
+    uint32_t hash = name_hash(ent.name);
+    if (hash != slot.hash) {
+      slot.hash = hash;
+      if (!vector_push_back(&ents, 1, &slot))
+        goto error;
+    }
+  }
+  if (errno != 0)
+    goto error;
+  /* build table, keeping the load factor at or below one half */
+  uint32_t n_slot = 8;
+  while (n_slot < ents.size * 2)
+    n_slot *= 2;
+  struct fat_dir_slot *slot = malloc(sizeof(*slot) * n_slot);
+  if (!slot)
+    goto error;
+  if (index->slot)
+    free(index->slot);
+  index->clust = key;
+  index->lru = ++fat->dir_clock;
+  index->n_slot = n_slot;
+  index->slot = slot;
+  for (uint32_t i = 0; i < n_slot; ++i)
+    slot[i].p_off = FAT_DIR_SLOT_EMPTY;
+  for (size_t i = 0; i < ents.size; ++i) {
+    struct fat_dir_slot *ent_slot = vector_at(&ents, i);
+    dir_index_put(index, ent_slot->hash, ent_slot->p_off);
+  }
+  vector_destroy(&ents);
+  errno = e;
+  return index;
+error:
+  /* leave it to the caller to scan the directory */
+  vector_destroy(&ents);
+  errno = e;
+  return NULL;
+}
+
+/* check if `name` refers to `entry` */
+static _Bool dir_match(const char *name, _Bool is_sfn,
+                       struct fat_entry *entry)
+{
+  if (entry->attrib & FAT_ATTRIB_LABEL)
+    return 0;
+  if (is_sfn)
+    return name_comp(name, entry->short_name);
+  else
+    return name_comp(name, entry->name);
+}
+
+/* find a directory entry by name with a linear scan */
+static int dir_scan(struct fat *fat, uint32_t clust, const char *name,
+                    struct fat_entry *entry)
+{
+  struct fat_file pos;
+  begin_dir(fat, &pos, clust);
+  _Bool is_sfn = name_is_sfn(name, NULL, NULL);
+  struct fat_entry ent;
+  int e = errno;
+  errno = 0;
+  while (fat_dir(&pos, &ent) == 0) {
+    if (dir_match(name, is_sfn, &ent)) {
       if (entry)
         *entry = ent;
       errno = e;
@@ -1191,6 +1982,47 @@ static int dir_find(struct fat *fat, uint32_t clust, const char *name,
   return -1;
 }
 
+/* find a directory entry by name */
+static int dir_find(struct fat *fat, uint32_t clust, const char *name,
+                    struct fat_entry *entry)
+{
+  struct fat_dir_index *index = dir_index_get(fat, clust);
+  if (!index)
+    return dir_scan(fat, clust, name, entry);
+  _Bool is_sfn = name_is_sfn(name, NULL, NULL);
+  uint32_t hash = name_hash(name);
+  uint32_t mask = index->n_slot - 1;
+  int e = errno;
+  errno = 0;
+  for (uint32_t i = hash & mask; index->slot[i].p_off != FAT_DIR_SLOT_EMPTY;
+       i = (i + 1) & mask)
+  {
+    if (index->slot[i].hash != hash)
+      continue;
+    /* read the entry at the indexed location */
+    uint32_t p_off = index->slot[i].p_off;
+    struct fat_file pos;
+    struct fat_entry ent;
+    begin_dir(fat, &pos, clust);
+    if (fat_advance(&pos, p_off, NULL) != p_off || fat_dir(&pos, &ent)) {
+      if (errno != 0)
+        return -1;
+      /* the index is out of date, fall back to scanning */
+      dir_index_inval(fat, clust);
+      errno = e;
+      return dir_scan(fat, clust, name, entry);
+    }
+    if (dir_match(name, is_sfn, &ent)) {
+      if (entry)
+        *entry = ent;
+      errno = e;
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
 /* point an entry structure to the root directory */
 static void make_root(struct fat *fat, struct fat_entry *entry)
 {
@@ -1470,6 +2302,8 @@ static int dir_insert(struct fat *fat, uint32_t dir_clust, const char *name,
       set_word(lfn_ent_buf, 0x1A, 2, 0x0000);
     }
   }
+  /* the directory index does not track insertions */
+  dir_index_inval(fat, dir_clust);
   /* initialize search position */
   struct fat_file start;
   struct fat_file pos;
@@ -1496,6 +2330,9 @@ static int dir_insert(struct fat *fat, uint32_t dir_clust, const char *name,
       {
         return -1;
       }
+      /* move the position from the end of the old chain onto the new
+         cluster, so that entry pointers don't refer to the end state */
+      fat_advance(&pos, 0, NULL);
       continue;
     }
     /* check entry */
@@ -1608,6 +2445,7 @@ static int dir_insert(struct fat *fat, uint32_t dir_clust, const char *name,
 static int dir_remove(struct fat_entry *entry)
 {
   struct fat *fat = entry->fat;
+  dir_index_inval(fat, entry->first.clust);
   struct fat_file pos = entry->first;
   while (pos.p_off <= entry->last.p_off) {
     if (file_sect(&pos, 1))
@@ -1802,10 +2640,13 @@ int fat_resize(struct fat_entry *entry, uint32_t size, struct fat_file *file)
   if (size == entry->size)
     return 0;
   /* allocate a cluster if the file is empty */
-  uint32_t n_clust = (size + fat->n_clust_byte - 1) / fat->n_clust_byte;
+  uint32_t n_clust = size_clust(fat, size);
   uint32_t clust = entry->clust;
   uint32_t chunk_length = 0;
   if (size > 0 && clust < 2) {
+    /* check for space first to avoid leaking the first cluster */
+    if (check_free_space(fat, n_clust))
+      return -1;
     clust = find_free_clust(fat, 0, n_clust, &chunk_length);
     if (clust == 0)
       return -1;
@@ -1832,6 +2673,12 @@ int fat_resize(struct fat_entry *entry, uint32_t size, struct fat_file *file)
   cache_dirty(fat, FAT_CACHE_DATA);
    /* update file pointer */
   if (file) {
+    if (file->extmap) {
+      if (file->clust != entry->clust)
+        extmap_reset(file);
+      else
+        extmap_truncate(file, n_clust);
+    }
     file->size = entry->size;
     if (file->size == 0 || file->clust < 2) {
       file->clust = entry->clust;
@@ -1843,6 +2690,66 @@ int fat_resize(struct fat_entry *entry, uint32_t size, struct fat_file *file)
   return 0;
 }
 
+/* grow `entry` to at least `size` (must be a file), allocating the new
+   clusters as a single contiguous run if possible. `file` is treated as
+   in `fat_resize`. */
+int fat_prealloc(struct fat_entry *entry, uint32_t size,
+                 struct fat_file *file)
+{
+  struct fat *fat = entry->fat;
+  /* sanity check */
+  if (entry->attrib & FAT_ATTRIB_DIRECTORY) {
+    errno = EISDIR;
+    return -1;
+  }
+  if (entry->attrib & FAT_ATTRIB_LABEL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (size <= entry->size)
+    return 0;
+  /* an empty file gets a contiguous chain from `fat_resize` if possible,
+     otherwise try to append a contiguous run to the existing chain */
+  uint32_t n_clust = size_clust(fat, size);
+  uint32_t n_old_clust = size_clust(fat, entry->size);
+  if (entry->clust >= 2 && n_old_clust > 0 && n_clust > n_old_clust) {
+    uint32_t n_new_clust = n_clust - n_old_clust;
+    if (check_free_space(fat, n_new_clust))
+      return -1;
+    /* find the last cluster in the chain */
+    uint32_t last_clust = entry->clust;
+    for (uint32_t i = 1; i < n_old_clust; ++i) {
+      int e = advance_clust(fat, &last_clust);
+      if (e == -1)
+        return -1;
+      if (e == 0)
+        break;
+    }
+    /* prefer the clusters that directly follow the chain */
+    uint32_t run_clust = last_clust + 1;
+    uint32_t run_length = check_free_chunk_length(fat, run_clust,
+                                                  n_new_clust);
+    if (run_length < n_new_clust) {
+      run_clust = find_free_clust(fat, 0, n_new_clust, &run_length);
+      if (run_clust == 0)
+        return -1;
+    }
+    /* link the run if it's large enough, otherwise leave the allocation
+       to `fat_resize` */
+    if (run_length == n_new_clust) {
+      for (uint32_t i = 0; i < n_new_clust; ++i) {
+        uint32_t clust = run_clust + i;
+        uint32_t next = i == n_new_clust - 1 ? 0x0FFFFFFF : clust + 1;
+        if (set_clust(fat, clust, next))
+          return -1;
+      }
+      if (link_clust(fat, last_clust, run_clust, 0))
+        return -1;
+    }
+  }
+  return fat_resize(entry, size, file);
+}
+
 /* check if a directory is empty */
 int fat_empty(struct fat *fat, struct fat_entry *dir)
 {
@@ -1988,6 +2895,8 @@ int fat_remove(struct fat_entry *entry)
     return -1;
   /* free cluster chain */
   if (entry->clust >= 2) {
+    if (entry->attrib & FAT_ATTRIB_DIRECTORY)
+      dir_index_inval(fat, entry->clust);
     if (resize_clust_chain(fat, entry->clust, 0, 0))
       return -1;
   }
@@ -2104,15 +3013,51 @@ static int check_rec(struct fat *fat, uint32_t rec_lba, int part)
   return 0;
 }
 
+/* load the fsinfo sector, returns null if there is no valid fsinfo sector */
+static void *get_fsis(struct fat *fat)
+{
+  if (fat->type != FAT32 || fat->fsis_lba == 0 ||
+      fat->fsis_lba >= fat->n_resv_sect)
+  {
+    return NULL;
+  }
+  int e = errno;
+  void *fsis = cache_prep(fat, FAT_CACHE_DATA, fat->part_lba + fat->fsis_lba, 1);
+  errno = e;
+  if (!fsis)
+    return NULL;
+  /* check signatures */
+  if (get_word(fsis, 0x000, 4) != 0x41615252 ||
+      get_word(fsis, 0x1E4, 4) != 0x61417272 ||
+      get_word(fsis, 0x1FC, 4) != 0xAA550000)
+  {
+    return NULL;
+  }
+  return fsis;
+}
+
 int fat_init(struct fat *fat, fat_io_proc read, fat_io_proc write,
              uint32_t rec_lba, int part)
 {
   /* initialize cache */
   fat->read = read;
   fat->write = write;
+  fat->readv = NULL;
+  fat->writev = NULL;
+  fat_reset_stats(fat);
   for (int i = 0; i < FAT_CACHE_MAX; ++i) {
-    fat->cache[i].valid = 0;
-    fat->cache[i].max_lba = 0xFFFFFFFF;
+    struct fat_cache *cache = &fat->cache[i];
+    cache->max_lba = 0xFFFFFFFF;
+    cache->prep_block = NULL;
+    cache->lru_clock = 0;
+    cache_inval(fat, i);
+  }
+  fat->n_free_log = 0;
+  /* initialize directory indices */
+  fat->dir_clock = 0;
+  for (int i = 0; i < FAT_DIR_CACHE_MAX; ++i) {
+    fat->dir_index[i].n_slot = 0;
+    fat->dir_index[i].slot = NULL;
   }
   /* check partition record for compatible partition */
   if (check_rec(fat, rec_lba, part)) {
@@ -2129,6 +3074,7 @@ int fat_init(struct fat *fat, fat_io_proc read, fat_io_proc write,
   fat->n_clust_sect = get_word(pbr, 0x00D, 1);
   fat->n_resv_sect = get_word(pbr, 0x00E, 2);
   fat->n_fat = get_word(pbr, 0x010, 1);
+  uint16_t ext_flags = get_word(pbr, 0x028, 2);
   fat->n_entry = get_word(pbr, 0x011, 2);
   fat->n_fs_sect = get_word(pbr, 0x013, 2);
   if (fat->n_fs_sect == 0)
@@ -2185,6 +3131,15 @@ int fat_init(struct fat *fat, fat_io_proc read, fat_io_proc write,
     n_fat_clust /= 4;
   if (fat->max_clust > n_fat_clust)
     fat->max_clust = n_fat_clust;
+  /* fat32 can disable mirroring and use a single active FAT */
+  fat->fat_mirror = fat->n_fat > 1 &&
+                    !(fat->type == FAT32 && (ext_flags & 0x0080));
+  if (fat->type == FAT32 && (ext_flags & 0x0080) &&
+      (ext_flags & 0x000F) < fat->n_fat)
+  {
+    fat->fat_lba += (ext_flags & 0x000F) * fat->n_fat_sect;
+    fat->cache[FAT_CACHE_FAT].max_lba = fat->fat_lba + fat->n_fat_sect;
+  }
   /* get fat32 info */
   if (fat->type == FAT32) {
     fat->root_clust = get_word(pbr, 0x02C, 4);
@@ -2201,14 +3156,156 @@ int fat_init(struct fat *fat, fat_io_proc read, fat_io_proc write,
     errno = ENOENT;
     return -1;
   }
+  /* initialize free space info, seed from the fsinfo sector if available */
+  fat->n_free = FAT_FREE_UNKNOWN;
+  fat->free_scanned = 0;
+  fat->free_checked = 0;
+  fat->fsis_dirty = 0;
+  for (int i = 0; i < FAT_FREE_EXT_MAX; ++i)
+    fat->free_ext[i].length = 0;
+  void *fsis = get_fsis(fat);
+  if (fsis) {
+    uint32_t n_free = get_word(fsis, 0x1E8, 4);
+    uint32_t next_free = get_word(fsis, 0x1EC, 4);
+    /* discard counts that can't be right for this volume */
+    if (n_free <= fat->max_clust - 2)
+      fat->n_free = n_free;
+    if (next_free >= 2 && next_free < fat->max_clust)
+      fat->free_lb = next_free;
+  }
   return 0;
 }
 
+/* release the memory held by a file system set up with `fat_init`.
+   `fat_init` may be called again afterwards */
+void fat_destroy(struct fat *fat)
+{
+  for (int i = 0; i < FAT_DIR_CACHE_MAX; ++i) {
+    struct fat_dir_index *index = &fat->dir_index[i];
+    if (index->slot) {
+      free(index->slot);
+      index->slot = NULL;
+      index->n_slot = 0;
+    }
+  }
+}
+
 int fat_flush(struct fat *fat)
 {
+  if (meta_commit(fat))
+    return -1;
+  /* update fsinfo sector */
+  if (fat->fsis_dirty) {
+    void *fsis = get_fsis(fat);
+    if (fsis) {
+      set_word(fsis, 0x1E8, 4, fat->n_free);
+      set_word(fsis, 0x1EC, 4, fat->free_lb);
+      cache_dirty(fat, FAT_CACHE_DATA);
+    }
+    fat->fsis_dirty = 0;
+  }
   for (int i = 0; i < FAT_CACHE_MAX; ++i) {
     if (cache_flush(fat, i))
       return -1;
   }
+  return mirror_sync(fat);
+}
+
+/* create an empty FAT12 or FAT16 file system with a single FAT on a
+   logical volume of `n_sect` sectors */
+int fat_mkfs(fat_io_proc write, uint32_t n_sect)
+{
+  const uint32_t n_entry = 0x200;
+  const uint32_t n_root_sect = n_entry * 0x20 / 0x200;
+  /* find the smallest cluster size that can address the volume */
+  uint32_t n_clust_sect;
+  uint32_t n_fat_sect;
+  uint32_t n_clust = 0;
+  enum fat_type type = FAT12;
+  for (n_clust_sect = 1; n_clust_sect <= 0x80; n_clust_sect *= 2) {
+    n_fat_sect = 1;
+    for (;;) {
+      uint32_t n_meta_sect = 1 + n_fat_sect + n_root_sect;
+      if (n_sect <= n_meta_sect + n_clust_sect) {
+        n_clust = 0;
+        break;
+      }
+      n_clust = (n_sect - n_meta_sect) / n_clust_sect;
+      type = n_clust < 0xFF5 ? FAT12 : FAT16;
+      uint32_t n_fat_byte = type == FAT12 ? (n_clust + 2) * 3 / 2 + 1 :
+                                            (n_clust + 2) * 2;
+      uint32_t n_need = (n_fat_byte + 0x1FF) / 0x200;
+      if (n_need <= n_fat_sect)
+        break;
+      n_fat_sect = n_need;
+    }
+    if (n_clust != 0 && n_clust < 0xFFF5)
+      break;
+  }
+  if (n_clust_sect > 0x80 || n_clust == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* write boot record */
+  _Alignas(0x10) char sect[0x200];
+  memset(sect, 0, sizeof(sect));
+  memcpy(&sect[0x000], "\xEB\x3C\x90gz      ", 11);
+  set_word(sect, 0x00B, 2, 0x200);
+  set_word(sect, 0x00D, 1, n_clust_sect);
+  set_word(sect, 0x00E, 2, 1);
+  set_word(sect, 0x010, 1, 1);
+  set_word(sect, 0x011, 2, n_entry);
+  if (n_sect < 0x10000)
+    set_word(sect, 0x013, 2, n_sect);
+  else
+    set_word(sect, 0x020, 4, n_sect);
+  set_word(sect, 0x015, 1, 0xF8);
+  set_word(sect, 0x016, 2, n_fat_sect);
+  set_word(sect, 0x026, 1, 0x29);
+  memcpy(&sect[0x02B], "NO NAME    ", 11);
+  memcpy(&sect[0x036], type == FAT12 ? "FAT12   " : "FAT16   ", 8);
+  set_word(sect, 0x1FE, 2, 0xAA55);
+  if (write(0, 1, sect))
+    return -1;
+  /* write FAT, with the media descriptor and end-of-chain marker in the
+     reserved entries */
+  for (uint32_t i = 0; i < n_fat_sect; ++i) {
+    memset(sect, 0, sizeof(sect));
+    if (i == 0) {
+      if (type == FAT12)
+        set_word(sect, 0, 3, 0xFFFFF8);
+      else
+        set_word(sect, 0, 4, 0xFFFFFFF8);
+    }
+    if (write(1 + i, 1, sect))
+      return -1;
+  }
+  /* clear root directory */
+  memset(sect, 0, sizeof(sect));
+  for (uint32_t i = 0; i < n_root_sect; ++i) {
+    if (write(1 + n_fat_sect + i, 1, sect))
+      return -1;
+  }
   return 0;
 }
+
+/* set the optional vectored io interface, used for multi-cluster
+   transfers in place of the block io interface */
+void fat_set_iov(struct fat *fat, fat_iov_proc readv, fat_iov_proc writev)
+{
+  fat->readv = readv;
+  fat->writev = writev;
+}
+
+/* clear cache and device io statistics */
+void fat_reset_stats(struct fat *fat)
+{
+  for (int i = 0; i < FAT_CACHE_MAX; ++i) {
+    fat->cache[i].n_hit = 0;
+    fat->cache[i].n_miss = 0;
+  }
+  fat->n_read = 0;
+  fat->n_read_sect = 0;
+  fat->n_write = 0;
+  fat->n_write_sect = 0;
+}
@@ -3,13 +3,26 @@
 #include <stdint.h>
 #include <time.h>
 #include <list/list.h>
+#include <vector/vector.h>
 
 #define FAT_MAX_CACHE_SECT    4
+#define FAT_CACHE_SETS        4
+#define FAT_CACHE_WAYS        2
 
 #define FAT_CACHE_FAT         0
 #define FAT_CACHE_DATA        1
 #define FAT_CACHE_MAX         2
 
+#define FAT_FREE_EXT_MAX      16
+#define FAT_FREE_SCAN_MAX     0x1000
+#define FAT_FREE_UNKNOWN      0xFFFFFFFF
+#define FAT_FREE_LOG_MAX      16
+
+#define FAT_IOV_MAX           8
+
+#define FAT_DIR_CACHE_MAX     4
+#define FAT_DIR_SLOT_EMPTY    0xFFFFFFFF
+
 #define FAT_ATTRIB_DEFAULT    0x00
 #define FAT_ATTRIB_READONLY   0x01
 #define FAT_ATTRIB_HIDDEN     0x02
@@ -32,20 +45,67 @@ enum fat_rw
   FAT_WRITE,
 };
 
-/* block cache */
-struct fat_cache
+/* cache block, holds up to FAT_MAX_CACHE_SECT sectors aligned to
+   FAT_MAX_CACHE_SECT, with per-sector valid and dirty bits, and for the
+   FAT cache, bits for sectors that are yet to be copied to the mirrors */
+struct fat_cache_block
 {
-  _Bool     valid;
-  _Bool     dirty;
-  uint32_t  max_lba;
+  uint8_t   valid;
+  uint8_t   dirty;
+  uint8_t   sync;
   uint32_t  load_lba;
-  uint32_t  prep_lba;
-  int       n_sect;
+  uint32_t  lru;
   _Alignas(0x10)
   char      data[0x200 * FAT_MAX_CACHE_SECT];
 };
 
+/* set-associative block cache with lru replacement */
+struct fat_cache
+{
+  uint32_t                max_lba;
+  struct fat_cache_block *prep_block;
+  uint32_t                prep_lba;
+  uint32_t                lru_clock;
+  /* statistics */
+  uint32_t                n_hit;
+  uint32_t                n_miss;
+  struct fat_cache_block  block[FAT_CACHE_SETS * FAT_CACHE_WAYS];
+};
+
+/* run of free clusters */
+struct fat_free_ext
+{
+  uint32_t  clust;
+  uint32_t  length;
+};
+
+/* directory index slot, maps a name hash to an entry offset */
+struct fat_dir_slot
+{
+  uint32_t  hash;
+  uint32_t  p_off;
+};
+
+/* name hash index of a directory, built on the first lookup */
+struct fat_dir_index
+{
+  uint32_t              clust;
+  uint32_t              lru;
+  /* open addressing table, size is a power of two */
+  uint32_t              n_slot;
+  struct fat_dir_slot  *slot;
+};
+
+/* io segment for vectored transfers */
+struct fat_iovec
+{
+  uint32_t  lba;
+  uint32_t  n_block;
+  void     *buf;
+};
+
 typedef int (*fat_io_proc)(uint32_t lba, uint32_t n_block, void *buf);
+typedef int (*fat_iov_proc)(const struct fat_iovec *iov, int n_iov);
 
 /* fat context */
 struct fat
@@ -53,6 +113,9 @@ struct fat
   /* block io interface */
   fat_io_proc       read;
   fat_io_proc       write;
+  /* optional vectored io interface */
+  fat_iov_proc      readv;
+  fat_iov_proc      writev;
   /* file system info */
   enum fat_type     type;
   uint32_t          part_lba;
@@ -61,6 +124,7 @@ struct fat
   uint8_t           n_clust_sect;
   uint16_t          n_resv_sect;
   uint8_t           n_fat;
+  _Bool             fat_mirror;
   uint16_t          n_entry;
   uint32_t          n_fs_sect;
   uint32_t          n_fat_sect;
@@ -72,14 +136,51 @@ struct fat
   uint32_t          n_clust_byte;
   uint32_t          max_clust;
   uint32_t          free_lb;
+  /* free space summary */
+  uint32_t          n_free;
+  _Bool             free_scanned;
+  _Bool             free_checked;
+  _Bool             fsis_dirty;
+  struct fat_free_ext free_ext[FAT_FREE_EXT_MAX];
+  /* clusters to be freed when metadata is committed */
+  int               n_free_log;
+  struct fat_free_ext free_log[FAT_FREE_LOG_MAX];
+  /* directory indices */
+  uint32_t          dir_clock;
+  struct fat_dir_index dir_index[FAT_DIR_CACHE_MAX];
   /* cache */
   struct fat_cache  cache[FAT_CACHE_MAX];
+  /* device io statistics */
+  uint32_t          n_read;
+  uint32_t          n_read_sect;
+  uint32_t          n_write;
+  uint32_t          n_write_sect;
+};
+
+/* run of consecutive clusters in a cluster chain */
+struct fat_extent
+{
+  uint32_t          clust_seq;
+  uint32_t          clust;
+  uint32_t          length;
+};
+
+/* extent map, lazily built from the cluster chain of a file */
+struct fat_extmap
+{
+  struct vector     extents;
+  /* number of clusters mapped */
+  uint32_t          n_clust;
+  /* end of chain has been reached */
+  _Bool             complete;
 };
 
 /* file pointer */
 struct fat_file
 {
   struct fat       *fat;
+  /* optional extent map, shared by copies of the file pointer */
+  struct fat_extmap *extmap;
   /* file info */
   uint32_t          clust;
   uint32_t          size;
@@ -144,6 +245,8 @@ struct fat_path  *fat_create_path(struct fat *fat, struct fat_path *dir_fp,
                                   const char *path, uint8_t attrib);
 int               fat_resize(struct fat_entry *entry, uint32_t size,
                              struct fat_file *file);
+int               fat_prealloc(struct fat_entry *entry, uint32_t size,
+                               struct fat_file *file);
 int               fat_empty(struct fat *fat, struct fat_entry *dir);
 int               fat_rename(struct fat *fat, struct fat_path *entry_fp,
                              struct fat_path *dir_fp, const char *path,
@@ -154,6 +257,14 @@ int               fat_atime(struct fat_entry *entry, time_t timeval);
 int               fat_mtime(struct fat_entry *entry, time_t timeval);
 int               fat_init(struct fat *fat, fat_io_proc read,
                            fat_io_proc write, uint32_t rec_lba, int part);
+void              fat_destroy(struct fat *fat);
 int               fat_flush(struct fat *fat);
+int               fat_mkfs(fat_io_proc write, uint32_t n_sect);
+void              fat_set_iov(struct fat *fat, fat_iov_proc readv,
+                              fat_iov_proc writev);
+void              fat_reset_stats(struct fat *fat);
+void              fat_extmap_init(struct fat_file *file,
+                                  struct fat_extmap *extmap);
+void              fat_extmap_destroy(struct fat_extmap *extmap);
 
 #endif
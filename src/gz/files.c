@@ -3,6 +3,7 @@
 #include <string.h>
 #include <set/set.h>
 #include <vector/vector.h>
+#include "bgio.h"
 #include "files.h"
 #include "menu.h"
 #include "osk.h"
@@ -437,6 +438,7 @@ static void clear_proc(struct menu_item *item, void *data)
 
 static void reset_proc(struct menu_item *item, void *data)
 {
+  bgio_sync();
   sys_reset();
   vector_clear(&gf_dir_state);
   struct dir_state *ds = vector_insert(&gf_dir_state, 0, 1, NULL);
@@ -535,6 +537,8 @@ void menu_get_file(struct menu *menu, enum get_file_mode mode,
                    const char *defname, const char *suffix,
                    get_file_callback_t callback_proc, void *callback_data)
 {
+  /* finish background writes first, so that the files are listed whole */
+  bgio_sync();
   gf_mode = mode;
   if (gf_suffix)
     free(gf_suffix);
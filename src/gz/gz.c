@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
@@ -6,6 +7,7 @@
 #include <mips.h>
 #include <n64.h>
 #include <vector/vector.h>
+#include "bgio.h"
 #include "explorer.h"
 #include "geometry.h"
 #include "gfx.h"
@@ -17,6 +19,7 @@
 #include "resource.h"
 #include "settings.h"
 #include "start.h"
+#include "state.h"
 #include "util.h"
 #include "watchlist.h"
 #include "z64.h"
@@ -28,7 +31,7 @@ struct gz gz =
   .ready = 0,
 };
 
-static void update_cpu_counter(void)
+void gz_update_cpu_counter(void)
 {
   static uint32_t count = 0;
   uint32_t new_count;
@@ -47,9 +50,10 @@ static void update_cpu_counter(void)
 
 static void main_hook(void)
 {
-  update_cpu_counter();
+  gz_update_cpu_counter();
   input_update();
   gfx_mode_init();
+  bgio_update();
 
   {
     /* handle emergency settings reset */
@@ -187,6 +191,8 @@ static void main_hook(void)
     if (command_info[i].proc && active)
       command_info[i].proc();
   }
+  /* capture rewind states */
+  gz_rewind_update();
   if (input_bind_pressed(COMMAND_PREVROOM))
     explorer_room_prev(gz.menu_explorer);
   if (input_bind_pressed(COMMAND_NEXTROOM))
@@ -436,6 +442,16 @@ static void main_hook(void)
     gfx_printf(font, msg_x, msg_y, "%s", ent->msg);
   }
 
+  /* draw background io progress */
+  if (bgio_busy()) {
+    char msg[16];
+    snprintf(msg, sizeof(msg), "saving %3i%%", bgio_progress());
+    int msg_x = settings->log_x - cw * strlen(msg);
+    int msg_y = settings->log_y - ch * SETTINGS_LOG_MAX;
+    gfx_mode_set(GFX_MODE_COLOR, GPACK_RGB24A8(0xC0C0C0, alpha));
+    gfx_printf(font, msg_x, msg_y, "%s", msg);
+  }
+
   /* finish frame */
   gfx_flush();
 }
@@ -668,6 +684,7 @@ static void state_main_hook(void)
       gz.reset_flag = 0;
       gz.lag_vi_offset += (int32_t)z64_vi_counter - gz.frame_counter;
       gz.frame_counter = 0;
+      state_cache_clear();
       /* try doing a homeboy reset */
       if (hb_check() == 0) {
         /* simulate 0.5s nmi delay */
@@ -1041,7 +1058,7 @@ static void init(void)
   gz.frame_counter = 0;
   gz.lag_vi_offset = -(int32_t)z64_vi_counter;
   gz.cpu_counter = 0;
-  update_cpu_counter();
+  gz_update_cpu_counter();
   gz.timer_active = 0;
   gz.timer_counter_offset = -gz.cpu_counter;
   gz.timer_counter_prev = gz.cpu_counter;
@@ -1065,9 +1082,12 @@ static void init(void)
   for (int i = 0; i < SETTINGS_MEMFILE_MAX; ++i)
     gz.memfile_saved[i] = 0;
   gz.memfile_slot = 0;
-  for (int i = 0; i < SETTINGS_STATE_MAX; ++i)
+  for (int i = 0; i < SETTINGS_STATE_MAX; ++i) {
     gz.state_buf[i] = NULL;
+    gz.state_lz[i] = 0;
+  }
   gz.state_slot = 0;
+  gz.state_base = NULL;
   gz.reset_flag = 0;
 
   /* load settings */
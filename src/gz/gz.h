@@ -4,6 +4,7 @@
 #include <vector/vector.h>
 #include <n64.h>
 #include "settings.h"
+#include "state.h"
 #include "z64.h"
 #include "zu.h"
 
@@ -204,6 +205,8 @@ struct gz
   uint8_t               memfile_slot;
   void                 *state_buf[SETTINGS_STATE_MAX];
   uint8_t               state_slot;
+  _Bool                 state_lz[SETTINGS_STATE_MAX];
+  void                 *state_base;
   _Bool                 reset_flag;
   _Bool                 frame_flag;
   struct selected_actor selected_actor;
@@ -218,6 +221,11 @@ void          gz_load_memfile(struct memory_file *memfile);
 void          gz_warp(int16_t entrance_index,
                       uint16_t cutscene_index, int age);
 void          gz_set_input_mask(uint16_t pad, uint8_t x, uint8_t y);
+struct state_meta *gz_save_state(void);
+void          gz_load_state(struct state_meta *state);
+int           gz_save_state_file(int fd);
+int           gz_load_state_file(int fd, const struct state_meta *meta);
+void          gz_update_cpu_counter(void);
 
 void          command_break(void);
 void          command_levitate(void);
@@ -235,6 +243,7 @@ void          command_savepos(void);
 void          command_loadpos(void);
 void          command_prevstate(void);
 void          command_nextstate(void);
+void          command_rewind(void);
 void          command_prevfile(void);
 void          command_nextfile(void);
 void          command_prevpos(void);
@@ -258,6 +267,11 @@ void          movie_to_z(int movie_frame, z64_input_t *zi, _Bool *reset);
 void          gz_movie_rewind(void);
 void          gz_movie_seek(int frame);
 
+void          gz_rewind_update(void);
+void          gz_rewind_step(void);
+void          gz_rewind_clear(void);
+int64_t       gz_rewind_cost(void);
+
 void          gz_vcont_set(int port, _Bool plugged, z64_controller_t *cont);
 void          gz_vcont_get(int port, z64_input_t *input);
 
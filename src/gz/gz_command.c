@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <string.h>
 #include "gfx.h"
 #include "gz.h"
@@ -33,6 +34,7 @@ struct command_info command_info[COMMAND_MAX] =
   {"load position",     command_loadpos,       CMDACT_HOLD},
   {"previous state",    command_prevstate,     CMDACT_PRESS_ONCE},
   {"next state",        command_nextstate,     CMDACT_PRESS_ONCE},
+  {"rewind",            command_rewind,        CMDACT_PRESS},
   {"previous memfile",  command_prevfile,      CMDACT_PRESS_ONCE},
   {"next memfile",      command_nextfile,      CMDACT_PRESS_ONCE},
   {"previous position", command_prevpos,       CMDACT_PRESS_ONCE},
@@ -295,23 +297,87 @@ void command_age(void)
   z64_UpdateEquipment(&z64_game, &z64_link);
 }
 
+static void set_state_meta(struct state_meta *meta)
+{
+  meta->z64_version = Z64_VERSION;
+  meta->state_version = SETTINGS_STATE_VERSION;
+  meta->scene_idx = z64_game.scene_index;
+  meta->flags = 0;
+  if (gz.movie_state == MOVIE_IDLE)
+    meta->movie_frame = -1;
+  else
+    meta->movie_frame = gz.movie_frame;
+}
+
+/* save the game state to a new full state */
+struct state_meta *gz_save_state(void)
+{
+  struct state_meta *state = malloc(368 * 1024);
+  if (!state)
+    return NULL;
+  state->size = save_state(state);
+  set_state_meta(state);
+  return state;
+}
+
+/* save a full state straight to a file, without buffering it in memory */
+int gz_save_state_file(int fd)
+{
+  struct state_meta meta;
+  set_state_meta(&meta);
+  return save_state_file(fd, &meta);
+}
+
+static void state_loaded(const struct state_meta *meta)
+{
+  if (gz.movie_state != MOVIE_IDLE && meta->movie_frame != -1)
+    gz_movie_seek(meta->movie_frame);
+  /* connect direct input with state's context input */
+  z64_input_t *di = &z64_input_direct;
+  z64_input_t *zi = &z64_ctxt.input[0];
+  di->raw_prev = zi->raw;
+  di->status_prev = zi->status;
+  di->pad_pressed = (di->raw.pad ^ zi->raw.pad) & di->raw.pad;
+  di->pad_released = (di->raw.pad ^ zi->raw.pad) & zi->raw.pad;
+  di->x_diff = di->raw.x - zi->raw.x;
+  di->y_diff = di->raw.y - zi->raw.y;
+}
+
+/* load a full state */
+void gz_load_state(struct state_meta *state)
+{
+  load_state(state);
+  state_loaded(state);
+}
+
+/* load a full state from the start of a file, whose metadata has
+   already been checked */
+int gz_load_state_file(int fd, const struct state_meta *meta)
+{
+  if (load_state_file(fd))
+    return -1;
+  state_loaded(meta);
+  return 0;
+}
+
 void command_savestate(void)
 {
   if (!zu_in_game())
     gz_log("can not save here");
   else {
-    if (gz.state_buf[gz.state_slot])
+    if (gz.state_buf[gz.state_slot]) {
       free(gz.state_buf[gz.state_slot]);
-    struct state_meta *state = malloc(368 * 1024);
-    state->z64_version = Z64_VERSION;
-    state->state_version = SETTINGS_STATE_VERSION;
-    state->size = save_state(state);
-    state->scene_idx = z64_game.scene_index;
-    if (gz.movie_state == MOVIE_IDLE)
-      state->movie_frame = -1;
-    else
-      state->movie_frame = gz.movie_frame;
-    gz.state_buf[gz.state_slot] = realloc(state, state->size);
+      gz.state_buf[gz.state_slot] = NULL;
+    }
+    struct state_meta *state = gz_save_state();
+    if (!state) {
+      gz_log("out of memory");
+      return;
+    }
+    /* store as a delta of the base state if there is one, and compress
+       if enabled for this slot */
+    gz.state_buf[gz.state_slot] = state_pack(gz.state_base, state,
+                                             gz.state_lz[gz.state_slot]);
     gz_log("saved state %i", gz.state_slot);
   }
 }
@@ -322,18 +388,19 @@ void command_loadstate(void)
     gz_log("can not load here");
   else if (gz.state_buf[gz.state_slot]) {
     struct state_meta *state = gz.state_buf[gz.state_slot];
-    load_state(state);
-    if (gz.movie_state != MOVIE_IDLE && state->movie_frame != -1)
-      gz_movie_seek(state->movie_frame);
-    /* connect direct input with state's context input */
-    z64_input_t *di = &z64_input_direct;
-    z64_input_t *zi = &z64_ctxt.input[0];
-    di->raw_prev = zi->raw;
-    di->status_prev = zi->status;
-    di->pad_pressed = (di->raw.pad ^ zi->raw.pad) & di->raw.pad;
-    di->pad_released = (di->raw.pad ^ zi->raw.pad) & zi->raw.pad;
-    di->x_diff = di->raw.x - zi->raw.x;
-    di->y_diff = di->raw.y - zi->raw.y;
+    struct state_meta *full = state_unpack(gz.state_base, state);
+    if (!full) {
+      if (errno == ENOMEM)
+        gz_log("out of memory");
+      else if (state->flags & STATE_DELTA)
+        gz_log("state %i needs its base state", gz.state_slot);
+      else
+        gz_log("state %i is invalid", gz.state_slot);
+      return;
+    }
+    gz_load_state(full);
+    if (full != state)
+      free(full);
     gz_log("loaded state %i", gz.state_slot);
   }
   else
@@ -389,6 +456,14 @@ void command_nextstate(void)
   gz_log("state %i", gz.state_slot);
 }
 
+void command_rewind(void)
+{
+  if (!zu_in_game())
+    gz_log("can not load here");
+  else
+    gz_rewind_step();
+}
+
 void command_prevfile(void)
 {
   gz.memfile_slot += SETTINGS_MEMFILE_MAX - 1;
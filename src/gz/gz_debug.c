@@ -1,16 +1,23 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
 #include <inttypes.h>
 #include <n64.h>
+#include "bgio.h"
+#include "ed.h"
+#include "fat.h"
+#include "files.h"
 #include "flags.h"
 #include "gfx.h"
 #include "gz.h"
 #include "mem.h"
 #include "menu.h"
 #include "rdb.h"
+#include "state.h"
+#include "sys.h"
 #include "ucode.h"
 #include "z64.h"
 
@@ -505,6 +512,244 @@ static void fetch_actor_info_proc(struct menu_item *item, void *data)
   asi->rz = z64_link.common.rot_2.z;
 }
 
+static int disk_draw_proc(struct menu_item *item,
+                          struct menu_draw_params *draw_params)
+{
+  int x = draw_params->x;
+  int y = draw_params->y;
+  struct gfx_font *font = draw_params->font;
+  int ch = menu_get_cell_height(item->owner, 1);
+  gfx_mode_set(GFX_MODE_COLOR, GPACK_RGB24A8(draw_params->color,
+                                             draw_params->alpha));
+  struct fat *fat = sys_fat();
+  if (!fat) {
+    gfx_printf(font, x, y, "no file system mounted");
+    return 1;
+  }
+  static const char *cache_name[FAT_CACHE_MAX] = {"fat", "data"};
+  gfx_printf(font, x, y, "cache     hits     misses");
+  for (int i = 0; i < FAT_CACHE_MAX; ++i) {
+    struct fat_cache *cache = &fat->cache[i];
+    gfx_printf(font, x, y + ch * (i + 1), "%-9s %-8" PRIu32 " %" PRIu32,
+               cache_name[i], cache->n_hit, cache->n_miss);
+  }
+  y += ch * (FAT_CACHE_MAX + 2);
+  gfx_printf(font, x, y, "io        requests sectors");
+  gfx_printf(font, x, y + ch * 1, "%-9s %-8" PRIu32 " %" PRIu32,
+             "read", fat->n_read, fat->n_read_sect);
+  gfx_printf(font, x, y + ch * 2, "%-9s %-8" PRIu32 " %" PRIu32,
+             "write", fat->n_write, fat->n_write_sect);
+  struct ed_sd_stats sd;
+  if (sys_sd_stats(&sd) == 0) {
+    static const char *speed_name[] = {"50 mhz", "25 mhz", "init"};
+    y += ch * 4;
+    gfx_printf(font, x, y, "sd card   %s, max %s",
+               speed_name[sd.speed], speed_name[sd.max_speed]);
+    gfx_printf(font, x, y + ch * 1, "%-9s %" PRIu32,
+               "crc retry", sd.n_crc_retry);
+    gfx_printf(font, x, y + ch * 2, "%-9s %" PRIu32,
+               "timeouts", sd.n_timeout);
+    gfx_printf(font, x, y + ch * 3, "%-9s %" PRIu32,
+               "slowdowns", sd.n_speed_drop);
+    gfx_printf(font, x, y + ch * 4, "%-9s %" PRIu32 " kb/s",
+               "rate", sd.blocks_per_sec / 2);
+  }
+  return 1;
+}
+
+static void reset_disk_stats_proc(struct menu_item *item, void *data)
+{
+  struct fat *fat = sys_fat();
+  if (fat)
+    fat_reset_stats(fat);
+  ed_sd_reset_stats();
+}
+
+#define RAMDISK_SIZE 0x80000
+
+static struct sys_blkdev  ramdisk;
+static void              *ramdisk_mem;
+
+static int ramdisk_proc(struct menu_item *item,
+                        enum menu_callback_reason reason,
+                        void *data)
+{
+  if (reason == MENU_CALLBACK_SWITCH_ON) {
+    /* finish background writes to the current disk before switching */
+    bgio_sync();
+    void *mem = malloc(RAMDISK_SIZE);
+    if (!mem) {
+      gz_log("out of memory");
+      return 1;
+    }
+    /* clear the boot sector so that the disk is formatted on first use */
+    memset(mem, 0, 0x200);
+    sys_ramdisk(&ramdisk, mem, RAMDISK_SIZE);
+    sys_set_blkdev(&ramdisk);
+    ramdisk_mem = mem;
+  }
+  else if (reason == MENU_CALLBACK_SWITCH_OFF) {
+    /* the contents of the ram disk are lost */
+    bgio_sync();
+    sys_set_blkdev(NULL);
+    free(ramdisk_mem);
+    ramdisk_mem = NULL;
+  }
+  else if (reason == MENU_CALLBACK_THINK) {
+    _Bool enabled = ramdisk_mem != NULL;
+    if (menu_checkbox_get(item) != enabled)
+      menu_checkbox_set(item, enabled);
+  }
+  return 0;
+}
+
+static int state_prof_proc(struct menu_item *item,
+                           enum menu_callback_reason reason,
+                           void *data)
+{
+  if (reason == MENU_CALLBACK_SWITCH_ON)
+    state_prof.enabled = 1;
+  else if (reason == MENU_CALLBACK_SWITCH_OFF)
+    state_prof.enabled = 0;
+  else if (reason == MENU_CALLBACK_THINK) {
+    if (menu_checkbox_get(item) != state_prof.enabled)
+      menu_checkbox_set(item, state_prof.enabled);
+  }
+  return 0;
+}
+
+static void reset_state_prof_proc(struct menu_item *item, void *data)
+{
+  state_prof_reset();
+}
+
+/* convert counter cycles to microseconds */
+static uint32_t prof_usec(int64_t n_cycles)
+{
+  return n_cycles * 1000000 / gz.cpu_counter_freq;
+}
+
+static int state_prof_draw_proc(struct menu_item *item,
+                                struct menu_draw_params *draw_params)
+{
+  int x = draw_params->x;
+  int y = draw_params->y;
+  struct gfx_font *font = draw_params->font;
+  int ch = menu_get_cell_height(item->owner, 1);
+  gfx_mode_set(GFX_MODE_COLOR, GPACK_RGB24A8(draw_params->color,
+                                             draw_params->alpha));
+  uint32_t n_save = state_prof.n_save;
+  uint32_t n_load = state_prof.n_load;
+  gfx_printf(font, x, y, "saves %-8" PRIu32 " loads %" PRIu32,
+             n_save, n_load);
+  /* show the average per save and load */
+  gfx_printf(font, x, y + ch * 2, "section   bytes   save us load us");
+  struct state_prof_stat save_total = {0};
+  struct state_prof_stat load_total = {0};
+  for (int i = 0; i <= STATE_PROF_MAX; ++i) {
+    const char *name;
+    struct state_prof_stat *save;
+    struct state_prof_stat *load;
+    if (i < STATE_PROF_MAX) {
+      name = state_prof_name[i];
+      save = &state_prof.save[i];
+      load = &state_prof.load[i];
+      save_total.n_bytes += save->n_bytes;
+      save_total.n_cycles += save->n_cycles;
+      load_total.n_cycles += load->n_cycles;
+    }
+    else {
+      name = "total";
+      save = &save_total;
+      load = &load_total;
+    }
+    uint32_t n_bytes = n_save ? save->n_bytes / n_save : 0;
+    uint32_t save_us = n_save ? prof_usec(save->n_cycles / n_save) : 0;
+    uint32_t load_us = n_load ? prof_usec(load->n_cycles / n_load) : 0;
+    gfx_printf(font, x, y + ch * (i + 3),
+               "%-9s %-7" PRIu32 " %-7" PRIu32 " %" PRIu32,
+               name, n_bytes, save_us, load_us);
+  }
+  /* rewind captures, with the packing that follows the save */
+  uint32_t n_capture = state_prof.n_capture;
+  int64_t capture_cycles = n_capture ?
+                           state_prof.capture.n_cycles / n_capture : 0;
+  y += ch * (STATE_PROF_MAX + 5);
+  gfx_printf(font, x, y, "rewind    captures avg us  max us");
+  gfx_printf(font, x, y + ch, "%-9s %-8" PRIu32 " %-7" PRIu32 " %" PRIu32,
+             "", n_capture, prof_usec(capture_cycles),
+             prof_usec(state_prof.capture_max));
+  return 1;
+}
+
+static void export_state_prof_done(int error, void *data)
+{
+  free(data);
+  if (error)
+    gz_log("profile export failed: %s", strerror(error));
+}
+
+/* write the profile as csv, with the totals of all saves and loads */
+static int do_export_state_prof(const char *path, void *data)
+{
+  static const char *header = "section,saves,save bytes,save cycles,"
+                              "loads,load bytes,load cycles,"
+                              "counter freq\n";
+  /* a row is a name and seven numbers, of which two are 32-bit counts
+     (10 digits), four are 64-bit values (20 digits with the sign) and one
+     is a signed 32-bit frequency (11 characters), plus the separators.
+     the last row holds the rewind captures */
+  static const char *capture_name = "rewind";
+  size_t size = strlen(header) + strlen(capture_name) + 1;
+  for (int i = 0; i < STATE_PROF_MAX; ++i)
+    size += strlen(state_prof_name[i]);
+  size += (STATE_PROF_MAX + 1) * (2 * 10 + 4 * 20 + 11 + 8);
+  char *buf = malloc(size);
+  if (!buf) {
+    menu_prompt(gz.menu_main, strerror(ENOMEM), "return\0", 0, NULL, NULL);
+    return 1;
+  }
+  size_t n = strlen(header);
+  memcpy(buf, header, n);
+  for (int i = 0; i <= STATE_PROF_MAX; ++i) {
+    static const struct state_prof_stat none = {0};
+    const char *name = capture_name;
+    uint32_t n_save = state_prof.n_capture;
+    uint32_t n_load = 0;
+    const struct state_prof_stat *save = &state_prof.capture;
+    const struct state_prof_stat *load = &none;
+    if (i < STATE_PROF_MAX) {
+      name = state_prof_name[i];
+      n_save = state_prof.n_save;
+      n_load = state_prof.n_load;
+      save = &state_prof.save[i];
+      load = &state_prof.load[i];
+    }
+    int r = snprintf(&buf[n], size - n,
+                     "%s,%" PRIu32 ",%" PRIu64 ",%" PRIi64
+                     ",%" PRIu32 ",%" PRIu64 ",%" PRIi64 ",%" PRIi32 "\n",
+                     name, n_save, save->n_bytes, save->n_cycles,
+                     n_load, load->n_bytes, load->n_cycles,
+                     gz.cpu_counter_freq);
+    if (r < 0 || (size_t)r >= size - n)
+      break;
+    n += r;
+  }
+  if (bgio_write_file(path, buf, n, export_state_prof_done, buf)) {
+    menu_prompt(gz.menu_main, strerror(errno), "return\0", 0, NULL, NULL);
+    free(buf);
+    return 1;
+  }
+  else
+    return 0;
+}
+
+static void export_state_prof_proc(struct menu_item *item, void *data)
+{
+  menu_get_file(gz.menu_main, GETFILE_SAVE, "states", ".csv",
+                do_export_state_prof, NULL);
+}
+
 #ifndef WIIVC
 static void start_rdb_proc(struct menu_item *item, void *data)
 {
@@ -542,6 +787,8 @@ struct menu *gz_debug_menu(void)
   static struct menu actors;
   static struct menu flags;
   static struct menu mem;
+  static struct menu disk;
+  static struct menu states;
 #ifndef WIIVC
   static struct menu rdb;
 #endif
@@ -553,6 +800,8 @@ struct menu *gz_debug_menu(void)
   menu_init(&disp, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
   menu_init(&objects, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
   menu_init(&actors, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
+  menu_init(&disk, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
+  menu_init(&states, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
 #ifndef WIIVC
   menu_init(&rdb, MENU_NOVALUE, MENU_NOVALUE, MENU_NOVALUE);
 #endif
@@ -565,8 +814,10 @@ struct menu *gz_debug_menu(void)
   menu_add_submenu(&menu, 0, 4, &actors, "actors");
   menu_add_submenu(&menu, 0, 5, &flags, "flags");
   menu_add_submenu(&menu, 0, 6, &mem, "memory");
+  menu_add_submenu(&menu, 0, 7, &disk, "disk");
+  menu_add_submenu(&menu, 0, 8, &states, "savestates");
 #ifndef WIIVC
-  menu_add_submenu(&menu, 0, 7, &rdb, "rdb");
+  menu_add_submenu(&menu, 0, 9, &rdb, "rdb");
 #endif
 
   /* populate heap menu */
@@ -633,6 +884,22 @@ struct menu *gz_debug_menu(void)
   mem_menu_create(&mem);
   gz.menu_mem = &mem;
 
+  /* populate disk menu */
+  disk.selector = menu_add_submenu(&disk, 0, 0, NULL, "return");
+  menu_add_checkbox(&disk, 0, 1, ramdisk_proc, NULL);
+  menu_add_static(&disk, 2, 1, "ram disk", 0xC0C0C0);
+  menu_add_button(&disk, 0, 2, "reset", reset_disk_stats_proc, NULL);
+  menu_add_static_custom(&disk, 0, 3, disk_draw_proc, NULL, 0xC0C0C0);
+
+  /* populate savestate profiler menu */
+  states.selector = menu_add_submenu(&states, 0, 0, NULL, "return");
+  menu_add_checkbox(&states, 0, 1, state_prof_proc, NULL);
+  menu_add_static(&states, 2, 1, "profile", 0xC0C0C0);
+  menu_add_button(&states, 0, 2, "reset", reset_state_prof_proc, NULL);
+  menu_add_button(&states, 6, 2, "export", export_state_prof_proc, NULL);
+  menu_add_static_custom(&states, 0, 4, state_prof_draw_proc, NULL,
+                         0xC0C0C0);
+
 #ifndef WIIVC
   /* populate rdb menu */
   rdb.selector = menu_add_submenu(&rdb, 0, 0, NULL, "return");
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include "bgio.h"
 #include "files.h"
 #include "gfx.h"
 #include "gz.h"
@@ -217,33 +219,27 @@ static int on_file_load_proc(struct menu_item *item,
   return 0;
 }
 
+static void save_file_done(int error, void *data)
+{
+  free(data);
+  if (error)
+    gz_log("file save failed: %s", strerror(error));
+}
+
 static int do_save_file(const char *path, void *data)
 {
   const char *s_memory = "out of memory";
   const char *err_str = NULL;
-  struct memory_file *file = NULL;
-  int f = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-  if (f != -1) {
-    file = malloc(sizeof(*file));
-    if (!file)
-      err_str = s_memory;
-    else {
-      gz_save_memfile(file);
-      if (write(f, file, sizeof(*file)) != sizeof(*file))
-        err_str = strerror(errno);
-      else {
-        if (close(f))
-          err_str = strerror(errno);
-        f = -1;
-      }
+  struct memory_file *file = malloc(sizeof(*file));
+  if (!file)
+    err_str = s_memory;
+  else {
+    gz_save_memfile(file);
+    if (bgio_write_file(path, file, sizeof(*file), save_file_done, file)) {
+      err_str = strerror(errno);
+      free(file);
     }
   }
-  else
-    err_str = strerror(errno);
-  if (f != -1)
-    close(f);
-  if (file)
-    free(file);
   if (err_str) {
     menu_prompt(gz.menu_main, err_str, "return\0", 0, NULL, NULL);
     return 1;
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <string.h>
+#include "bgio.h"
 #include "files.h"
 #include "gz.h"
 #include "menu.h"
@@ -117,6 +119,8 @@ static int do_import_macro(const char *path, void *data)
   if (f != -1) {
     struct stat st;
     fstat(f, &st);
+    /* the file is read front to back in small pieces */
+    posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
     int n;
     size_t n_input;
     size_t n_seed;
@@ -238,67 +242,71 @@ error:
     return 0;
 }
 
+static void export_macro_done(int error, void *data)
+{
+  free(data);
+  if (error)
+    gz_log("macro export failed: %s", strerror(error));
+}
+
+/* append `n` bytes to a serialized macro */
+static char *put_macro_data(char *p, const void *src, size_t n)
+{
+  memcpy(p, src, n);
+  return p + n;
+}
+
 static int do_export_macro(const char *path, void *data)
 {
+  const char *s_memory = "out of memory";
   const char *err_str = NULL;
-  int f = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-  if (f != -1) {
-    int n;
-    size_t n_input = gz.movie_input.size;
-    size_t n_seed = gz.movie_seed.size;
-    errno = 0;
-    n = sizeof(n_input);
-    if (write(f, &n_input, n) != n)
-      goto f_err;
-    n = sizeof(n_seed);
-    if (write(f, &n_seed, n) != n)
-      goto f_err;
-    n = sizeof(gz.movie_input_start);
-    if (write(f, &gz.movie_input_start, n) != n)
-      goto f_err;
-    n = gz.movie_input.element_size * n_input;
-    if (write(f, gz.movie_input.begin, n) != n)
-      goto f_err;
-    n = gz.movie_seed.element_size * n_seed;
-    if (write(f, gz.movie_seed.begin, n) != n)
-      goto f_err;
-    size_t n_oca_input = gz.movie_oca_input.size;
-    size_t n_oca_sync = gz.movie_oca_sync.size;
-    size_t n_room_load = gz.movie_room_load.size;
+  size_t n_input = gz.movie_input.size;
+  size_t n_seed = gz.movie_seed.size;
+  size_t n_oca_input = gz.movie_oca_input.size;
+  size_t n_oca_sync = gz.movie_oca_sync.size;
+  size_t n_room_load = gz.movie_room_load.size;
+  _Bool have_sync = n_oca_input != 0 || n_oca_sync != 0 || n_room_load != 0;
+  /* serialize the macro so that it can be written while the movie
+     keeps changing */
+  size_t n = sizeof(n_input) + sizeof(n_seed) + sizeof(gz.movie_input_start) +
+             gz.movie_input.element_size * n_input +
+             gz.movie_seed.element_size * n_seed;
+  if (have_sync) {
+    n += sizeof(n_oca_input) + sizeof(n_oca_sync) + sizeof(n_room_load) +
+         gz.movie_oca_input.element_size * n_oca_input +
+         gz.movie_oca_sync.element_size * n_oca_sync +
+         gz.movie_room_load.element_size * n_room_load;
+  }
+  char *buf = malloc(n);
+  if (!buf)
+    err_str = s_memory;
+  else {
+    char *p = buf;
+    p = put_macro_data(p, &n_input, sizeof(n_input));
+    p = put_macro_data(p, &n_seed, sizeof(n_seed));
+    p = put_macro_data(p, &gz.movie_input_start,
+                       sizeof(gz.movie_input_start));
+    p = put_macro_data(p, gz.movie_input.begin,
+                       gz.movie_input.element_size * n_input);
+    p = put_macro_data(p, gz.movie_seed.begin,
+                       gz.movie_seed.element_size * n_seed);
     /* write sync info if there is any */
-    if (n_oca_input != 0 || n_oca_sync != 0 || n_room_load != 0) {
-      n = sizeof(n_oca_input);
-      if (write(f, &n_oca_input, n) != n)
-        goto f_err;
-      n = sizeof(n_oca_sync);
-      if (write(f, &n_oca_sync, n) != n)
-        goto f_err;
-      n = sizeof(n_room_load);
-      if (write(f, &n_room_load, n) != n)
-        goto f_err;
-      n = gz.movie_oca_input.element_size * n_oca_input;
-      if (write(f, gz.movie_oca_input.begin, n) != n)
-        goto f_err;
-      n = gz.movie_oca_sync.element_size * n_oca_sync;
-      if (write(f, gz.movie_oca_sync.begin, n) != n)
-        goto f_err;
-      n = gz.movie_room_load.element_size * n_room_load;
-      if (write(f, gz.movie_room_load.begin, n) != n)
-        goto f_err;
+    if (have_sync) {
+      p = put_macro_data(p, &n_oca_input, sizeof(n_oca_input));
+      p = put_macro_data(p, &n_oca_sync, sizeof(n_oca_sync));
+      p = put_macro_data(p, &n_room_load, sizeof(n_room_load));
+      p = put_macro_data(p, gz.movie_oca_input.begin,
+                         gz.movie_oca_input.element_size * n_oca_input);
+      p = put_macro_data(p, gz.movie_oca_sync.begin,
+                         gz.movie_oca_sync.element_size * n_oca_sync);
+      p = put_macro_data(p, gz.movie_room_load.begin,
+                         gz.movie_room_load.element_size * n_room_load);
     }
-f_err:
-    if (errno != 0)
+    if (bgio_write_file(path, buf, n, export_macro_done, buf)) {
       err_str = strerror(errno);
-    else {
-      if (close(f))
-        err_str = strerror(errno);
-      f = -1;
+      free(buf);
     }
   }
-  else
-    err_str = strerror(errno);
-  if (f != -1)
-    close(f);
   if (err_str) {
     menu_prompt(gz.menu_main, err_str, "return\0", 0, NULL, NULL);
     return 1;
@@ -349,6 +357,74 @@ static void clear_state_proc(struct menu_item *item, void *data)
   }
 }
 
+/* expand the delta states in all slots before the base state changes.
+   deltas of some other base are left as they are */
+static _Bool expand_deltas(void)
+{
+  if (!gz.state_base)
+    return 1;
+  for (int i = 0; i < SETTINGS_STATE_MAX; ++i) {
+    struct state_meta *state = gz.state_buf[i];
+    if (!state || !(state->flags & STATE_DELTA))
+      continue;
+    struct state_meta *full = state_unpack(gz.state_base, state);
+    if (full) {
+      free(state);
+      gz.state_buf[i] = state_pack(NULL, full, gz.state_lz[i]);
+    }
+    else if (errno == ENOMEM)
+      return 0;
+  }
+  return 1;
+}
+
+static void base_state_proc(struct menu_item *item, void *data)
+{
+  if (!expand_deltas()) {
+    gz_log("out of memory");
+    return;
+  }
+  if (gz.state_base) {
+    free(gz.state_base);
+    gz.state_base = NULL;
+  }
+  /* states saved from now on are stored as deltas of the current state */
+  struct state_meta *state = gz.state_buf[gz.state_slot];
+  if (state) {
+    struct state_meta *base = state_unpack(NULL, state);
+    if (base == state) {
+      base = malloc(state->size);
+      if (base)
+        memcpy(base, state, state->size);
+    }
+    if (base) {
+      gz.state_base = base;
+      gz_log("state %i is the base state", gz.state_slot);
+    }
+    else if (errno == ENOMEM)
+      gz_log("out of memory");
+    else
+      gz_log("state %i needs its base state", gz.state_slot);
+  }
+  else
+    gz_log("cleared base state");
+}
+
+static int compress_state_proc(struct menu_item *item,
+                               enum menu_callback_reason reason,
+                               void *data)
+{
+  if (reason == MENU_CALLBACK_SWITCH_ON)
+    gz.state_lz[gz.state_slot] = 1;
+  else if (reason == MENU_CALLBACK_SWITCH_OFF)
+    gz.state_lz[gz.state_slot] = 0;
+  else if (reason == MENU_CALLBACK_THINK) {
+    if (menu_checkbox_get(item) != gz.state_lz[gz.state_slot])
+      menu_checkbox_set(item, gz.state_lz[gz.state_slot]);
+  }
+  return 0;
+}
+
 static int do_import_state(const char *path, void *data)
 {
   const char *s_invalid = "invalid state file";
@@ -367,6 +443,25 @@ static int do_import_state(const char *path, void *data)
       err_str = s_invalid;
       goto error;
     }
+    /* check the header before replacing the current state */
+    struct sys_map *map = sys_mmap(f, 0, st.st_size);
+    if (!map) {
+      err_str = strerror(errno);
+      goto error;
+    }
+    const struct state_meta *meta = sys_mmap_at(map, 0, sizeof(*meta));
+    if (!meta)
+      err_str = strerror(errno);
+    else if (meta->z64_version != Z64_VERSION ||
+             meta->state_version != SETTINGS_STATE_VERSION)
+    {
+      err_str = s_version;
+    }
+    else if (meta->size != st.st_size)
+      err_str = s_invalid;
+    sys_munmap(map);
+    if (err_str)
+      goto error;
     if (gz.state_buf[gz.state_slot])
       free(gz.state_buf[gz.state_slot]);
     gz.state_buf[gz.state_slot] = malloc(st.st_size);
@@ -378,13 +473,6 @@ static int do_import_state(const char *path, void *data)
     sys_io_mode(SYS_IO_DMA);
     if (read(f, state, st.st_size) != st.st_size)
       err_str = strerror(errno);
-    else if (state->z64_version != Z64_VERSION ||
-             state->state_version != SETTINGS_STATE_VERSION)
-    {
-      err_str = s_version;
-    }
-    else if (state->size != st.st_size)
-      err_str = s_invalid;
     else
       state = NULL;
     sys_io_mode(SYS_IO_PIO);
@@ -406,26 +494,27 @@ error:
     return 0;
 }
 
+static void export_state_done(int error, void *data)
+{
+  if (error)
+    gz_log("state export failed: %s", strerror(error));
+  free(data);
+}
+
 static int do_export_state(const char *path, void *data)
 {
-  const char *err_str = NULL;
-  int f = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-  if (f != -1) {
-    struct state_meta *state = gz.state_buf[gz.state_slot];
-    if (write(f, state, state->size) == state->size) {
-      if (close(f))
-        err_str = strerror(errno);
-      f = -1;
-    }
-    else
-      err_str = strerror(errno);
+  /* write a copy of the state, so that the slot can change while the
+     file is written in the background */
+  struct state_meta *state = gz.state_buf[gz.state_slot];
+  struct state_meta *copy = malloc(state->size);
+  if (!copy) {
+    menu_prompt(gz.menu_main, strerror(ENOMEM), "return\0", 0, NULL, NULL);
+    return 1;
   }
-  else
-    err_str = strerror(errno);
-  if (f != -1)
-    close(f);
-  if (err_str) {
-    menu_prompt(gz.menu_main, err_str, "return\0", 0, NULL, NULL);
+  memcpy(copy, state, state->size);
+  if (bgio_write_file(path, copy, copy->size, export_state_done, copy)) {
+    menu_prompt(gz.menu_main, strerror(errno), "return\0", 0, NULL, NULL);
+    free(copy);
     return 1;
   }
   else
@@ -450,6 +539,84 @@ static void export_state_proc(struct menu_item *item, void *data)
   }
 }
 
+/* save the game state straight to a file, this only needs a small staging
+   buffer instead of memory for the whole state */
+static int do_save_state_disk(const char *path, void *data)
+{
+  const char *err_str = NULL;
+  int f = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (f == -1 || gz_save_state_file(f))
+    err_str = strerror(errno);
+  if (f != -1 && close(f) && !err_str)
+    err_str = strerror(errno);
+  if (err_str) {
+    menu_prompt(gz.menu_main, err_str, "return\0", 0, NULL, NULL);
+    return 1;
+  }
+  else
+    return 0;
+}
+
+static int do_load_state_disk(const char *path, void *data)
+{
+  const char *s_invalid = "invalid state file";
+  const char *s_version = "incompatible state file";
+  const char *s_packed = "state must be imported";
+  const char *err_str = NULL;
+  int f = open(path, O_RDONLY);
+  if (f != -1) {
+    struct stat st;
+    struct state_meta meta;
+    if (fstat(f, &st))
+      err_str = strerror(errno);
+    else if (read(f, &meta, sizeof(meta)) != sizeof(meta))
+      err_str = s_invalid;
+    else if (meta.z64_version != Z64_VERSION ||
+             meta.state_version != SETTINGS_STATE_VERSION)
+    {
+      err_str = s_version;
+    }
+    else if (meta.size != st.st_size)
+      err_str = s_invalid;
+    /* delta and compressed states can not be streamed */
+    else if (meta.flags != 0)
+      err_str = s_packed;
+    else if (lseek(f, 0, SEEK_SET) == -1 || gz_load_state_file(f, &meta))
+      err_str = strerror(errno);
+    close(f);
+  }
+  else
+    err_str = strerror(errno);
+  if (err_str) {
+    menu_prompt(gz.menu_main, err_str, "return\0", 0, NULL, NULL);
+    return 1;
+  }
+  else
+    return 0;
+}
+
+static void save_state_disk_proc(struct menu_item *item, void *data)
+{
+  if (!zu_in_game())
+    gz_log("can not save here");
+  else {
+    char defname[32];
+    snprintf(defname, sizeof(defname), "000-%s",
+             zu_scene_info[z64_game.scene_index].scene_name);
+    menu_get_file(gz.menu_main, GETFILE_SAVE, defname, ".gzs",
+                  do_save_state_disk, NULL);
+  }
+}
+
+static void load_state_disk_proc(struct menu_item *item, void *data)
+{
+  if (!zu_in_game())
+    gz_log("can not load here");
+  else
+    menu_get_file(gz.menu_main, GETFILE_LOAD, NULL, ".gzs",
+                  do_load_state_disk, NULL);
+}
+
 static int state_info_draw_proc(struct menu_item *item,
                                 struct menu_draw_params *draw_params)
 {
@@ -471,6 +638,10 @@ static int state_info_draw_proc(struct menu_item *item,
     int cx = 11;
     gfx_printf(font, x + cw * cx, y + ch * 2,
                "%" PRIu32 "kb", state->size / 1024);
+    if (state->flags & STATE_DELTA)
+      gfx_printf(font, x + cw * cx, y + ch, "delta");
+    if (state->flags & STATE_LZ)
+      gfx_printf(font, x + cw * (cx + 6), y + ch, "lz");
     if (state->movie_frame != -1) {
       struct gfx_texture *t_macro = resource_get(RES_ICON_MACRO);
       int w = t_macro->tile_width;
@@ -542,6 +713,55 @@ static int hack_oca_input_proc(struct menu_item *item,
   return 0;
 }
 
+static int rewind_proc(struct menu_item *item,
+                       enum menu_callback_reason reason,
+                       void *data)
+{
+  if (reason == MENU_CALLBACK_SWITCH_ON)
+    settings->bits.rewind = 1;
+  else if (reason == MENU_CALLBACK_SWITCH_OFF)
+    settings->bits.rewind = 0;
+  else if (reason == MENU_CALLBACK_THINK) {
+    if (menu_checkbox_get(item) != settings->bits.rewind)
+      menu_checkbox_set(item, settings->bits.rewind);
+  }
+  return 0;
+}
+
+static int rewind_interval_proc(struct menu_item *item,
+                                enum menu_callback_reason reason,
+                                void *data)
+{
+  if (reason == MENU_CALLBACK_THINK_INACTIVE) {
+    if (menu_intinput_get(item) != settings->rewind_interval)
+      menu_intinput_set(item, settings->rewind_interval);
+  }
+  else if (reason == MENU_CALLBACK_CHANGED) {
+    int interval = menu_intinput_get(item);
+    if (interval < 1)
+      interval = 1;
+    else if (interval > 255)
+      interval = 255;
+    settings->rewind_interval = interval;
+  }
+  return 0;
+}
+
+/* each capture is a full savestate followed by packing, which runs on the
+   frame it is taken on. captures are put off when they would take more
+   than a tenth of the running time, so the actual interval can be longer
+   than the one that is set */
+static int rewind_cost_draw_proc(struct menu_item *item,
+                                 struct menu_draw_params *draw_params)
+{
+  gfx_mode_set(GFX_MODE_COLOR, GPACK_RGB24A8(draw_params->color,
+                                             draw_params->alpha));
+  uint32_t cost_us = gz_rewind_cost() * 1000000 / gz.cpu_counter_freq;
+  gfx_printf(draw_params->font, draw_params->x, draw_params->y,
+             "capture %" PRIu32 " us", cost_us);
+  return 1;
+}
+
 static int hack_oca_sync_proc(struct menu_item *item,
                               enum menu_callback_reason reason,
                               void *data)
@@ -746,6 +966,14 @@ struct menu *gz_macro_menu(void)
   menu_add_submenu(&menu, 0, 15, &menu_settings, "settings");
   /* create virtual controller controls */
   menu_add_submenu(&menu, 0, 16, &menu_vcont, "virtual controller");
+  /* create base state control */
+  menu_add_button(&menu, 0, 17, "set base state", base_state_proc, NULL);
+  menu_add_checkbox(&menu, 0, 18, compress_state_proc, NULL);
+  menu_add_static(&menu, 2, 18, "compress state", 0xC0C0C0);
+  /* create disk state controls */
+  menu_add_button(&menu, 0, 19, "save to disk", save_state_disk_proc, NULL);
+  menu_add_button(&menu, 13, 19, "load from disk", load_state_disk_proc,
+                  NULL);
   /* create tooltip */
   menu_add_tooltip(&menu, 8, 0, gz.menu_main, 0xC0C0C0);
 
@@ -762,6 +990,14 @@ struct menu *gz_macro_menu(void)
   menu_add_static(&menu_settings, 0, 5, "game settings", 0xC0C0C0);
   menu_add_checkbox(&menu_settings, 2, 6, wiivc_cam_proc, NULL);
   menu_add_static(&menu_settings, 4, 6, "wii vc camera", 0xC0C0C0);
+  menu_add_static(&menu_settings, 0, 7, "rewind settings", 0xC0C0C0);
+  menu_add_checkbox(&menu_settings, 2, 8, rewind_proc, NULL);
+  menu_add_static(&menu_settings, 4, 8, "capture states", 0xC0C0C0);
+  menu_add_static(&menu_settings, 2, 9, "interval", 0xC0C0C0);
+  menu_add_intinput(&menu_settings, 14, 9, 10, 3,
+                    rewind_interval_proc, NULL);
+  menu_add_static_custom(&menu_settings, 2, 10, rewind_cost_draw_proc, NULL,
+                         0xC0C0C0);
 
   /* populate virtual pad menu */
   menu_vcont.selector = menu_add_submenu(&menu_vcont, 0, 0, NULL, "return");
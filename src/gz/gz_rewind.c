@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "gz.h"
+#include "settings.h"
+#include "state.h"
+#include "zu.h"
+
+/* size of the rewind buffer, maximum number of captured states, and the
+   number of captures per key state. key states are stored in full, and
+   the captures that follow are stored as deltas of the last key state.
+   all captures are compressed */
+#define REWIND_SIZE       0x100000
+#define REWIND_MAX        64
+#define REWIND_KEY        8
+/* rewinding again within this many frames goes one capture further back */
+#define REWIND_STEP       20
+/* captures are put off as needed to keep them under this percentage of the
+   running time */
+#define REWIND_BUDGET     10
+
+struct rewind_rec
+{
+  uint32_t              offset;
+  uint32_t              size;
+  _Bool                 key;
+};
+
+static char              *rewind_buf = NULL;
+static struct rewind_rec  rewind_rec[REWIND_MAX];
+static int                rewind_first = 0;
+static int                rewind_n = 0;
+/* full copy of the last key state, and the number of captures since */
+static struct state_meta *rewind_base = NULL;
+static int                rewind_n_delta;
+/* frames since the last capture and since the last rewind */
+static int                rewind_timer;
+static int                rewind_step_timer = REWIND_STEP;
+/* cpu counter at the start of the last capture, and the cycles it took */
+static int64_t            rewind_time;
+static int64_t            rewind_cost;
+
+static struct rewind_rec *get_rec(int index)
+{
+  return &rewind_rec[(rewind_first + index) % REWIND_MAX];
+}
+
+static void set_base(struct state_meta *base)
+{
+  if (rewind_base)
+    free(rewind_base);
+  rewind_base = base;
+}
+
+/* drop the oldest key state along with its deltas */
+static void drop_oldest(void)
+{
+  do {
+    rewind_first = (rewind_first + 1) % REWIND_MAX;
+    --rewind_n;
+  } while (rewind_n > 0 && !get_rec(0)->key);
+  if (rewind_n == 0)
+    set_base(NULL);
+}
+
+static _Bool overlaps(uint32_t offset, uint32_t size)
+{
+  for (int i = 0; i < rewind_n; ++i) {
+    struct rewind_rec *rec = get_rec(i);
+    if (rec->offset < offset + size && offset < rec->offset + rec->size)
+      return 1;
+  }
+  return 0;
+}
+
+/* store a packed state in the buffer, replacing the oldest captures */
+static void store(struct state_meta *state, _Bool key)
+{
+  /* keep records aligned for the state readers */
+  uint32_t size = (state->size + 7) & ~7;
+  if (size > REWIND_SIZE)
+    return;
+  uint32_t offset = 0;
+  if (rewind_n > 0) {
+    struct rewind_rec *last = get_rec(rewind_n - 1);
+    offset = last->offset + last->size;
+  }
+  if (offset + size > REWIND_SIZE)
+    offset = 0;
+  while (rewind_n > 0 && (rewind_n == REWIND_MAX || overlaps(offset, size)))
+    drop_oldest();
+  /* a delta can not be kept without its key state */
+  if (!key && rewind_n == 0)
+    return;
+  struct rewind_rec *rec = get_rec(rewind_n++);
+  rec->offset = offset;
+  rec->size = size;
+  rec->key = key;
+  memcpy(&rewind_buf[offset], state, state->size);
+}
+
+static void do_capture(void)
+{
+  struct state_meta *state = gz_save_state();
+  if (!state)
+    return;
+  _Bool key = !rewind_base || rewind_n_delta >= REWIND_KEY - 1;
+  if (key) {
+    struct state_meta *base = malloc(state->size);
+    if (!base) {
+      free(state);
+      return;
+    }
+    memcpy(base, state, state->size);
+    set_base(base);
+    rewind_n_delta = 0;
+  }
+  else
+    ++rewind_n_delta;
+  state = state_pack(key ? NULL : rewind_base, state, 1);
+  store(state, key);
+  if (state_prof.enabled)
+    state_prof.capture.n_bytes += state->size;
+  free(state);
+}
+
+/* capture a state, and account for the time it takes */
+static void capture(void)
+{
+  gz_update_cpu_counter();
+  rewind_time = gz.cpu_counter;
+  do_capture();
+  gz_update_cpu_counter();
+  rewind_cost = gz.cpu_counter - rewind_time;
+  if (state_prof.enabled) {
+    ++state_prof.n_capture;
+    state_prof.capture.n_cycles += rewind_cost;
+    if (rewind_cost > state_prof.capture_max)
+      state_prof.capture_max = rewind_cost;
+  }
+}
+
+void gz_rewind_clear(void)
+{
+  if (rewind_buf) {
+    free(rewind_buf);
+    rewind_buf = NULL;
+  }
+  set_base(NULL);
+  rewind_n = 0;
+  state_cache_clear();
+}
+
+/* capture states at the set interval, call once per frame */
+void gz_rewind_update(void)
+{
+  if (!settings->bits.rewind) {
+    if (rewind_buf)
+      gz_rewind_clear();
+    return;
+  }
+  if (!rewind_buf) {
+    rewind_buf = malloc(REWIND_SIZE);
+    if (!rewind_buf) {
+      gz_log("rewind: out of memory");
+      settings->bits.rewind = 0;
+      return;
+    }
+    rewind_n = 0;
+    rewind_timer = settings->rewind_interval;
+    rewind_cost = 0;
+  }
+  /* only count frames that advance the game */
+  if (!gz.frame_flag)
+    return;
+  if (rewind_step_timer < REWIND_STEP)
+    ++rewind_step_timer;
+  if (++rewind_timer >= settings->rewind_interval && zu_in_game() &&
+      gz.cpu_counter - rewind_time >= rewind_cost * (100 / REWIND_BUDGET))
+  {
+    rewind_timer = 0;
+    capture();
+  }
+}
+
+/* get the cpu counter cycles taken by the last capture */
+int64_t gz_rewind_cost(void)
+{
+  return rewind_cost;
+}
+
+static struct state_meta *get_state(int index)
+{
+  return (void *)&rewind_buf[get_rec(index)->offset];
+}
+
+/* load the last capture, or the one before it when called again shortly
+   after a rewind. newer captures are dropped */
+void gz_rewind_step(void)
+{
+  if (!settings->bits.rewind || rewind_n == 0) {
+    gz_log("nothing to rewind");
+    return;
+  }
+  if (rewind_step_timer < REWIND_STEP && rewind_n > 1)
+    --rewind_n;
+  /* find the key state of the capture */
+  int index = rewind_n - 1;
+  int key = index;
+  while (!get_rec(key)->key)
+    --key;
+  struct state_meta *base = state_unpack(NULL, get_state(key));
+  struct state_meta *state = base;
+  if (base && index != key)
+    state = state_unpack(base, get_state(index));
+  if (!state) {
+    int e = errno;
+    if (base && base != get_state(key))
+      free(base);
+    gz_log("rewind failed: %s", strerror(e));
+    return;
+  }
+  gz_load_state(state);
+  if (state != base && state != get_state(index))
+    free(state);
+  /* continue capturing from the restored state */
+  if (base == get_state(key)) {
+    base = malloc(base->size);
+    if (base)
+      memcpy(base, get_state(key), get_state(key)->size);
+  }
+  set_base(base);
+  rewind_n_delta = index - key;
+  rewind_timer = 0;
+  rewind_step_timer = 0;
+  gz_log("rewind %i", rewind_n - 1);
+}
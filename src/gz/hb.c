@@ -29,35 +29,84 @@ int hb_sd_init(void)
     return -1;
 }
 
-int hb_sd_read(uint32_t lba, uint32_t n_blocks, void *dst)
+/* queue an sd transfer without waiting for it to complete. returns -1 and
+   sets errno to EAGAIN if the device queue is full */
+int hb_sd_submit(uint32_t lba, uint32_t n_blocks, void *buf, _Bool write)
 {
-  if (hb_check() == -1)
+  if (hb_check() == -1) {
+    errno = ENODEV;
     return -1;
-  hb_regs.sd_dram_addr = MIPS_KSEG0_TO_PHYS(dst);
+  }
+  hb_regs.sd_dram_addr = MIPS_KSEG0_TO_PHYS(buf);
   hb_regs.sd_n_blocks = n_blocks;
-  hb_regs.sd_read_lba = lba;
-  while (hb_regs.status & HB_STATUS_SD_BUSY)
-    ;
-  if (hb_regs.status & HB_STATUS_ERROR)
-    return -1;
+  if (write)
+    hb_regs.sd_write_lba = lba;
   else
-    return 0;
+    hb_regs.sd_read_lba = lba;
+  uint32_t error = (hb_regs.status & HB_STATUS_ERROR) >> 5;
+  if (error == HB_ERROR_QUEUEFULL) {
+    errno = EAGAIN;
+    return -1;
+  }
+  else if (error != HB_ERROR_SUCCESS) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
 }
 
-int hb_sd_write(uint32_t lba, uint32_t n_blocks, void *src)
+/* check on queued transfers, returns 1 if any are still in progress,
+   0 if all have completed, and -1 if a transfer failed */
+int hb_sd_poll(void)
 {
-  if (hb_check() == -1)
+  if (hb_check() == -1) {
+    errno = ENODEV;
     return -1;
+  }
+  uint32_t status = hb_regs.status;
+  if (status & HB_STATUS_SD_BUSY)
+    return 1;
+  if (status & HB_STATUS_ERROR) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* wait for all queued transfers to complete */
+int hb_sd_sync(void)
+{
+  int e;
+  do
+    e = hb_sd_poll();
+  while (e == 1);
+  return e;
+}
+
+/* queue a transfer, waiting for room in the queue if needed */
+static int sd_submit_wait(uint32_t lba, uint32_t n_blocks, void *buf,
+                          _Bool write)
+{
+  while (hb_sd_submit(lba, n_blocks, buf, write)) {
+    if (errno != EAGAIN || hb_sd_sync())
+      return -1;
+  }
+  return 0;
+}
+
+int hb_sd_read(uint32_t lba, uint32_t n_blocks, void *dst)
+{
+  if (sd_submit_wait(lba, n_blocks, dst, 0))
+    return -1;
+  return hb_sd_sync();
+}
+
+int hb_sd_write(uint32_t lba, uint32_t n_blocks, void *src)
+{
   if (src) {
-    hb_regs.sd_dram_addr = MIPS_KSEG0_TO_PHYS(src);
-    hb_regs.sd_n_blocks = n_blocks;
-    hb_regs.sd_write_lba = lba;
-    while (hb_regs.status & HB_STATUS_SD_BUSY)
-      ;
-    if (hb_regs.status & HB_STATUS_ERROR)
+    if (sd_submit_wait(lba, n_blocks, src, 1))
       return -1;
-    else
-      return 0;
+    return hb_sd_sync();
   }
   else {
     char data[0x200] = {0};
@@ -40,6 +40,9 @@ int hb_check(void);
 int hb_sd_init(void);
 int hb_sd_read(uint32_t lba, uint32_t n_blocks, void *dst);
 int hb_sd_write(uint32_t lba, uint32_t n_blocks, void *src);
+int hb_sd_submit(uint32_t lba, uint32_t n_blocks, void *buf, _Bool write);
+int hb_sd_poll(void);
+int hb_sd_sync(void);
 int hb_reset(uint32_t dram_save_addr, uint32_t dram_save_len);
 int hb_get_timebase(uint32_t *hi, uint32_t *lo);
 int hb_get_timebase64(uint64_t *tb);
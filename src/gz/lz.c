@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "lz.h"
+
+/* lz4-style block codec. each sequence is a token byte holding the
+   literal count in the high nibble and the match length less 4 in the
+   low nibble, followed by extra length bytes for the literal count, the
+   literals, a 16-bit little endian match distance, and extra length bytes
+   for the match length. a nibble of 15 is continued by length bytes up to
+   and including the first byte that is not 255. the last sequence has no
+   match */
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_DIST     0xFFFF
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *p, uint32_t n)
+{
+  for (; n >= 0xFF; n -= 0xFF)
+    *p++ = 0xFF;
+  *p++ = n;
+  return p;
+}
+
+static int get_len(const uint8_t **p, const uint8_t *end, uint32_t *n)
+{
+  const uint8_t *cp = *p;
+  uint8_t c;
+  do {
+    if (cp == end)
+      return -1;
+    c = *cp++;
+    *n += c;
+  } while (c == 0xFF);
+  *p = cp;
+  return 0;
+}
+
+static uint8_t *put_seq(uint8_t *p, const uint8_t *lit, uint32_t n_lit,
+                        uint32_t dist, uint32_t len)
+{
+  uint8_t *token = p++;
+  *token = (n_lit < 15 ? n_lit : 15) << 4;
+  if (n_lit >= 15)
+    p = put_len(p, n_lit - 15);
+  memcpy(p, lit, n_lit);
+  p += n_lit;
+  if (dist != 0) {
+    *token |= len < 15 ? len : 15;
+    *p++ = dist;
+    *p++ = dist >> 8;
+    if (len >= 15)
+      p = put_len(p, len - 15);
+  }
+  return p;
+}
+
+/* compress `size` bytes from `src` to `dst`. returns the compressed size,
+   or 0 if it does not fit in `dst_size` bytes */
+uint32_t lz_compress(const void *src, uint32_t size,
+                     void *dst, uint32_t dst_size)
+{
+  uint32_t *table = calloc(1 << LZ_HASH_BITS, sizeof(*table));
+  if (!table) {
+    errno = ENOMEM;
+    return 0;
+  }
+  const uint8_t *base = src;
+  const uint8_t *end = base + size;
+  const uint8_t *ip = base;
+  const uint8_t *anchor = base;
+  uint8_t *op = dst;
+  uint8_t *op_end = op + dst_size;
+  while (end - ip >= LZ_MIN_MATCH) {
+    uint32_t v = read32(ip);
+    uint32_t h = hash(v);
+    const uint8_t *ref = base + table[h];
+    table[h] = ip - base;
+    if (ref >= ip || ip - ref > LZ_MAX_DIST || read32(ref) != v) {
+      /* skip ahead faster through data that does not compress */
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    const uint8_t *mp = ip + LZ_MIN_MATCH;
+    const uint8_t *rp = ref + LZ_MIN_MATCH;
+    while (mp < end && *mp == *rp) {
+      ++mp;
+      ++rp;
+    }
+    uint32_t n_lit = ip - anchor;
+    uint32_t len = mp - ip - LZ_MIN_MATCH;
+    if (op_end - op < n_lit + n_lit / 0xFF + len / 0xFF + 5)
+      goto nospc;
+    op = put_seq(op, anchor, n_lit, ip - ref, len);
+    ip = anchor = mp;
+  }
+  uint32_t n_lit = end - anchor;
+  if (op_end - op < n_lit + n_lit / 0xFF + 2)
+    goto nospc;
+  op = put_seq(op, anchor, n_lit, 0, 0);
+  free(table);
+  return op - (uint8_t *)dst;
+nospc:
+  free(table);
+  errno = ENOSPC;
+  return 0;
+}
+
+/* decompress `size` bytes from `src` to exactly `dst_size` bytes at
+   `dst` */
+int lz_decompress(const void *src, uint32_t size,
+                  void *dst, uint32_t dst_size)
+{
+  const uint8_t *ip = src;
+  const uint8_t *end = ip + size;
+  uint8_t *op = dst;
+  uint8_t *op_end = op + dst_size;
+  while (ip < end) {
+    uint8_t token = *ip++;
+    uint32_t n_lit = token >> 4;
+    if (n_lit == 15 && get_len(&ip, end, &n_lit))
+      goto error;
+    if (n_lit > end - ip || n_lit > op_end - op)
+      goto error;
+    memcpy(op, ip, n_lit);
+    ip += n_lit;
+    op += n_lit;
+    if (ip == end)
+      break;
+    if (end - ip < 2)
+      goto error;
+    uint32_t dist = ip[0] | ip[1] << 8;
+    ip += 2;
+    uint32_t len = token & 0xF;
+    if (len == 15 && get_len(&ip, end, &len))
+      goto error;
+    len += LZ_MIN_MATCH;
+    if (dist == 0 || dist > op - (uint8_t *)dst || len > op_end - op)
+      goto error;
+    const uint8_t *rp = op - dist;
+    if (dist >= len) {
+      memcpy(op, rp, len);
+      op += len;
+    }
+    else {
+      while (len-- > 0)
+        *op++ = *rp++;
+    }
+  }
+  if (op != op_end)
+    goto error;
+  return 0;
+error:
+  errno = EINVAL;
+  return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+#include <stdint.h>
+
+uint32_t lz_compress(const void *src, uint32_t size,
+                     void *dst, uint32_t dst_size);
+int      lz_decompress(const void *src, uint32_t size,
+                       void *dst, uint32_t dst_size);
+
+#endif
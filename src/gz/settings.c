@@ -65,6 +65,7 @@ void settings_load_default(void)
   d->bits.hit_view_xlu = 1;
   d->bits.hit_view_shade = 1;
   d->bits.watches_visible = 1;
+  d->bits.rewind = 0;
   d->menu_x = 20;
   d->menu_y = 64;
   d->input_display_x = 20;
@@ -84,6 +85,7 @@ void settings_load_default(void)
     d->teleport_rot[i] = 0;
   }
   d->teleport_slot = 0;
+  d->rewind_interval = 20;
   d->warp_entrance = 0;
   d->binds[COMMAND_MENU] = bind_make(2, BUTTON_R, BUTTON_L);
   d->binds[COMMAND_RETURN] = bind_make(2, BUTTON_R, BUTTON_D_LEFT);
@@ -107,6 +109,7 @@ void settings_load_default(void)
   d->binds[COMMAND_LOADPOS] = bind_make(0);
   d->binds[COMMAND_PREVSTATE] = bind_make(0);
   d->binds[COMMAND_NEXTSTATE] = bind_make(0);
+  d->binds[COMMAND_REWIND] = bind_make(0);
   d->binds[COMMAND_PREVFILE] = bind_make(0);
   d->binds[COMMAND_NEXTFILE] = bind_make(0);
   d->binds[COMMAND_PREVPOS] = bind_make(0);
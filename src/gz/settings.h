@@ -8,8 +8,8 @@
 #define SETTINGS_MAXSIZE            (0x8000-(SETTINGS_ADDRESS))
 #define SETTINGS_PADSIZE            ((sizeof(struct settings)+1)/2*2)
 #define SETTINGS_PROFILE_MAX        ((SETTINGS_MAXSIZE)/(SETTINGS_PADSIZE))
-#define SETTINGS_VERSION            0x0003
-#define SETTINGS_STATE_VERSION      0x0003
+#define SETTINGS_VERSION            0x0004
+#define SETTINGS_STATE_VERSION      0x0006
 
 #define SETTINGS_WATCHES_MAX        18
 #define SETTINGS_TELEPORT_MAX       9
@@ -79,6 +79,7 @@ enum commands
   COMMAND_LOADPOS,
   COMMAND_PREVSTATE,
   COMMAND_NEXTSTATE,
+  COMMAND_REWIND,
   COMMAND_PREVFILE,
   COMMAND_NEXTFILE,
   COMMAND_PREVPOS,
@@ -137,6 +138,7 @@ struct settings_bits
   uint32_t hit_view_xlu    : 1;
   uint32_t hit_view_shade  : 1;
   uint32_t watches_visible : 1;
+  uint32_t rewind          : 1;
 };
 
 struct settings_data
@@ -163,6 +165,7 @@ struct settings_data
   uint16_t              binds[SETTINGS_BIND_MAX];
   struct watch_info     watch_info[SETTINGS_WATCHES_MAX];
   uint8_t               teleport_slot;
+  uint8_t               rewind_interval;
   uint8_t               n_watches;
 };
 
@@ -1,40 +1,314 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <mips.h>
 #include <n64.h>
-#include <set/set.h>
+#include <vector/vector.h>
 #include "gz.h"
+#include "lz.h"
 #include "state.h"
 #include "sys.h"
 #include "yaz0.h"
 #include "zu.h"
 #include "z64.h"
 
-static void serial_write(void **p, void *data, uint32_t length)
+/* size of the staging buffer for states that are streamed to or from a
+   file */
+#define STATE_IO_CHUNK  0x2000
+
+/* a state being serialized. memory streams read and write the state
+   directly, file streams go through a staging buffer that is flushed or
+   refilled whenever it runs out */
+struct state_io
+{
+  char                 *buf;
+  char                 *pos;
+  char                 *end;
+  uint32_t              offset;
+  int                   fd;
+  _Bool                 load;
+  int                   error;
+};
+
+static void io_mem(struct state_io *io, void *state, _Bool load)
+{
+  io->buf = state;
+  io->pos = state;
+  io->end = NULL;
+  io->offset = 0;
+  io->fd = -1;
+  io->load = load;
+  io->error = 0;
+}
+
+static int io_file(struct state_io *io, int fd, _Bool load)
+{
+  io->buf = malloc(STATE_IO_CHUNK);
+  if (!io->buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+  io->pos = io->buf;
+  io->end = load ? io->buf : io->buf + STATE_IO_CHUNK;
+  io->offset = 0;
+  io->fd = fd;
+  io->load = load;
+  io->error = 0;
+  return 0;
+}
+
+/* flush the staging buffer of a file stream, returns 0 or -1 on error */
+static int io_close(struct state_io *io)
+{
+  if (io->fd != -1) {
+    uint32_t n = io->pos - io->buf;
+    if (!io->load && n > 0 && io->error == 0 &&
+        write(io->fd, io->buf, n) != n)
+    {
+      io->error = errno;
+    }
+    free(io->buf);
+  }
+  if (io->error) {
+    errno = io->error;
+    return -1;
+  }
+  return 0;
+}
+
+/* write out or refill the staging buffer of a file stream. after an
+   error, writes are discarded and reads come up empty */
+static void io_next(struct state_io *io)
+{
+  uint32_t n = io->pos - io->buf;
+  io->offset += n;
+  io->pos = io->buf;
+  if (io->load) {
+    int r = 0;
+    if (io->error == 0) {
+      r = read(io->fd, io->buf, STATE_IO_CHUNK);
+      if (r == 0)
+        io->error = EINVAL;
+      else if (r == -1) {
+        io->error = errno;
+        r = 0;
+      }
+    }
+    io->end = io->buf + r;
+  }
+  else if (io->error == 0 && write(io->fd, io->buf, n) != n)
+    io->error = errno;
+}
+
+/* get the current position in the state */
+static uint32_t io_tell(struct state_io *io)
+{
+  return io->offset + (io->pos - io->buf);
+}
+
+static void serial_write(struct state_io *io, void *data, uint32_t length)
+{
+  if (io->fd == -1) {
+    memcpy(io->pos, data, length);
+    io->pos += length;
+    return;
+  }
+  char *cp = data;
+  while (length > 0) {
+    if (io->pos == io->end)
+      io_next(io);
+    uint32_t n = io->end - io->pos;
+    if (n > length)
+      n = length;
+    memcpy(io->pos, cp, n);
+    io->pos += n;
+    cp += n;
+    length -= n;
+  }
+}
+
+static void serial_read(struct state_io *io, void *data, uint32_t length)
+{
+  if (io->fd == -1) {
+    memcpy(data, io->pos, length);
+    io->pos += length;
+    return;
+  }
+  char *cp = data;
+  while (length > 0) {
+    if (io->pos == io->end)
+      io_next(io);
+    uint32_t n = io->end - io->pos;
+    if (n == 0) {
+      /* a truncated or unreadable file, zero the rest of the data rather
+         than leaving it half loaded */
+      memset(cp, 0, length);
+      break;
+    }
+    if (n > length)
+      n = length;
+    memcpy(cp, io->pos, n);
+    io->pos += n;
+    cp += n;
+    length -= n;
+  }
+}
+
+static void serial_skip(struct state_io *io, uint32_t length)
+{
+  if (io->fd == -1) {
+    io->pos += length;
+    return;
+  }
+  while (length > 0) {
+    if (io->pos == io->end)
+      io_next(io);
+    uint32_t n = io->end - io->pos;
+    if (n == 0)
+      break;
+    if (n > length)
+      n = length;
+    if (!io->load)
+      memset(io->pos, 0, n);
+    io->pos += n;
+    length -= n;
+  }
+}
+
+/* pristine overlay data segments, decompressed from rom on first use and
+   sorted by vrom address. the cache is limited to OVL_DATA_CAP bytes, and
+   the least recently used entries are dropped to make room */
+#define OVL_DATA_CAP    0x20000
+
+struct ovl_data
+{
+  uint32_t              vrom_start;
+  uint32_t              last_use;
+  char                 *data;
+  z64_ovl_hdr_t         hdr;
+};
+
+static struct vector ovl_data_cache;
+static _Bool         ovl_data_ready = 0;
+static uint32_t      ovl_data_size = 0;
+static uint32_t      ovl_data_clock = 0;
+
+static uint32_t ovl_data_cost(struct ovl_data *od)
 {
-  char *cp = *p;
-  memcpy(cp, data, length);
-  cp += length;
-  *p = cp;
+  return sizeof(*od) + od->hdr.data_size;
 }
 
-static void serial_read(void **p, void *data, uint32_t length)
+static void drop_ovl_data(size_t index)
 {
-  char *cp = *p;
-  memcpy(data, cp, length);
-  cp += length;
-  *p = cp;
+  struct ovl_data *od = vector_at(&ovl_data_cache, index);
+  ovl_data_size -= ovl_data_cost(od);
+  if (od->data)
+    free(od->data);
+  vector_erase(&ovl_data_cache, index, 1);
 }
 
-static void serial_skip(void **p, uint32_t length)
+static size_t find_ovl_data(uint32_t vrom_start)
 {
-  char *cp = *p;
-  cp += length;
-  *p = cp;
+  size_t lo = 0;
+  size_t hi = ovl_data_cache.size;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    struct ovl_data *od = vector_at(&ovl_data_cache, mid);
+    if (od->vrom_start < vrom_start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static struct ovl_data *get_ovl_data(z64_ftab_t *file, uint32_t hdr_pos)
+{
+  if (!ovl_data_ready) {
+    vector_init(&ovl_data_cache, sizeof(struct ovl_data));
+    ovl_data_ready = 1;
+  }
+  size_t pos = find_ovl_data(file->vrom_start);
+  if (pos < ovl_data_cache.size) {
+    struct ovl_data *od = vector_at(&ovl_data_cache, pos);
+    if (od->vrom_start == file->vrom_start) {
+      od->last_use = ++ovl_data_clock;
+      return od;
+    }
+  }
+  struct ovl_data od;
+  od.vrom_start = file->vrom_start;
+  od.last_use = ++ovl_data_clock;
+  yaz0_begin(file->prom_start);
+  yaz0_advance(hdr_pos);
+  yaz0_read(&od.hdr, sizeof(od.hdr));
+  if (ovl_data_cost(&od) > OVL_DATA_CAP)
+    return NULL;
+  /* evict least recently used entries */
+  while (ovl_data_size + ovl_data_cost(&od) > OVL_DATA_CAP) {
+    size_t lru = 0;
+    for (size_t i = 1; i < ovl_data_cache.size; ++i) {
+      struct ovl_data *a = vector_at(&ovl_data_cache, i);
+      struct ovl_data *b = vector_at(&ovl_data_cache, lru);
+      if (a->last_use < b->last_use)
+        lru = i;
+    }
+    drop_ovl_data(lru);
+  }
+  od.data = NULL;
+  if (od.hdr.data_size > 0) {
+    od.data = malloc(od.hdr.data_size);
+    if (!od.data)
+      return NULL;
+    yaz0_begin(file->prom_start);
+    yaz0_advance(od.hdr.text_size);
+    yaz0_read(od.data, od.hdr.data_size);
+  }
+  pos = find_ovl_data(od.vrom_start);
+  struct ovl_data *r = vector_insert(&ovl_data_cache, pos, 1, &od);
+  if (r)
+    ovl_data_size += ovl_data_cost(&od);
+  else if (od.data)
+    free(od.data);
+  return r;
+}
+
+void state_cache_clear(void)
+{
+  if (!ovl_data_ready)
+    return;
+  while (ovl_data_cache.size > 0)
+    drop_ovl_data(ovl_data_cache.size - 1);
+  vector_destroy(&ovl_data_cache);
+  ovl_data_ready = 0;
+  ovl_data_size = 0;
+}
+
+/* get the number of bytes from the start of `a` and `b` that are equal,
+   or not equal, comparing words where possible */
+static uint32_t run_len(const char *a, const char *b, uint32_t n,
+                        _Bool equal)
+{
+  uint32_t i = 0;
+  if ((((uint32_t)a ^ (uint32_t)b) & 3) == 0) {
+    for (; i < n && ((uint32_t)&a[i] & 3) != 0; ++i) {
+      if ((a[i] == b[i]) != equal)
+        return i;
+    }
+    for (; i + 4 <= n; i += 4) {
+      if ((*(uint32_t*)&a[i] == *(uint32_t*)&b[i]) != equal)
+        break;
+    }
+  }
+  for (; i < n; ++i) {
+    if ((a[i] == b[i]) != equal)
+      break;
+  }
+  return i;
 }
 
-static void save_ovl(void **p, void *addr,
+static void save_ovl(struct state_io *p, void *addr,
                      uint32_t vrom_start, uint32_t vrom_end)
 {
   /* locate file table entry */
@@ -56,6 +330,7 @@ static void save_ovl(void **p, void *addr,
   uint32_t *hdr_off = (void*)(end - sizeof(*hdr_off));
   if (*hdr_off == 0)
     return;
+  struct ovl_data *od = get_ovl_data(file, end - *hdr_off - start);
   z64_ovl_hdr_t *hdr;
 #if Z64_VERSION == Z64_OOT10 || \
     Z64_VERSION == Z64_OOT11 || \
@@ -67,49 +342,42 @@ static void save_ovl(void **p, void *addr,
       Z64_VERSION == Z64_OOTGCU || \
       Z64_VERSION == Z64_OOTCEJ
   z64_ovl_hdr_t l_hdr;
-  hdr = &l_hdr;
-  yaz0_begin(file->prom_start);
-  yaz0_advance(end - *hdr_off - start);
-  yaz0_read(hdr, sizeof(*hdr));
+  if (od)
+    hdr = &od->hdr;
+  else {
+    hdr = &l_hdr;
+    yaz0_begin(file->prom_start);
+    yaz0_advance(end - *hdr_off - start);
+    yaz0_read(hdr, sizeof(*hdr));
+  }
   serial_write(p, hdr, sizeof(*hdr));
 #endif
   char *data = start + hdr->text_size;
   char *bss = end;
-  /* save data segment */
-  if (hdr->data_size > 0) {
-    yaz0_begin(file->prom_start);
-    yaz0_advance(hdr->text_size);
-  }
-  uint16_t n_copy = 0;
-  uint16_t n_save = 0;
-  char *save_data = NULL;
-  for (uint32_t i = 0; i < hdr->data_size; ++i) {
-    if (yaz0_get_byte() == data[i]) {
-      if (n_save > 0) {
-        serial_write(p, &n_copy, sizeof(n_copy));
-        serial_write(p, &n_save, sizeof(n_save));
-        serial_write(p, save_data, n_save);
-        n_copy = 0;
-        n_save = 0;
-      }
-      ++n_copy;
-    }
-    else {
-      if (n_save == 0)
-        save_data = &data[i];
-      ++n_save;
-    }
-  }
-  if (n_copy > 0 || n_save > 0) {
+  /* save data segment as runs of pristine and modified bytes. without
+     the pristine data, save all of it */
+  for (uint32_t i = 0; i < hdr->data_size; ) {
+    uint32_t n = hdr->data_size - i;
+    if (n > 0xFFFF)
+      n = 0xFFFF;
+    uint16_t n_copy = 0;
+    if (od)
+      n_copy = run_len(&data[i], &od->data[i], n, 1);
+    i += n_copy;
+    n -= n_copy;
+    uint16_t n_save = n;
+    if (od)
+      n_save = run_len(&data[i], &od->data[i], n, 0);
     serial_write(p, &n_copy, sizeof(n_copy));
     serial_write(p, &n_save, sizeof(n_save));
-    serial_write(p, save_data, n_save);
+    serial_write(p, &data[i], n_save);
+    i += n_save;
   }
   /* save bss segment */
   serial_write(p, bss, hdr->bss_size);
 }
 
-static void load_ovl(void **p, void **p_addr,
+static void load_ovl(struct state_io *p, void **p_addr,
                      uint32_t vrom_start, uint32_t vrom_end,
                      uint32_t vram_start, uint32_t vram_end)
 {
@@ -156,21 +424,29 @@ static void load_ovl(void **p, void **p_addr,
 #endif
   char *data = start + hdr->text_size;
   char *bss = end;
-  /* restore data segment */
+  /* restore data segment, from the pristine data if it is available or
+     by decompressing the overlay otherwise */
+  struct ovl_data *od = NULL;
   if (hdr->data_size > 0) {
-    yaz0_begin(file->prom_start);
-    yaz0_advance(hdr->text_size);
+    od = get_ovl_data(file, end - *hdr_off - start);
+    if (!od) {
+      yaz0_begin(file->prom_start);
+      yaz0_advance(hdr->text_size);
+    }
   }
   for (uint32_t i = 0; i < hdr->data_size; ) {
     uint16_t n_copy = 0;
     uint16_t n_save = 0;
     serial_read(p, &n_copy, sizeof(n_copy));
     serial_read(p, &n_save, sizeof(n_save));
-    yaz0_read(&data[i], n_copy);
+    if (od)
+      memcpy(&data[i], &od->data[i], n_copy);
+    else
+      yaz0_read(&data[i], n_copy);
     i += n_copy;
     serial_read(p, &data[i], n_save);
     i += n_save;
-    if (i < hdr->data_size)
+    if (!od && i < hdr->data_size)
       yaz0_advance(n_save);
   }
   /* restore bss segment */
@@ -440,270 +716,374 @@ static void grayscale_texture(uint32_t *pixels, uint16_t n_pixels)
   }
 }
 
-static _Bool addr_comp(void *a, void *b)
+/* addresses of the loaded overlays, sorted so that the arena nodes that
+   hold them can be looked up without allocating. this is kept in static
+   memory, as it is too large for the stack. it replaced a set, and the
+   two have not been timed against each other; the "overlays" and "arena"
+   columns of the savestate profiler cover the inserts and lookups */
+#define OVL_TAB_LEN(t)  (sizeof(t) / sizeof(*(t)))
+#define OVL_NODE_MAX    (OVL_TAB_LEN(z64_actor_ovl_tab) + \
+                         OVL_TAB_LEN(z64_play_ovl_tab) + \
+                         OVL_TAB_LEN(z64_part_ovl_tab) + 1)
+
+struct ovl_nodes
+{
+  int                   n;
+  void                 *addr[OVL_NODE_MAX];
+};
+
+static struct ovl_nodes ovl_nodes;
+
+static void ovl_nodes_insert(struct ovl_nodes *on, void *addr)
 {
-  uint32_t *a_u32 = a;
-  uint32_t *b_u32 = b;
-  return *a_u32 < *b_u32;
+  int i;
+  for (i = on->n; i > 0 && on->addr[i - 1] > addr; --i)
+    on->addr[i] = on->addr[i - 1];
+  on->addr[i] = addr;
+  ++on->n;
 }
 
-uint32_t save_state(void *state)
+static _Bool ovl_nodes_get(struct ovl_nodes *on, void *addr)
+{
+  int lo = 0;
+  int hi = on->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (on->addr[mid] == addr)
+      return 1;
+    else if (on->addr[mid] < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+struct state_prof state_prof;
+
+const char *state_prof_name[STATE_PROF_MAX] =
+{
+  "sequencer",
+  "context",
+  "overlays",
+  "arena",
+  "particles",
+  "collision",
+  "scene",
+  "display",
+  "other",
+};
+
+/* the table being updated, and the counter and position of the last mark */
+static struct state_prof_stat  *prof_stat;
+static int64_t                  prof_count;
+static uint32_t                 prof_pos;
+
+static void prof_start(struct state_io *io)
+{
+  if (!state_prof.enabled) {
+    prof_stat = NULL;
+    return;
+  }
+  if (io->load) {
+    prof_stat = state_prof.load;
+    ++state_prof.n_load;
+  }
+  else {
+    prof_stat = state_prof.save;
+    ++state_prof.n_save;
+  }
+  gz_update_cpu_counter();
+  prof_count = gz.cpu_counter;
+  prof_pos = io_tell(io);
+}
+
+/* add the cycles and bytes since the last mark to a section */
+static void prof_mark(enum state_prof_sect sect, struct state_io *io)
+{
+  if (!prof_stat)
+    return;
+  gz_update_cpu_counter();
+  prof_stat[sect].n_cycles += gz.cpu_counter - prof_count;
+  prof_stat[sect].n_bytes += io_tell(io) - prof_pos;
+  prof_count = gz.cpu_counter;
+  prof_pos = io_tell(io);
+}
+
+void state_prof_reset(void)
 {
-  void *p = state;
+  state_prof.n_save = 0;
+  state_prof.n_load = 0;
+  memset(state_prof.save, 0, sizeof(state_prof.save));
+  memset(state_prof.load, 0, sizeof(state_prof.load));
+  state_prof.n_capture = 0;
+  memset(&state_prof.capture, 0, sizeof(state_prof.capture));
+  state_prof.capture_max = 0;
+}
 
+static void save_io(struct state_io *p)
+{
   /* allocate metadata */
-  serial_skip(&p, sizeof(struct state_meta));
+  serial_skip(p, sizeof(struct state_meta));
+  prof_start(p);
 
   /* save sequencer info */
   for (int i = 0; i < 4; ++i) {
     z64_seq_ctl_t *sc = &z64_seq_ctl[i];
     char *seq = &z64_afx[0x3530 + i * 0x0160];
     _Bool seq_active = (*(uint8_t*)(seq) & 0x80) || z64_afx_config_busy;
-    serial_write(&p, &seq_active, sizeof(seq_active));
+    serial_write(p, &seq_active, sizeof(seq_active));
     if (seq_active) {
-      serial_write(&p, &sc->stop_cmd_timer, sizeof(sc->stop_cmd_timer));
-      serial_write(&p, &sc->stop_cmd_count, sizeof(sc->stop_cmd_count));
-      serial_write(&p, &sc->stop_cmd_buf,
+      serial_write(p, &sc->stop_cmd_timer, sizeof(sc->stop_cmd_timer));
+      serial_write(p, &sc->stop_cmd_count, sizeof(sc->stop_cmd_count));
+      serial_write(p, &sc->stop_cmd_buf,
                    sizeof(*sc->stop_cmd_buf) * sc->stop_cmd_count);
     }
-    serial_write(&p, &sc->seq_idx, sizeof(sc->seq_idx));
+    serial_write(p, &sc->seq_idx, sizeof(sc->seq_idx));
     if (sc->vs_time != 0)
-      serial_write(&p, &sc->vs_target, sizeof(sc->vs_target));
+      serial_write(p, &sc->vs_target, sizeof(sc->vs_target));
     else
-      serial_write(&p, &sc->vs_current, sizeof(sc->vs_current));
-    serial_write(&p, &sc->vp_factors, sizeof(sc->vp_factors));
+      serial_write(p, &sc->vs_current, sizeof(sc->vs_current));
+    serial_write(p, &sc->vp_factors, sizeof(sc->vp_factors));
     uint16_t seq_ch_mute = 0;
     for (int j = 0; j < 16; ++j) {
       char *ch = *(void**)(seq + 0x0038 + j * 0x0004);
       _Bool ch_mute = *(uint8_t*)(ch) & 0x10;
       seq_ch_mute |= ch_mute << j;
     }
-    serial_write(&p, &seq_ch_mute, sizeof(seq_ch_mute));
+    serial_write(p, &seq_ch_mute, sizeof(seq_ch_mute));
   }
 
   /* save afx config */
-  serial_write(&p, &z64_afx_cfg, sizeof(z64_afx_cfg));
+  serial_write(p, &z64_afx_cfg, sizeof(z64_afx_cfg));
+  prof_mark(STATE_PROF_SEQ, p);
 
   int16_t sot = 0;
   int16_t eot = -1;
   /* save context */
-  serial_write(&p, &z64_game, sizeof(z64_game));
-  serial_write(&p, &z64_file, sizeof(z64_file));
-  serial_write(&p, z64_file.gameinfo, sizeof(*z64_file.gameinfo));
+  serial_write(p, &z64_game, sizeof(z64_game));
+  serial_write(p, &z64_file, sizeof(z64_file));
+  serial_write(p, z64_file.gameinfo, sizeof(*z64_file.gameinfo));
+  prof_mark(STATE_PROF_CTXT, p);
   /* save overlays */
   int16_t n_ovl;
-  struct set ovl_nodes;
-  set_init(&ovl_nodes, sizeof(uint32_t), addr_comp);
+  ovl_nodes.n = 0;
   /* actor overlays */
   n_ovl = sizeof(z64_actor_ovl_tab) / sizeof(*z64_actor_ovl_tab);
   for (int16_t i = 0; i < n_ovl; ++i) {
     z64_actor_ovl_t *ovl = &z64_actor_ovl_tab[i];
     if (ovl->ptr) {
-      serial_write(&p, &i, sizeof(i));
-      serial_write(&p, &ovl->n_inst, sizeof(ovl->n_inst));
-      save_ovl(&p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
-      set_insert(&ovl_nodes, &ovl->ptr);
+      serial_write(p, &i, sizeof(i));
+      serial_write(p, &ovl->n_inst, sizeof(ovl->n_inst));
+      save_ovl(p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
   /* play overlays */
   n_ovl = sizeof(z64_play_ovl_tab) / sizeof(*z64_play_ovl_tab);
   for (int16_t i = 0; i < n_ovl; ++i) {
     z64_play_ovl_t *ovl = &z64_play_ovl_tab[i];
     if (ovl->ptr) {
-      serial_write(&p, &i, sizeof(i));
-      save_ovl(&p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
-      set_insert(&ovl_nodes, &ovl->ptr);
+      serial_write(p, &i, sizeof(i));
+      save_ovl(p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
-  serial_write(&p, &z64_play_ovl_ptr, sizeof(z64_play_ovl_ptr));
+  serial_write(p, &eot, sizeof(eot));
+  serial_write(p, &z64_play_ovl_ptr, sizeof(z64_play_ovl_ptr));
   /* particle overlays */
   n_ovl = sizeof(z64_part_ovl_tab) / sizeof(*z64_part_ovl_tab);
   for (int16_t i = 0; i < n_ovl; ++i) {
     z64_part_ovl_t *ovl = &z64_part_ovl_tab[i];
     if (ovl->ptr) {
-      serial_write(&p, &i, sizeof(i));
-      save_ovl(&p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
-      set_insert(&ovl_nodes, &ovl->ptr);
+      serial_write(p, &i, sizeof(i));
+      save_ovl(p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
   /* map mark overlay */
   if (z64_map_mark_ovl.ptr) {
     z64_map_mark_ovl_t *ovl = &z64_map_mark_ovl;
-    serial_write(&p, &sot, sizeof(sot));
-    save_ovl(&p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
-    set_insert(&ovl_nodes, &ovl->ptr);
+    serial_write(p, &sot, sizeof(sot));
+    save_ovl(p, ovl->ptr, ovl->vrom_start, ovl->vrom_end);
+    ovl_nodes_insert(&ovl_nodes, ovl->ptr);
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
+  prof_mark(STATE_PROF_OVL, p);
 
   /* save arena nodes */
-  serial_write(&p, &z64_game_arena, sizeof(z64_game_arena));
+  serial_write(p, &z64_game_arena, sizeof(z64_game_arena));
   for (z64_arena_node_t *node = z64_game_arena.first_node;
        node; node = node->next)
   {
-    serial_write(&p, &sot, sizeof(sot));
-    serial_write(&p, &node->free, sizeof(node->free));
-    serial_write(&p, &node->size, sizeof(node->size));
+    serial_write(p, &sot, sizeof(sot));
+    serial_write(p, &node->free, sizeof(node->free));
+    serial_write(p, &node->size, sizeof(node->size));
     char *data = node->data;
-    if (!set_get(&ovl_nodes, &data) && !node->free)
-      serial_write(&p, data, node->size);
+    if (!ovl_nodes_get(&ovl_nodes, data) && !node->free)
+      serial_write(p, data, node->size);
   }
-  serial_write(&p, &eot, sizeof(eot));
-  set_destroy(&ovl_nodes);
+  serial_write(p, &eot, sizeof(eot));
+  prof_mark(STATE_PROF_ARENA, p);
 
   /* save light queue */
-  serial_write(&p, &z64_light_queue, sizeof(z64_light_queue));
+  serial_write(p, &z64_light_queue, sizeof(z64_light_queue));
   /* save matrix stack info */
-  serial_write(&p, &z64_mtx_stack, sizeof(z64_mtx_stack));
-  serial_write(&p, &z64_mtx_stack_top, sizeof(z64_mtx_stack_top));
+  serial_write(p, &z64_mtx_stack, sizeof(z64_mtx_stack));
+  serial_write(p, &z64_mtx_stack_top, sizeof(z64_mtx_stack_top));
   /* save segment table */
-  serial_write(&p, &z64_stab, sizeof(z64_stab));
+  serial_write(p, &z64_stab, sizeof(z64_stab));
+  prof_mark(STATE_PROF_MISC, p);
 
   /* save particles */
-  serial_write(&p, &z64_part_space, sizeof(z64_part_space));
-  serial_write(&p, &z64_part_pos, sizeof(z64_part_pos));
-  serial_write(&p, &z64_part_max, sizeof(z64_part_max));
+  serial_write(p, &z64_part_space, sizeof(z64_part_space));
+  serial_write(p, &z64_part_pos, sizeof(z64_part_pos));
+  serial_write(p, &z64_part_max, sizeof(z64_part_max));
   for (int16_t i = 0; i < z64_part_max; ++i) {
     z64_part_t *part = &z64_part_space[i];
     if (part->time >= 0) {
-      serial_write(&p, &i, sizeof(i));
-      serial_write(&p, part, sizeof(*part));
+      serial_write(p, &i, sizeof(i));
+      serial_write(p, part, sizeof(*part));
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
   /* save static particles */
   for (int16_t i = 0; i < 3; ++i) {
     z64_dot_t *dot = &z64_pfx.dots[i];
     if (dot->active) {
-      serial_write(&p, &i, sizeof(i));
-      serial_write(&p, dot, sizeof(*dot));
+      serial_write(p, &i, sizeof(i));
+      serial_write(p, dot, sizeof(*dot));
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
   for (int16_t i = 0; i < 25; ++i) {
     z64_trail_t *trail = &z64_pfx.trails[i];
     if (trail->active) {
-      serial_write(&p, &i, sizeof(i));
-      serial_write(&p, trail, sizeof(*trail));
+      serial_write(p, &i, sizeof(i));
+      serial_write(p, trail, sizeof(*trail));
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
   for (int16_t i = 0; i < 3; ++i) {
     z64_spark_t *spark = &z64_pfx.sparks[i];
     if (spark->active) {
-      serial_write(&p, &i, sizeof(i));
-      serial_write(&p, spark, sizeof(*spark));
+      serial_write(p, &i, sizeof(i));
+      serial_write(p, spark, sizeof(*spark));
     }
   }
-  serial_write(&p, &eot, sizeof(eot));
+  serial_write(p, &eot, sizeof(eot));
+  prof_mark(STATE_PROF_PART, p);
   /* save camera shake effects */
-  serial_write(&p, &z64_n_camera_shake, 0x0002);
-  serial_write(&p, z64_camera_shake, 0x0090);
+  serial_write(p, &z64_n_camera_shake, 0x0002);
+  serial_write(p, z64_camera_shake, 0x0090);
 
   /* save transition actor list (it may have been modified during gameplay) */
   {
     z64_room_ctxt_t *room_ctxt = &z64_game.room_ctxt;
-    serial_write(&p, room_ctxt->tnsn_list,
+    serial_write(p, room_ctxt->tnsn_list,
                  room_ctxt->n_tnsn * sizeof(*room_ctxt->tnsn_list));
   }
+  prof_mark(STATE_PROF_MISC, p);
 
   /* save waterboxes */
   {
     z64_col_hdr_t *col_hdr = z64_game.col_ctxt.col_hdr;
-    serial_write(&p, &col_hdr->n_water, sizeof(col_hdr->n_water));
-    serial_write(&p, col_hdr->water,
+    serial_write(p, &col_hdr->n_water, sizeof(col_hdr->n_water));
+    serial_write(p, col_hdr->water,
                  sizeof(*col_hdr->water) * col_hdr->n_water);
   }
   /* save dynamic collision */
   {
     z64_col_ctxt_t *col = &z64_game.col_ctxt;
-    serial_write(&p, col->dyn_list,
+    serial_write(p, col->dyn_list,
                  col->dyn_list_max * sizeof(*col->dyn_list));
-    serial_write(&p, col->dyn_poly,
+    serial_write(p, col->dyn_poly,
                  col->dyn_poly_max * sizeof(*col->dyn_poly));
-    serial_write(&p, col->dyn_vtx,
+    serial_write(p, col->dyn_vtx,
                  col->dyn_vtx_max * sizeof(*col->dyn_vtx));
   }
+  prof_mark(STATE_PROF_COL, p);
 
   if (z64_game.elf_message)
-    serial_write(&p, z64_game.elf_message, 0x0070);
+    serial_write(p, z64_game.elf_message, 0x0070);
 
   /* minimap details */
-  serial_write(&p, &z64_minimap_entrance_x, sizeof(z64_minimap_entrance_x));
-  serial_write(&p, &z64_minimap_entrance_y, sizeof(z64_minimap_entrance_y));
-  serial_write(&p, &z64_minimap_entrance_r, sizeof(z64_minimap_entrance_r));
+  serial_write(p, &z64_minimap_entrance_x, sizeof(z64_minimap_entrance_x));
+  serial_write(p, &z64_minimap_entrance_y, sizeof(z64_minimap_entrance_y));
+  serial_write(p, &z64_minimap_entrance_r, sizeof(z64_minimap_entrance_r));
 
   /* weather / daytime state */
-  serial_write(&p, z64_weather_state, 0x0018);
-  serial_write(&p, &z64_temp_day_speed, sizeof(z64_temp_day_speed));
+  serial_write(p, z64_weather_state, 0x0018);
+  serial_write(p, &z64_temp_day_speed, sizeof(z64_temp_day_speed));
 
   /* hazard state */
-  serial_write(&p, z64_hazard_state, 0x0008);
+  serial_write(p, z64_hazard_state, 0x0008);
 
   /* timer state */
-  serial_write(&p, z64_timer_state, 0x0008);
+  serial_write(p, z64_timer_state, 0x0008);
 
   /* hud state */
-  serial_write(&p, z64_hud_state, 0x0008);
+  serial_write(p, z64_hud_state, 0x0008);
 
   /* letterboxing */
-  serial_write(&p, &z64_letterbox_target, sizeof(z64_letterbox_target));
-  serial_write(&p, &z64_letterbox_current, sizeof(z64_letterbox_current));
-  serial_write(&p, &z64_letterbox_time, sizeof(z64_letterbox_time));
+  serial_write(p, &z64_letterbox_target, sizeof(z64_letterbox_target));
+  serial_write(p, &z64_letterbox_current, sizeof(z64_letterbox_current));
+  serial_write(p, &z64_letterbox_time, sizeof(z64_letterbox_time));
 
   /* poly color filter state (sepia effect) */
-  serial_write(&p, z64_poly_colorfilter_state, 0x001C);
+  serial_write(p, z64_poly_colorfilter_state, 0x001C);
 
   /* sound state */
-  serial_write(&p, z64_sound_state, 0x004C);
+  serial_write(p, z64_sound_state, 0x004C);
 
   /* event state */
-  serial_write(&p, z64_event_state_1, 0x0008);
-  serial_write(&p, z64_event_state_2, 0x0004);
+  serial_write(p, z64_event_state_1, 0x0008);
+  serial_write(p, z64_event_state_2, 0x0004);
   /* event camera parameters */
   for (int i = 0; i < 24; ++i)
-    serial_write(&p, &z64_event_camera[0x28 * i + 0x10], 0x0018);
+    serial_write(p, &z64_event_camera[0x28 * i + 0x10], 0x0018);
 
   /* oob timer */
-  serial_write(&p, &z64_oob_timer, sizeof(z64_oob_timer));
+  serial_write(p, &z64_oob_timer, sizeof(z64_oob_timer));
 
   /* countdown to gameover screen */
-  serial_write(&p, &z64_gameover_countdown, sizeof(z64_gameover_countdown));
+  serial_write(p, &z64_gameover_countdown, sizeof(z64_gameover_countdown));
 
   /* rng */
-  serial_write(&p, &z64_random, sizeof(z64_random));
+  serial_write(p, &z64_random, sizeof(z64_random));
 
   /* spell states */
-  serial_write(&p, z64_dins_state_1, 0x0004);
-  serial_write(&p, &z64_dins_state_2[0x0006], 0x0002);
-  serial_write(&p, &z64_dins_state_2[0x0014], 0x0004);
-  serial_write(&p, &z64_dins_state_2[0x0020], 0x0004);
-  serial_write(&p, &z64_dins_state_2[0x003C], 0x0004);
-  serial_write(&p, z64_fw_state_1, 0x0004);
-  serial_write(&p, z64_fw_state_2, 0x0004);
+  serial_write(p, z64_dins_state_1, 0x0004);
+  serial_write(p, &z64_dins_state_2[0x0006], 0x0002);
+  serial_write(p, &z64_dins_state_2[0x0014], 0x0004);
+  serial_write(p, &z64_dins_state_2[0x0020], 0x0004);
+  serial_write(p, &z64_dins_state_2[0x003C], 0x0004);
+  serial_write(p, z64_fw_state_1, 0x0004);
+  serial_write(p, z64_fw_state_2, 0x0004);
 
   /* camera state */
-  serial_write(&p, z64_camera_state, 0x0020);
+  serial_write(p, z64_camera_state, 0x0020);
 
   /* cutscene state */
-  serial_write(&p, z64_cs_state, 0x0140);
+  serial_write(p, z64_cs_state, 0x0140);
   /* cutscene message id */
-  serial_write(&p, z64_cs_message, 0x0008);
+  serial_write(p, z64_cs_message, 0x0008);
 
   /* message state */
-  serial_write(&p, z64_message_state, 0x0028);
+  serial_write(p, z64_message_state, 0x0028);
+  prof_mark(STATE_PROF_MISC, p);
 
   _Bool save_gfx = 1;
   /* save display lists */
   if (save_gfx) {
     z64_gfx_t *gfx = z64_ctxt.gfx;
-    serial_write(&p, &sot, sizeof(sot));
+    serial_write(p, &sot, sizeof(sot));
     /* save pointers */
     struct zu_disp_p disp_p;
     zu_save_disp_p(&disp_p);
-    serial_write(&p, &disp_p, sizeof(disp_p));
+    serial_write(p, &disp_p, sizeof(disp_p));
     /* save commands and data */
     z64_disp_buf_t *z_disp[4] =
     {
@@ -716,60 +1096,59 @@ uint32_t save_state(void *state)
       z64_disp_buf_t *disp_buf = z_disp[i];
       size_t s = sizeof(Gfx);
       Gfx *e = disp_buf->buf + disp_buf->size / s;
-      serial_write(&p, disp_buf->buf, (disp_buf->p - disp_buf->buf) * s);
-      serial_write(&p, disp_buf->d, (e - disp_buf->d) * s);
+      serial_write(p, disp_buf->buf, (disp_buf->p - disp_buf->buf) * s);
+      serial_write(p, disp_buf->d, (e - disp_buf->d) * s);
     }
     /* save counters */
-    serial_write(&p, &gfx->frame_count_1,
+    serial_write(p, &gfx->frame_count_1,
                  sizeof(gfx->frame_count_1));
-    serial_write(&p, &gfx->frame_count_2,
+    serial_write(p, &gfx->frame_count_2,
                  sizeof(gfx->frame_count_2));
   }
   else
-    serial_write(&p, &eot, sizeof(eot));
+    serial_write(p, &eot, sizeof(eot));
+  prof_mark(STATE_PROF_DISP, p);
 
   /* save sfx mutes */
-  serial_write(&p, z64_sfx_mute, 0x0008);
+  serial_write(p, z64_sfx_mute, 0x0008);
   /* save pending audio commands */
   {
     uint8_t n_cmd = z64_audio_cmd_write_pos - z64_audio_cmd_read_pos;
-    serial_write(&p, &n_cmd, sizeof(n_cmd));
+    serial_write(p, &n_cmd, sizeof(n_cmd));
     for (uint8_t i = z64_audio_cmd_read_pos; i != z64_audio_cmd_write_pos; ++i)
-      serial_write(&p, &z64_audio_cmd_buf[i], sizeof(*z64_audio_cmd_buf));
+      serial_write(p, &z64_audio_cmd_buf[i], sizeof(*z64_audio_cmd_buf));
   }
 #if 0
   {
     uint8_t n_cmd = z64_afx_cmd_write_pos - z64_afx_cmd_read_pos;
-    serial_write(&p, &n_cmd, sizeof(n_cmd));
+    serial_write(p, &n_cmd, sizeof(n_cmd));
     for (uint8_t i = z64_afx_cmd_read_pos; i != z64_afx_cmd_write_pos; ++i)
-      serial_write(&p, &z64_afx_cmd_buf[i], sizeof(*z64_afx_cmd_buf));
+      serial_write(p, &z64_afx_cmd_buf[i], sizeof(*z64_afx_cmd_buf));
   }
 #endif
 
   /* save ocarina state */
-  serial_write(&p, z64_ocarina_state, 0x0060);
+  serial_write(p, z64_ocarina_state, 0x0060);
   /* ocarina minigame parameters */
-  serial_write(&p, &z64_ocarina_state[0x0068], 0x0001);
-  serial_write(&p, &z64_ocarina_state[0x006C], 0x0001);
+  serial_write(p, &z64_ocarina_state[0x0068], 0x0001);
+  serial_write(p, &z64_ocarina_state[0x006C], 0x0001);
   /* save song state */
-  serial_write(&p, z64_song_state, 0x00AC);
-  serial_write(&p, z64_scarecrow_song, 0x0140);
-  serial_write(&p, z64_song_ptr, 0x0004);
-  serial_write(&p, z64_staff_notes, 0x001E);
-
-  //serial_write(&p, (void*)0x800E2FC0, 0x31E10);
-  //serial_write(&p, (void*)0x8012143C, 0x41F4);
-  //serial_write(&p, (void*)0x801DAA00, 0x1D4790);
-
-  return (char*)p - (char*)state;
+  serial_write(p, z64_song_state, 0x00AC);
+  serial_write(p, z64_scarecrow_song, 0x0140);
+  serial_write(p, z64_song_ptr, 0x0004);
+  serial_write(p, z64_staff_notes, 0x001E);
+  prof_mark(STATE_PROF_MISC, p);
+
+  //serial_write(p, (void*)0x800E2FC0, 0x31E10);
+  //serial_write(p, (void*)0x8012143C, 0x41F4);
+  //serial_write(p, (void*)0x801DAA00, 0x1D4790);
 }
 
-void load_state(void *state)
+static void load_io(struct state_io *p)
 {
-  void *p = state;
-
   /* skip metadata */
-  serial_skip(&p, sizeof(struct state_meta));
+  serial_skip(p, sizeof(struct state_meta));
+  prof_start(p);
 
   /* cancel queued sound effects */
   z64_sfx_read_pos = z64_sfx_write_pos;
@@ -797,23 +1176,23 @@ void load_state(void *state)
 
   for (int i = 0; i < 4; ++i) {
     struct seq_info *si = &seq_info[i];
-    serial_read(&p, &si->p_active, sizeof(si->p_active));
+    serial_read(p, &si->p_active, sizeof(si->p_active));
     if (si->p_active) {
-      serial_read(&p, &si->stop_cmd_timer, sizeof(si->stop_cmd_timer));
-      serial_read(&p, &si->stop_cmd_count, sizeof(si->stop_cmd_count));
-      serial_read(&p, &si->stop_cmd_buf,
+      serial_read(p, &si->stop_cmd_timer, sizeof(si->stop_cmd_timer));
+      serial_read(p, &si->stop_cmd_count, sizeof(si->stop_cmd_count));
+      serial_read(p, &si->stop_cmd_buf,
                   sizeof(*si->stop_cmd_buf) * si->stop_cmd_count);
     }
-    serial_read(&p, &si->seq_idx, sizeof(si->seq_idx));
-    serial_read(&p, &si->volume, sizeof(si->volume));
-    serial_read(&p, &si->vp_factors, sizeof(si->vp_factors));
-    serial_read(&p, &si->ch_mute, sizeof(si->ch_mute));
+    serial_read(p, &si->seq_idx, sizeof(si->seq_idx));
+    serial_read(p, &si->volume, sizeof(si->volume));
+    serial_read(p, &si->vp_factors, sizeof(si->vp_factors));
+    serial_read(p, &si->ch_mute, sizeof(si->ch_mute));
   }
 
   /* configure afx if needed */
   int p_afx_cfg = z64_afx_cfg;
   uint8_t c_afx_cfg;
-  serial_read(&p, &c_afx_cfg, sizeof(c_afx_cfg));
+  serial_read(p, &c_afx_cfg, sizeof(c_afx_cfg));
   if (c_afx_cfg != p_afx_cfg) {
     z64_afx_cfg = c_afx_cfg;
     z64_ConfigureAfx(c_afx_cfg);
@@ -834,6 +1213,7 @@ void load_state(void *state)
     }
     z64_FlushAfxCmd();
   }
+  prof_mark(STATE_PROF_SEQ, p);
 
   /* wait for gfx task to finish */
   z64_osRecvMesg(&z64_ctxt.gfx->task_mq, NULL, OS_MESG_BLOCK);
@@ -861,28 +1241,29 @@ void load_state(void *state)
   int ps = z64_game.pause_ctxt.state;
   _Bool p_pause_objects = (ps > 0x0003 && ps < 0x0008) || ps > 0x000A;
   _Bool p_gameover = ps >= 0x0008 && ps <= 0x0011;
+  prof_mark(STATE_PROF_MISC, p);
 
   /* load context */
-  serial_read(&p, &z64_game, sizeof(z64_game));
-  serial_read(&p, &z64_file, sizeof(z64_file));
-  serial_read(&p, z64_file.gameinfo, sizeof(*z64_file.gameinfo));
+  serial_read(p, &z64_game, sizeof(z64_game));
+  serial_read(p, &z64_file, sizeof(z64_file));
+  serial_read(p, z64_file.gameinfo, sizeof(*z64_file.gameinfo));
+  prof_mark(STATE_PROF_CTXT, p);
   /* load overlays */
   int16_t n_ent;
   int16_t next_ent;
-  struct set ovl_nodes;
-  set_init(&ovl_nodes, sizeof(uint32_t), addr_comp);
+  ovl_nodes.n = 0;
   /* actor overlays */
   n_ent = sizeof(z64_actor_ovl_tab) / sizeof(*z64_actor_ovl_tab);
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < n_ent; ++i) {
     z64_actor_ovl_t *ovl = &z64_actor_ovl_tab[i];
     if (i == next_ent) {
-      serial_read(&p, &ovl->n_inst, sizeof(ovl->n_inst));
-      load_ovl(&p, &ovl->ptr,
+      serial_read(p, &ovl->n_inst, sizeof(ovl->n_inst));
+      load_ovl(p, &ovl->ptr,
                ovl->vrom_start, ovl->vrom_end,
                ovl->vram_start, ovl->vram_end);
-      set_insert(&ovl_nodes, &ovl->ptr);
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else {
       ovl->n_inst = 0;
@@ -891,47 +1272,47 @@ void load_state(void *state)
   }
   /* play overlays */
   n_ent = sizeof(z64_play_ovl_tab) / sizeof(*z64_play_ovl_tab);
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < n_ent; ++i) {
     z64_play_ovl_t *ovl = &z64_play_ovl_tab[i];
     if (i == next_ent) {
-      load_ovl(&p, &ovl->ptr,
+      load_ovl(p, &ovl->ptr,
                ovl->vrom_start, ovl->vrom_end,
                ovl->vram_start, ovl->vram_end);
       ovl->reloc_offset = (uint32_t)ovl->ptr - ovl->vram_start;
-      set_insert(&ovl_nodes, &ovl->ptr);
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else {
       ovl->ptr = NULL;
       ovl->reloc_offset = 0;
     }
   }
-  serial_read(&p, &z64_play_ovl_ptr, sizeof(z64_play_ovl_ptr));
+  serial_read(p, &z64_play_ovl_ptr, sizeof(z64_play_ovl_ptr));
   /* particle overlays */
   n_ent = sizeof(z64_part_ovl_tab) / sizeof(*z64_part_ovl_tab);
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < n_ent; ++i) {
     z64_part_ovl_t *ovl = &z64_part_ovl_tab[i];
     if (i == next_ent) {
-      load_ovl(&p, &ovl->ptr,
+      load_ovl(p, &ovl->ptr,
                ovl->vrom_start, ovl->vrom_end,
                ovl->vram_start, ovl->vram_end);
-      set_insert(&ovl_nodes, &ovl->ptr);
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      ovl_nodes_insert(&ovl_nodes, ovl->ptr);
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else
       ovl->ptr = NULL;
   }
   /* map mark overlay */
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   if (next_ent == 0) {
     z64_map_mark_ovl_t *ovl = &z64_map_mark_ovl;
-    load_ovl(&p, &ovl->ptr,
+    load_ovl(p, &ovl->ptr,
              ovl->vrom_start, ovl->vrom_end,
              ovl->vram_start, ovl->vram_end);
-    set_insert(&ovl_nodes, &ovl->ptr);
-    serial_read(&p, &next_ent, sizeof(next_ent));
+    ovl_nodes_insert(&ovl_nodes, ovl->ptr);
+    serial_read(p, &next_ent, sizeof(next_ent));
     /* relocate data table pointer */
     char *data_tab = ovl->ptr;
     data_tab += ovl->vram_data_tab - ovl->vram_start;
@@ -939,11 +1320,12 @@ void load_state(void *state)
   }
   else
     z64_map_mark_ovl.ptr = NULL;
+  prof_mark(STATE_PROF_OVL, p);
 
   /* load arena nodes */
-  serial_read(&p, &z64_game_arena, sizeof(z64_game_arena));
+  serial_read(p, &z64_game_arena, sizeof(z64_game_arena));
   z64_arena_node_t *node = z64_game_arena.first_node;
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   while (node) {
     node->magic = 0x7373;
 #if Z64_VERSION == Z64_OOT10 || \
@@ -954,14 +1336,14 @@ void load_state(void *state)
     node->line = 0;
     node->thread_id = 4;
 #endif
-    serial_read(&p, &node->free, sizeof(node->free));
-    serial_read(&p, &node->size, sizeof(node->size));
+    serial_read(p, &node->free, sizeof(node->free));
+    serial_read(p, &node->size, sizeof(node->size));
     char *data = node->data;
-    if (!set_get(&ovl_nodes, &data) && !node->free)
-      serial_read(&p, data, node->size);
+    if (!ovl_nodes_get(&ovl_nodes, data) && !node->free)
+      serial_read(p, data, node->size);
     if (node == z64_game_arena.first_node)
       node->prev = NULL;
-    serial_read(&p, &next_ent, sizeof(next_ent));
+    serial_read(p, &next_ent, sizeof(next_ent));
     if (next_ent == 0) {
       node->next = (void*)&node->data[node->size];
       node->next->prev = node;
@@ -970,26 +1352,27 @@ void load_state(void *state)
       node->next = NULL;
     node = node->next;
   }
-  set_destroy(&ovl_nodes);
+  prof_mark(STATE_PROF_ARENA, p);
 
   /* load light queue */
-  serial_read(&p, &z64_light_queue, sizeof(z64_light_queue));
+  serial_read(p, &z64_light_queue, sizeof(z64_light_queue));
   /* load matrix stack info */
-  serial_read(&p, &z64_mtx_stack, sizeof(z64_mtx_stack));
-  serial_read(&p, &z64_mtx_stack_top, sizeof(z64_mtx_stack_top));
+  serial_read(p, &z64_mtx_stack, sizeof(z64_mtx_stack));
+  serial_read(p, &z64_mtx_stack_top, sizeof(z64_mtx_stack_top));
   /* load segment table */
-  serial_read(&p, &z64_stab, sizeof(z64_stab));
+  serial_read(p, &z64_stab, sizeof(z64_stab));
+  prof_mark(STATE_PROF_MISC, p);
 
   /* load particles */
-  serial_read(&p, &z64_part_space, sizeof(z64_part_space));
-  serial_read(&p, &z64_part_pos, sizeof(z64_part_pos));
-  serial_read(&p, &z64_part_max, sizeof(z64_part_max));
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &z64_part_space, sizeof(z64_part_space));
+  serial_read(p, &z64_part_pos, sizeof(z64_part_pos));
+  serial_read(p, &z64_part_max, sizeof(z64_part_max));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < z64_part_max; ++i) {
     z64_part_t *part = &z64_part_space[i];
     if (i == next_ent) {
-      serial_read(&p, part, sizeof(*part));
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      serial_read(p, part, sizeof(*part));
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else {
       memset(part, 0, sizeof(*part));
@@ -999,39 +1382,41 @@ void load_state(void *state)
     }
   }
   /* load static particles */
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < 3; ++i) {
     z64_dot_t *dot = &z64_pfx.dots[i];
     if (i == next_ent) {
-      serial_read(&p, dot, sizeof(*dot));
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      serial_read(p, dot, sizeof(*dot));
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else
       dot->active = 0;
   }
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < 25; ++i) {
     z64_trail_t *trail = &z64_pfx.trails[i];
     if (i == next_ent) {
-      serial_read(&p, trail, sizeof(*trail));
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      serial_read(p, trail, sizeof(*trail));
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else
       trail->active = 0;
   }
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   for (int16_t i = 0; i < 3; ++i) {
     z64_spark_t *spark = &z64_pfx.sparks[i];
     if (i == next_ent) {
-      serial_read(&p, spark, sizeof(*spark));
-      serial_read(&p, &next_ent, sizeof(next_ent));
+      serial_read(p, spark, sizeof(*spark));
+      serial_read(p, &next_ent, sizeof(next_ent));
     }
     else
       spark->active = 0;
   }
+  prof_mark(STATE_PROF_PART, p);
   /* load camera shake effects */
-  serial_read(&p, &z64_n_camera_shake, 0x0002);
-  serial_read(&p, z64_camera_shake, 0x0090);
+  serial_read(p, &z64_n_camera_shake, 0x0002);
+  serial_read(p, z64_camera_shake, 0x0090);
+  prof_mark(STATE_PROF_MISC, p);
 
   /* load scene */
   if (z64_game.scene_index != scene_index) {
@@ -1048,7 +1433,7 @@ void load_state(void *state)
   {
     /* load transition actor list */
     z64_room_ctxt_t *room_ctxt = &z64_game.room_ctxt;
-    serial_read(&p, room_ctxt->tnsn_list,
+    serial_read(p, room_ctxt->tnsn_list,
                 room_ctxt->n_tnsn * sizeof(*room_ctxt->tnsn_list));
     /* load rooms */
     for (int i = 0; i < 2; ++i) {
@@ -1366,24 +1751,26 @@ void load_state(void *state)
       }
     }
   }
+  prof_mark(STATE_PROF_SCENE, p);
 
   /* load waterboxes */
   {
     z64_col_hdr_t *col_hdr = z64_game.col_ctxt.col_hdr;
-    serial_read(&p, &col_hdr->n_water, sizeof(col_hdr->n_water));
-    serial_read(&p, col_hdr->water,
+    serial_read(p, &col_hdr->n_water, sizeof(col_hdr->n_water));
+    serial_read(p, col_hdr->water,
                 sizeof(*col_hdr->water) * col_hdr->n_water);
   }
   /* load dynamic collision */
   {
     z64_col_ctxt_t *col = &z64_game.col_ctxt;
-    serial_read(&p, col->dyn_list,
+    serial_read(p, col->dyn_list,
                 col->dyn_list_max * sizeof(*col->dyn_list));
-    serial_read(&p, col->dyn_poly,
+    serial_read(p, col->dyn_poly,
                 col->dyn_poly_max * sizeof(*col->dyn_poly));
-    serial_read(&p, col->dyn_vtx,
+    serial_read(p, col->dyn_vtx,
                 col->dyn_vtx_max * sizeof(*col->dyn_vtx));
   }
+  prof_mark(STATE_PROF_COL, p);
 
   /* create skybox */
   if (z64_game.skybox_type != 0) {
@@ -1397,74 +1784,76 @@ void load_state(void *state)
       z64_CreateSkyGfx(&z64_game.sky_ctxt, z64_game.skybox_type);
     load_sky_image();
   }
+  prof_mark(STATE_PROF_SCENE, p);
 
   if (z64_game.elf_message)
-    serial_read(&p, z64_game.elf_message, 0x0070);
+    serial_read(p, z64_game.elf_message, 0x0070);
 
   /* minimap details */
-  serial_read(&p, &z64_minimap_entrance_x, sizeof(z64_minimap_entrance_x));
-  serial_read(&p, &z64_minimap_entrance_y, sizeof(z64_minimap_entrance_y));
-  serial_read(&p, &z64_minimap_entrance_r, sizeof(z64_minimap_entrance_r));
+  serial_read(p, &z64_minimap_entrance_x, sizeof(z64_minimap_entrance_x));
+  serial_read(p, &z64_minimap_entrance_y, sizeof(z64_minimap_entrance_y));
+  serial_read(p, &z64_minimap_entrance_r, sizeof(z64_minimap_entrance_r));
 
   /* weather / daytime state */
-  serial_read(&p, z64_weather_state, 0x0018);
-  serial_read(&p, &z64_temp_day_speed, sizeof(z64_temp_day_speed));
+  serial_read(p, z64_weather_state, 0x0018);
+  serial_read(p, &z64_temp_day_speed, sizeof(z64_temp_day_speed));
 
   /* hazard state */
-  serial_read(&p, z64_hazard_state, 0x0008);
+  serial_read(p, z64_hazard_state, 0x0008);
 
   /* timer state */
-  serial_read(&p, z64_timer_state, 0x0008);
+  serial_read(p, z64_timer_state, 0x0008);
 
   /* hud state */
-  serial_read(&p, z64_hud_state, 0x0008);
+  serial_read(p, z64_hud_state, 0x0008);
 
   /* letterboxing */
-  serial_read(&p, &z64_letterbox_target, sizeof(z64_letterbox_target));
-  serial_read(&p, &z64_letterbox_current, sizeof(z64_letterbox_current));
-  serial_read(&p, &z64_letterbox_time, sizeof(z64_letterbox_time));
+  serial_read(p, &z64_letterbox_target, sizeof(z64_letterbox_target));
+  serial_read(p, &z64_letterbox_current, sizeof(z64_letterbox_current));
+  serial_read(p, &z64_letterbox_time, sizeof(z64_letterbox_time));
 
   /* poly color filter state (sepia effect) */
-  serial_read(&p, z64_poly_colorfilter_state, 0x001C);
+  serial_read(p, z64_poly_colorfilter_state, 0x001C);
 
   /* sound state */
-  serial_read(&p, z64_sound_state, 0x004C);
+  serial_read(p, z64_sound_state, 0x004C);
 
   /* event state */
-  serial_read(&p, z64_event_state_1, 0x0008);
-  serial_read(&p, z64_event_state_2, 0x0004);
+  serial_read(p, z64_event_state_1, 0x0008);
+  serial_read(p, z64_event_state_2, 0x0004);
   /* event camera parameters */
   for (int i = 0; i < 24; ++i)
-    serial_read(&p, &z64_event_camera[0x28 * i + 0x10], 0x0018);
+    serial_read(p, &z64_event_camera[0x28 * i + 0x10], 0x0018);
 
   /* oob timer */
-  serial_read(&p, &z64_oob_timer, sizeof(z64_oob_timer));
+  serial_read(p, &z64_oob_timer, sizeof(z64_oob_timer));
 
   /* countdown to gameover screen */
-  serial_read(&p, &z64_gameover_countdown, sizeof(z64_gameover_countdown));
+  serial_read(p, &z64_gameover_countdown, sizeof(z64_gameover_countdown));
 
   /* rng */
-  serial_read(&p, &z64_random, sizeof(z64_random));
+  serial_read(p, &z64_random, sizeof(z64_random));
 
   /* spell states */
-  serial_read(&p, z64_dins_state_1, 0x0004);
-  serial_read(&p, &z64_dins_state_2[0x0006], 0x0002);
-  serial_read(&p, &z64_dins_state_2[0x0014], 0x0004);
-  serial_read(&p, &z64_dins_state_2[0x0020], 0x0004);
-  serial_read(&p, &z64_dins_state_2[0x003C], 0x0004);
-  serial_read(&p, z64_fw_state_1, 0x0004);
-  serial_read(&p, z64_fw_state_2, 0x0004);
+  serial_read(p, z64_dins_state_1, 0x0004);
+  serial_read(p, &z64_dins_state_2[0x0006], 0x0002);
+  serial_read(p, &z64_dins_state_2[0x0014], 0x0004);
+  serial_read(p, &z64_dins_state_2[0x0020], 0x0004);
+  serial_read(p, &z64_dins_state_2[0x003C], 0x0004);
+  serial_read(p, z64_fw_state_1, 0x0004);
+  serial_read(p, z64_fw_state_2, 0x0004);
 
   /* camera state */
-  serial_read(&p, z64_camera_state, 0x0020);
+  serial_read(p, z64_camera_state, 0x0020);
 
   /* cutscene state */
-  serial_read(&p, z64_cs_state, 0x0140);
+  serial_read(p, z64_cs_state, 0x0140);
   /* cutscene message id */
-  serial_read(&p, z64_cs_message, 0x0008);
+  serial_read(p, z64_cs_message, 0x0008);
 
   /* message state */
-  serial_read(&p, z64_message_state, 0x0028);
+  serial_read(p, z64_message_state, 0x0028);
+  prof_mark(STATE_PROF_MISC, p);
 
   /* load textures */
   zu_getfile_idx(z64_parameter_static, z64_game.if_ctxt.parameter);
@@ -1550,14 +1939,15 @@ void load_state(void *state)
       for (int x = 0; x < 64; ++x)
         (*img)[y][x] = GPACK_RGBA5551(0x00, 0x00, 0x00, 0x00);
   }
+  prof_mark(STATE_PROF_SCENE, p);
 
   /* load display lists */
-  serial_read(&p, &next_ent, sizeof(next_ent));
+  serial_read(p, &next_ent, sizeof(next_ent));
   if (next_ent == 0) {
     z64_gfx_t *gfx = z64_ctxt.gfx;
     /* load pointers */
     struct zu_disp_p disp_p;
-    serial_read(&p, &disp_p, sizeof(disp_p));
+    serial_read(p, &disp_p, sizeof(disp_p));
     zu_load_disp_p(&disp_p);
     /* load commands and data */
     z64_disp_buf_t *z_disp[4] =
@@ -1571,14 +1961,14 @@ void load_state(void *state)
       z64_disp_buf_t *disp_buf = z_disp[i];
       size_t s = sizeof(Gfx);
       Gfx *e = disp_buf->buf + disp_buf->size / s;
-      serial_read(&p, disp_buf->buf, (disp_buf->p - disp_buf->buf) * s);
-      serial_read(&p, disp_buf->d, (e - disp_buf->d) * s);
+      serial_read(p, disp_buf->buf, (disp_buf->p - disp_buf->buf) * s);
+      serial_read(p, disp_buf->d, (e - disp_buf->d) * s);
     }
     /* relocate lists */
     uint32_t frame_count_1;
     uint32_t frame_count_2;
-    serial_read(&p, &frame_count_1, sizeof(frame_count_1));
-    serial_read(&p, &frame_count_2, sizeof(frame_count_2));
+    serial_read(p, &frame_count_1, sizeof(frame_count_1));
+    serial_read(p, &frame_count_2, sizeof(frame_count_2));
     zu_reloc_gfx(frame_count_1 & 1, frame_count_2 & 1);
   }
   else {
@@ -1599,6 +1989,7 @@ void load_state(void *state)
     gDPFullSync(gfx->work.p++);
     gSPEndDisplayList(gfx->work.p++);
   }
+  prof_mark(STATE_PROF_DISP, p);
 
   /* wait for afx config to finish */
   if (c_afx_cfg != p_afx_cfg) {
@@ -1659,45 +2050,345 @@ void load_state(void *state)
   z64_FlushAfxCmd();
 
   /* load sfx mutes */
-  serial_read(&p, z64_sfx_mute, 0x0008);
+  serial_read(p, z64_sfx_mute, 0x0008);
   /* restore pending audio commands */
   {
     uint8_t n_cmd;
-    serial_read(&p, &n_cmd, sizeof(n_cmd));
+    serial_read(p, &n_cmd, sizeof(n_cmd));
     for (uint8_t i = 0; i != n_cmd; ++i) {
-      serial_read(&p, &z64_audio_cmd_buf[z64_audio_cmd_write_pos++],
+      serial_read(p, &z64_audio_cmd_buf[z64_audio_cmd_write_pos++],
                   sizeof(*z64_audio_cmd_buf));
     }
   }
 #if 0
   {
     uint8_t n_cmd;
-    serial_read(&p, &n_cmd, sizeof(n_cmd));
+    serial_read(p, &n_cmd, sizeof(n_cmd));
     for (uint8_t i = 0; i != n_cmd; ++i) {
-      serial_read(&p, &z64_afx_cmd_buf[z64_afx_cmd_write_pos++],
+      serial_read(p, &z64_afx_cmd_buf[z64_afx_cmd_write_pos++],
                   sizeof(*z64_afx_cmd_buf));
     }
   }
 #endif
 
   /* load ocarina state */
-  serial_read(&p, z64_ocarina_state, 0x0060);
+  serial_read(p, z64_ocarina_state, 0x0060);
   /* ocarina minigame parameters */
-  serial_read(&p, &z64_ocarina_state[0x0068], 0x0001);
-  serial_read(&p, &z64_ocarina_state[0x006C], 0x0001);
+  serial_read(p, &z64_ocarina_state[0x0068], 0x0001);
+  serial_read(p, &z64_ocarina_state[0x006C], 0x0001);
   /* load song state */
-  serial_read(&p, z64_song_state, 0x00AC);
-  serial_read(&p, z64_scarecrow_song, 0x0140);
-  serial_read(&p, z64_song_ptr, 0x0004);
-  serial_read(&p, z64_staff_notes, 0x001E);
+  serial_read(p, z64_song_state, 0x00AC);
+  serial_read(p, z64_scarecrow_song, 0x0140);
+  serial_read(p, z64_song_ptr, 0x0004);
+  serial_read(p, z64_staff_notes, 0x001E);
   /* fix audio counters */
   {
     uint32_t delta = z64_song_counter - z64_ocarina_counter;
     z64_song_counter = z64_afx_counter;
     z64_ocarina_counter = z64_song_counter - delta;
   }
+  prof_mark(STATE_PROF_MISC, p);
+
+  //serial_read(p, (void*)0x800E2FC0, 0x31E10);
+  //serial_read(p, (void*)0x8012143C, 0x41F4);
+  //serial_read(p, (void*)0x801DAA00, 0x1D4790);
+}
+
+uint32_t save_state(void *state)
+{
+  struct state_io io;
+  io_mem(&io, state, 0);
+  save_io(&io);
+  return io_tell(&io);
+}
+
+void load_state(void *state)
+{
+  struct state_io io;
+  io_mem(&io, state, 1);
+  load_io(&io);
+}
+
+/* stream a state to a file, through a small staging buffer instead of a
+   buffer for the whole state. `meta` is written at the start of the file,
+   with its size set to the size of the state */
+int save_state_file(int fd, struct state_meta *meta)
+{
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start == -1)
+    return -1;
+  struct state_io io;
+  if (io_file(&io, fd, 0))
+    return -1;
+  save_io(&io);
+  meta->size = io_tell(&io);
+  if (io_close(&io))
+    return -1;
+  /* fill in the metadata */
+  if (lseek(fd, start, SEEK_SET) == -1 ||
+      write(fd, meta, sizeof(*meta)) != sizeof(*meta))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/* load a full state streamed from a file. the metadata should be checked
+   by the caller beforehand, as a read error can not be undone */
+int load_state_file(int fd)
+{
+  struct state_io io;
+  if (io_file(&io, fd, 1))
+    return -1;
+  load_io(&io);
+  return io_close(&io);
+}
+
+/* delta states hold the blocks of state data that differ from a base
+   state. the base is identified by its size and checksum */
+#define STATE_BLOCK     0x40
 
-  //serial_read(&p, (void*)0x800E2FC0, 0x31E10);
-  //serial_read(&p, (void*)0x8012143C, 0x41F4);
-  //serial_read(&p, (void*)0x801DAA00, 0x1D4790);
+struct state_delta
+{
+  uint32_t              base_sum;
+  uint32_t              base_size;
+  uint32_t              state_size;
+};
+
+static uint32_t state_sum(const struct state_meta *state)
+{
+  const char *data = (const char *)state + sizeof(*state);
+  uint32_t size = state->size - sizeof(*state);
+  const uint32_t *w = (const uint32_t *)data;
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (uint32_t i = 0; i < size / 4; ++i) {
+    a += w[i];
+    b += a;
+  }
+  for (uint32_t i = size / 4 * 4; i < size; ++i) {
+    a += (uint8_t)data[i];
+    b += a;
+  }
+  return a ^ (b << 16 | b >> 16);
+}
+
+/* create a delta of `state` against the full state `base`, returns a
+   malloc'd buffer or null */
+static struct state_meta *state_delta(const struct state_meta *base,
+                                      const struct state_meta *state)
+{
+  const char *base_data = (const char *)base + sizeof(*base);
+  const char *state_data = (const char *)state + sizeof(*state);
+  uint32_t base_size = base->size - sizeof(*base);
+  uint32_t state_size = state->size - sizeof(*state);
+  uint32_t n_block = (state_size + STATE_BLOCK - 1) / STATE_BLOCK;
+  uint32_t map_size = (n_block + 31) / 32 * 4;
+  uint32_t hdr_size = sizeof(struct state_meta) + sizeof(struct state_delta);
+  /* allocate for the worst case and shrink when done */
+  struct state_meta *delta = malloc(hdr_size + map_size + state_size);
+  if (!delta) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  struct state_delta *d = (void *)((char *)delta + sizeof(*delta));
+  uint32_t *map = (void *)((char *)delta + hdr_size);
+  char *p = (char *)map + map_size;
+  memset(map, 0, map_size);
+  for (uint32_t i = 0; i < n_block; ++i) {
+    uint32_t pos = i * STATE_BLOCK;
+    uint32_t n = state_size - pos;
+    if (n > STATE_BLOCK)
+      n = STATE_BLOCK;
+    /* blocks past the end of the base are always stored */
+    if (pos + n <= base_size &&
+        memcmp(&state_data[pos], &base_data[pos], n) == 0)
+    {
+      continue;
+    }
+    map[i / 32] |= 1u << (i % 32);
+    memcpy(p, &state_data[pos], n);
+    p += n;
+  }
+  *delta = *state;
+  delta->flags |= STATE_DELTA;
+  delta->size = p - (char *)delta;
+  d->base_sum = state_sum(base);
+  d->base_size = base->size;
+  d->state_size = state->size;
+  struct state_meta *r = realloc(delta, delta->size);
+  return r ? r : delta;
+}
+
+/* expand a delta state against the base it was created from, returns a
+   malloc'd buffer or null */
+static struct state_meta *state_expand(const struct state_meta *base,
+                                       const struct state_meta *delta)
+{
+  const struct state_delta *d = (void *)((char *)delta + sizeof(*delta));
+  uint32_t hdr_size = sizeof(struct state_meta) + sizeof(struct state_delta);
+  if (delta->size < hdr_size ||
+      d->base_size != base->size || d->base_sum != state_sum(base) ||
+      d->state_size < sizeof(struct state_meta))
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  uint32_t state_size = d->state_size - sizeof(struct state_meta);
+  uint32_t n_block = (state_size + STATE_BLOCK - 1) / STATE_BLOCK;
+  uint32_t map_size = (n_block + 31) / 32 * 4;
+  if (map_size > delta->size - hdr_size) {
+    errno = EINVAL;
+    return NULL;
+  }
+  /* the stored blocks must fill the rest of the delta exactly, and the
+     blocks that are not stored must be in the base */
+  const uint32_t *map = (const void *)&d[1];
+  uint32_t base_size = base->size - sizeof(struct state_meta);
+  uint32_t data_size = 0;
+  for (uint32_t i = 0; i < n_block; ++i) {
+    uint32_t pos = i * STATE_BLOCK;
+    uint32_t n = state_size - pos;
+    if (n > STATE_BLOCK)
+      n = STATE_BLOCK;
+    if (map[i / 32] & (1u << (i % 32)))
+      data_size += n;
+    else if (pos + n > base_size) {
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  if (data_size != delta->size - hdr_size - map_size) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct state_meta *state = malloc(d->state_size);
+  if (!state) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  const char *base_data = (const char *)base + sizeof(*base);
+  char *state_data = (char *)state + sizeof(*state);
+  const char *p = (const char *)map + map_size;
+  for (uint32_t i = 0; i < n_block; ++i) {
+    uint32_t pos = i * STATE_BLOCK;
+    uint32_t n = state_size - pos;
+    if (n > STATE_BLOCK)
+      n = STATE_BLOCK;
+    if (map[i / 32] & (1u << (i % 32))) {
+      memcpy(&state_data[pos], p, n);
+      p += n;
+    }
+    else
+      memcpy(&state_data[pos], &base_data[pos], n);
+  }
+  *state = *delta;
+  state->flags &= ~STATE_DELTA;
+  state->size = d->state_size;
+  return state;
+}
+
+/* compressed states hold the size of the uncompressed state, followed by
+   the compressed state data. returns a malloc'd buffer, or null if the
+   state does not compress */
+static struct state_meta *state_compress(const struct state_meta *state)
+{
+  uint32_t hdr_size = sizeof(*state) + sizeof(uint32_t);
+  uint32_t size = state->size - sizeof(*state);
+  if (size <= sizeof(uint32_t))
+    return NULL;
+  struct state_meta *lz = malloc(state->size);
+  if (!lz) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  uint32_t n = lz_compress((const char *)state + sizeof(*state), size,
+                           (char *)lz + hdr_size, size - sizeof(uint32_t));
+  if (n == 0) {
+    free(lz);
+    return NULL;
+  }
+  *lz = *state;
+  lz->flags |= STATE_LZ;
+  lz->size = hdr_size + n;
+  *(uint32_t *)&lz[1] = state->size;
+  struct state_meta *r = realloc(lz, lz->size);
+  return r ? r : lz;
+}
+
+static struct state_meta *state_decompress(const struct state_meta *lz)
+{
+  uint32_t hdr_size = sizeof(*lz) + sizeof(uint32_t);
+  uint32_t size = *(const uint32_t *)&lz[1];
+  if (lz->size < hdr_size || size < sizeof(*lz)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct state_meta *state = malloc(size);
+  if (!state) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (lz_decompress((const char *)lz + hdr_size, lz->size - hdr_size,
+                    (char *)state + sizeof(*state), size - sizeof(*state)))
+  {
+    free(state);
+    return NULL;
+  }
+  *state = *lz;
+  state->flags &= ~STATE_LZ;
+  state->size = size;
+  return state;
+}
+
+/* convert a full state in a malloc'd buffer to the form that it is stored
+   in, as a delta of `base` if there is one, and compressed if `compress`
+   is set. the buffer is consumed */
+struct state_meta *state_pack(const struct state_meta *base,
+                              struct state_meta *state, _Bool compress)
+{
+  if (base) {
+    struct state_meta *delta = state_delta(base, state);
+    if (delta && delta->size < state->size) {
+      free(state);
+      state = delta;
+    }
+    else if (delta)
+      free(delta);
+  }
+  if (compress) {
+    struct state_meta *lz = state_compress(state);
+    if (lz) {
+      free(state);
+      state = lz;
+    }
+  }
+  struct state_meta *r = realloc(state, state->size);
+  return r ? r : state;
+}
+
+/* get the full, uncompressed form of a stored state. returns `state` if
+   it is stored that way, otherwise a malloc'd buffer or null */
+struct state_meta *state_unpack(const struct state_meta *base,
+                                struct state_meta *state)
+{
+  struct state_meta *raw = state;
+  if (state->flags & STATE_LZ) {
+    raw = state_decompress(state);
+    if (!raw)
+      return NULL;
+  }
+  if (!(raw->flags & STATE_DELTA))
+    return raw;
+  struct state_meta *full = NULL;
+  if (base)
+    full = state_expand(base, raw);
+  else
+    errno = EINVAL;
+  if (raw != state) {
+    int e = errno;
+    free(raw);
+    errno = e;
+  }
+  return full;
 }
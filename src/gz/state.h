@@ -2,16 +2,68 @@
 #define STATE_H
 #include <stdint.h>
 
+#define STATE_DELTA           0x0001
+#define STATE_LZ              0x0002
+
 struct state_meta
 {
   uint16_t              z64_version;
   uint16_t              state_version;
   uint32_t              size;
   uint16_t              scene_idx;
+  uint16_t              flags;
   int                   movie_frame;
 };
 
+/* sections of a state that are accounted for by the profiler */
+enum state_prof_sect
+{
+  STATE_PROF_SEQ,
+  STATE_PROF_CTXT,
+  STATE_PROF_OVL,
+  STATE_PROF_ARENA,
+  STATE_PROF_PART,
+  STATE_PROF_COL,
+  STATE_PROF_SCENE,
+  STATE_PROF_DISP,
+  STATE_PROF_MISC,
+  STATE_PROF_MAX,
+};
+
+struct state_prof_stat
+{
+  uint64_t              n_bytes;
+  int64_t               n_cycles;
+};
+
+/* cumulative cpu counter cycles and bytes per section, over all saves and
+   loads since the last reset */
+struct state_prof
+{
+  _Bool                 enabled;
+  uint32_t              n_save;
+  uint32_t              n_load;
+  struct state_prof_stat save[STATE_PROF_MAX];
+  struct state_prof_stat load[STATE_PROF_MAX];
+  /* rewind captures, with the packed bytes and the cycles spent on the
+     save and the packing, and the longest capture */
+  uint32_t              n_capture;
+  struct state_prof_stat capture;
+  int64_t               capture_max;
+};
+
+extern struct state_prof  state_prof;
+extern const char        *state_prof_name[STATE_PROF_MAX];
+
 uint32_t      save_state(void *state);
 void          load_state(void *state);
+int           save_state_file(int fd, struct state_meta *meta);
+int           load_state_file(int fd);
+struct state_meta *state_pack(const struct state_meta *base,
+                              struct state_meta *state, _Bool compress);
+struct state_meta *state_unpack(const struct state_meta *base,
+                                struct state_meta *state);
+void          state_prof_reset(void);
+void          state_cache_clear(void);
 
 #endif
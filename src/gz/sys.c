@@ -7,18 +7,23 @@
 #include "fat.h"
 #include "hb.h"
 
-enum device_type
-{
-  DEVICE_NONE,
-  DEVICE_EVERDRIVE,
-  DEVICE_HOMEBOY,
-};
+/* read-ahead buffer size, and number of consecutive sequential reads
+   before read-ahead kicks in */
+#define SYS_RA_SIZE 0x2000
+#define SYS_RA_SEQ  2
+
+/* number of blocks prefetched by sequential reads on homeboy */
+#define SYS_HB_RA_BLOCKS  16
+
+/* size of the window of a file mapping */
+#define SYS_MAP_WINDOW    0x4000
 
 struct desc
 {
   int               fildes;
   struct fat_path  *fp;
   struct fat_file   file;
+  struct fat_extmap extmap;
   int               flags;
 };
 
@@ -26,6 +31,29 @@ struct file_desc
 {
   struct desc       desc;
   uint32_t          pos;
+  /* size of the initialized part of the file, the rest has been
+     preallocated and reads as zero until written */
+  uint32_t          init_size;
+  /* read-ahead state */
+  int               advice;
+  uint32_t          ra_next;
+  int               ra_seq;
+  char             *ra_buf;
+  uint32_t          ra_off;
+  uint32_t          ra_size;
+};
+
+/* read-only mapping of a file region, accessed through a window that is
+   loaded on demand */
+struct sys_map
+{
+  int               fildes;
+  uint32_t          offset;
+  uint32_t          length;
+  char             *window;
+  /* file offset and size of the loaded window */
+  uint32_t          win_off;
+  uint32_t          win_size;
 };
 
 struct dir_desc
@@ -35,84 +63,302 @@ struct dir_desc
   struct dirent     dirent;
 };
 
-static enum device_type device_type = DEVICE_NONE;
+/* block device, and whether it was selected with sys_set_blkdev rather
+   than found by probing */
+static struct sys_blkdev *blkdev = NULL;
+static _Bool            blkdev_set = 0;
 static _Bool            fat_ready = 0;
 static struct fat       fat;
 static void            *desc_list[OPEN_MAX] = {NULL};
 static struct fat_path *wd = NULL;
 static int              io_mode = SYS_IO_PIO;
+static char            *hb_ra_buf = NULL;
+static _Bool            hb_ra_queued = 0;
+static uint32_t         hb_ra_lba;
+static uint32_t         hb_ra_n = 0;
+static uint32_t         hb_next_lba = 0;
 
-static int read_sd(uint32_t lba, uint32_t n_blocks, void *buf)
-{
-  switch (device_type) {
-    case DEVICE_EVERDRIVE: {
-      enum ed_error e;
-      if (io_mode == SYS_IO_PIO)
-        e = ed_sd_read(lba, n_blocks, buf);
-      else if (io_mode == SYS_IO_DMA)
-        e = ed_sd_read_dma(lba, n_blocks, buf);
-      else {
-        errno = EINVAL;
-        return -1;
-      }
-      if (e != ED_ERROR_SUCCESS) {
-        errno = EIO;
-        return -1;
-      }
-      return 0;
-    }
-    case DEVICE_HOMEBOY: {
-      if (hb_sd_read(lba, n_blocks, buf)) {
-        errno = EIO;
-        return -1;
-      }
+/* wait for a queued prefetch. at most one request is ever left queued on
+   homeboy, so that the device is only relied on to hold one. a failed
+   prefetch is dropped, and its blocks are read again when needed */
+static void sync_hb(void)
+{
+  if (hb_ra_queued && hb_sd_sync())
+    hb_ra_n = 0;
+  hb_ra_queued = 0;
+}
+
+static int read_hb(uint32_t lba, uint32_t n_blocks, void *buf)
+{
+  sync_hb();
+  /* serve the request from the prefetched blocks if possible */
+  if (hb_ra_n > 0 && lba >= hb_ra_lba &&
+      lba + n_blocks <= hb_ra_lba + hb_ra_n)
+  {
+    memcpy(buf, &hb_ra_buf[(lba - hb_ra_lba) * 0x200], n_blocks * 0x200);
+  }
+  else if (hb_sd_read(lba, n_blocks, buf)) {
+    errno = EIO;
+    return -1;
+  }
+  /* queue a read of the following blocks if reading sequentially */
+  _Bool seq = lba == hb_next_lba;
+  hb_next_lba = lba + n_blocks;
+  if (!seq || !fat_ready ||
+      (hb_ra_n > 0 && hb_next_lba >= hb_ra_lba &&
+       hb_next_lba < hb_ra_lba + hb_ra_n))
+  {
+    return 0;
+  }
+  hb_ra_n = 0;
+  uint32_t max_lba = fat.part_lba + fat.n_fs_sect;
+  if (hb_next_lba >= max_lba)
+    return 0;
+  uint32_t n_ra = SYS_HB_RA_BLOCKS;
+  if (n_ra > max_lba - hb_next_lba)
+    n_ra = max_lba - hb_next_lba;
+  if (!hb_ra_buf) {
+    hb_ra_buf = malloc(SYS_HB_RA_BLOCKS * 0x200);
+    if (!hb_ra_buf)
       return 0;
-    }
-    default: {
-      errno = ENODEV;
-      return -1;
-    }
   }
+  if (hb_sd_submit(hb_next_lba, n_ra, hb_ra_buf, 0) == 0) {
+    hb_ra_lba = hb_next_lba;
+    hb_ra_n = n_ra;
+    hb_ra_queued = 1;
+  }
+  return 0;
 }
 
-static int write_sd(uint32_t lba, uint32_t n_blocks, void *buf)
+/* writes are not left queued, so that each one has completed, and its
+   error is known, before the fat driver counts it as done */
+static int write_hb(uint32_t lba, uint32_t n_blocks, void *buf)
 {
-  switch (device_type) {
-    case DEVICE_EVERDRIVE: {
-      if (ed_sd_write(lba, n_blocks, buf) != ED_ERROR_SUCCESS) {
-        errno = EIO;
-        return -1;
-      }
-      return 0;
-    }
-    case DEVICE_HOMEBOY: {
-      if (hb_sd_write(lba, n_blocks, buf)) {
-        errno = EIO;
-        return -1;
-      }
-      return 0;
-    }
-    default: {
-      errno = ENODEV;
+  sync_hb();
+  /* drop prefetched blocks that are overwritten */
+  if (hb_ra_n > 0 && lba < hb_ra_lba + hb_ra_n &&
+      lba + n_blocks > hb_ra_lba)
+  {
+    hb_ra_n = 0;
+  }
+  if (hb_sd_write(lba, n_blocks, buf)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* everdrive backend */
+static int ed_dev_init(struct sys_blkdev *dev)
+{
+  if (ed_sd_init() != ED_ERROR_SUCCESS) {
+    errno = ENODEV;
+    return -1;
+  }
+  return 0;
+}
+
+static int ed_dev_read(struct sys_blkdev *dev, uint32_t lba,
+                       uint32_t n_blocks, void *buf)
+{
+  enum ed_error e;
+  if (io_mode == SYS_IO_PIO)
+    e = ed_sd_read(lba, n_blocks, buf);
+  else if (io_mode == SYS_IO_DMA)
+    e = ed_sd_read_dma(lba, n_blocks, buf);
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+  if (e != ED_ERROR_SUCCESS) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int ed_dev_write(struct sys_blkdev *dev, uint32_t lba,
+                        uint32_t n_blocks, void *buf)
+{
+  enum ed_error e;
+  if (io_mode == SYS_IO_PIO)
+    e = ed_sd_write(lba, n_blocks, buf);
+  else if (io_mode == SYS_IO_DMA)
+    e = ed_sd_write_dma(lba, n_blocks, buf);
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+  if (e != ED_ERROR_SUCCESS) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* homeboy backend */
+static int hb_dev_init(struct sys_blkdev *dev)
+{
+  if (hb_sd_init()) {
+    errno = ENODEV;
+    return -1;
+  }
+  return 0;
+}
+
+static int hb_dev_read(struct sys_blkdev *dev, uint32_t lba,
+                       uint32_t n_blocks, void *buf)
+{
+  return read_hb(lba, n_blocks, buf);
+}
+
+static int hb_dev_write(struct sys_blkdev *dev, uint32_t lba,
+                        uint32_t n_blocks, void *buf)
+{
+  return write_hb(lba, n_blocks, buf);
+}
+
+static int hb_dev_sync(struct sys_blkdev *dev)
+{
+  sync_hb();
+  return 0;
+}
+
+static struct sys_blkdev ed_blkdev =
+{
+  ed_dev_init, ed_dev_read, ed_dev_write, NULL,
+};
+
+static struct sys_blkdev hb_blkdev =
+{
+  hb_dev_init, hb_dev_read, hb_dev_write, hb_dev_sync,
+};
+
+/* ram disk backend */
+static int ram_dev_check(struct sys_blkdev *dev, uint32_t lba,
+                         uint32_t n_blocks)
+{
+  if (lba >= dev->n_blocks || n_blocks > dev->n_blocks - lba) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int ram_dev_read(struct sys_blkdev *dev, uint32_t lba,
+                        uint32_t n_blocks, void *buf)
+{
+  if (ram_dev_check(dev, lba, n_blocks))
+    return -1;
+  memcpy(buf, (char *)dev->data + lba * 0x200, n_blocks * 0x200);
+  return 0;
+}
+
+static int ram_dev_write(struct sys_blkdev *dev, uint32_t lba,
+                         uint32_t n_blocks, void *buf)
+{
+  if (ram_dev_check(dev, lba, n_blocks))
+    return -1;
+  char *p = (char *)dev->data + lba * 0x200;
+  if (buf)
+    memcpy(p, buf, n_blocks * 0x200);
+  else
+    memset(p, 0, n_blocks * 0x200);
+  return 0;
+}
+
+static int write_dev(uint32_t lba, uint32_t n_blocks, void *buf);
+
+static int ram_dev_init(struct sys_blkdev *dev)
+{
+  /* format the disk unless it already holds a file system. the device is
+     selected at this point, so it can be written through `write_dev` */
+  const uint8_t *boot = dev->data;
+  if (boot[0x1FE] == 0x55 && boot[0x1FF] == 0xAA)
+    return 0;
+  return fat_mkfs(write_dev, dev->n_blocks);
+}
+
+#ifdef SYS_HOST
+/* image file backend, for host builds */
+static int img_dev_init(struct sys_blkdev *dev)
+{
+  return 0;
+}
+
+static int img_dev_read(struct sys_blkdev *dev, uint32_t lba,
+                        uint32_t n_blocks, void *buf)
+{
+  FILE *f = dev->data;
+  if (lba >= dev->n_blocks || n_blocks > dev->n_blocks - lba ||
+      fseek(f, (long)lba * 0x200, SEEK_SET) ||
+      fread(buf, 0x200, n_blocks, f) != n_blocks)
+  {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int img_dev_write(struct sys_blkdev *dev, uint32_t lba,
+                         uint32_t n_blocks, void *buf)
+{
+  static const char zero[0x200];
+  FILE *f = dev->data;
+  if (lba >= dev->n_blocks || n_blocks > dev->n_blocks - lba ||
+      fseek(f, (long)lba * 0x200, SEEK_SET))
+  {
+    errno = EIO;
+    return -1;
+  }
+  for (uint32_t i = 0; i < n_blocks; ++i) {
+    const char *p = buf ? (const char *)buf + i * 0x200 : zero;
+    if (fwrite(p, 0x200, 1, f) != 1) {
+      errno = EIO;
       return -1;
     }
   }
+  return 0;
+}
+
+static int img_dev_sync(struct sys_blkdev *dev)
+{
+  if (fflush(dev->data)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+static int read_dev(uint32_t lba, uint32_t n_blocks, void *buf)
+{
+  return blkdev->read(blkdev, lba, n_blocks, buf);
+}
+
+static int write_dev(uint32_t lba, uint32_t n_blocks, void *buf)
+{
+  return blkdev->write(blkdev, lba, n_blocks, buf);
 }
 
 static int init_fat(void)
 {
   if (fat_ready)
     return 0;
+  if (blkdev) {
+    if (blkdev->init(blkdev))
+      return -1;
+  }
   /* checking for a homeboy device is faster, so do that first */
-  if (hb_sd_init() == 0)
-    device_type = DEVICE_HOMEBOY;
-  else if (ed_sd_init() == 0)
-    device_type = DEVICE_EVERDRIVE;
+  else if (hb_blkdev.init(&hb_blkdev) == 0)
+    blkdev = &hb_blkdev;
+  else if (ed_blkdev.init(&ed_blkdev) == 0)
+    blkdev = &ed_blkdev;
   else {
     errno = ENODEV;
     return -1;
   }
-  if (fat_init(&fat, read_sd, write_sd, 0, 0))
+  if (fat_init(&fat, read_dev, write_dev, 0, 0))
     return -1;
   wd = fat_path(&fat, NULL, "", NULL);
   if (!wd)
@@ -121,6 +367,16 @@ static int init_fat(void)
   return 0;
 }
 
+/* write back cached metadata and wait for queued writes to complete */
+static int flush_fat(void)
+{
+  if (fat_flush(&fat))
+    return -1;
+  if (blkdev->sync)
+    return blkdev->sync(blkdev);
+  return 0;
+}
+
 static struct fat_path *get_origin(const char *path, const char **tail)
 {
   if (path[0] == '/' || path[0] == '\\') {
@@ -202,6 +458,8 @@ static void *new_desc(size_t size, struct fat_path *fp, int flags)
       desc->fildes = i;
       desc->fp = fp;
       fat_begin(fat_path_target(fp), &desc->file);
+      if (!desc->file.is_dir)
+        fat_extmap_init(&desc->file, &desc->extmap);
       desc->flags = flags;
       desc_list[i] = desc;
       return desc;
@@ -213,6 +471,13 @@ static void *new_desc(size_t size, struct fat_path *fp, int flags)
 static void delete_desc(int fildes)
 {
   struct desc *desc = desc_list[fildes];
+  if (desc->file.extmap)
+    fat_extmap_destroy(desc->file.extmap);
+  if (!desc->file.is_dir) {
+    struct file_desc *fdesc = (void *)desc;
+    if (fdesc->ra_buf)
+      free(fdesc->ra_buf);
+  }
   fat_free(desc->fp);
   free(desc);
   desc_list[fildes] = NULL;
@@ -275,7 +540,8 @@ static void ent_stat(struct fat_entry *entry, struct stat *buf)
   buf->st_mtime = entry->mtime;
   buf->st_ctime = entry->ctime;
   buf->st_blksize = fat.n_clust_byte;
-  buf->st_blocks = (entry->size + fat.n_clust_byte - 1) / fat.n_clust_byte;
+  buf->st_blocks = entry->size / fat.n_clust_byte +
+                   (entry->size % fat.n_clust_byte != 0);
 }
 
 int open(const char *path, int oflags, ...)
@@ -336,6 +602,12 @@ int open(const char *path, int oflags, ...)
   if (!fdesc)
     goto error;
   fdesc->pos = 0;
+  fdesc->init_size = entry->size;
+  fdesc->advice = POSIX_FADV_NORMAL;
+  fdesc->ra_next = 0;
+  fdesc->ra_seq = 0;
+  fdesc->ra_buf = NULL;
+  fdesc->ra_size = 0;
   return fdesc->desc.fildes;
 error:
   if (fp)
@@ -402,14 +674,115 @@ off_t lseek(int fildes, off_t offset, int whence)
   return fdesc->pos;
 }
 
+/* fill the read-ahead buffer with up to `n` bytes of initialized data
+   from the current position */
+static int fill_ra(struct file_desc *fdesc, uint32_t n)
+{
+  if (!fdesc->ra_buf) {
+    fdesc->ra_buf = malloc(SYS_RA_SIZE);
+    if (!fdesc->ra_buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  if (n > SYS_RA_SIZE)
+    n = SYS_RA_SIZE;
+  if (n > fdesc->init_size - fdesc->pos)
+    n = fdesc->init_size - fdesc->pos;
+  fdesc->ra_size = 0;
+  if (seek_file(fdesc))
+    return -1;
+  struct fat_file *file = &fdesc->desc.file;
+  fdesc->ra_off = fdesc->pos;
+  fdesc->ra_size = fat_rw(file, FAT_READ, fdesc->ra_buf, n, file, NULL);
+  if (fdesc->ra_size != n)
+    return -1;
+  return 0;
+}
+
+/* read initialized data from the current position. sequential reads
+   smaller than the read-ahead buffer are served from it, so that the
+   card is accessed in large transfers. */
+static int read_data(struct file_desc *fdesc, void *buf, uint32_t nbyte)
+{
+  /* detect sequential access */
+  if (fdesc->pos == fdesc->ra_next) {
+    if (fdesc->ra_seq < SYS_RA_SEQ)
+      ++fdesc->ra_seq;
+  }
+  else
+    fdesc->ra_seq = 0;
+  _Bool ra = fdesc->advice == POSIX_FADV_SEQUENTIAL ||
+             (fdesc->advice == POSIX_FADV_NORMAL &&
+              fdesc->ra_seq >= SYS_RA_SEQ);
+  char *p = buf;
+  uint32_t n = 0;
+  while (n < nbyte) {
+    uint32_t n_left = nbyte - n;
+    /* copy buffered data */
+    uint32_t ra_end = fdesc->ra_off + fdesc->ra_size;
+    if (fdesc->pos >= fdesc->ra_off && fdesc->pos < ra_end) {
+      uint32_t n_copy = ra_end - fdesc->pos;
+      if (n_copy > n_left)
+        n_copy = n_left;
+      memcpy(p, &fdesc->ra_buf[fdesc->pos - fdesc->ra_off], n_copy);
+      p += n_copy;
+      n += n_copy;
+      fdesc->pos += n_copy;
+      continue;
+    }
+    /* refill the buffer for small sequential reads */
+    if (ra && n_left < SYS_RA_SIZE) {
+      if (fill_ra(fdesc, SYS_RA_SIZE) == 0)
+        continue;
+      if (errno != ENOMEM)
+        break;
+    }
+    /* read directly */
+    if (seek_file(fdesc))
+      break;
+    uint32_t n_read = fat_rw(&fdesc->desc.file, FAT_READ, p, n_left,
+                             &fdesc->desc.file, NULL);
+    n += n_read;
+    fdesc->pos += n_read;
+    break;
+  }
+  fdesc->ra_next = fdesc->pos;
+  if (n == 0 && nbyte > 0)
+    return -1;
+  return n;
+}
+
+/* clear the uninitialized part of a preallocated file */
+static int init_file(struct file_desc *fdesc, uint32_t size)
+{
+  if (size <= fdesc->init_size)
+    return 0;
+  uint32_t pos = fdesc->pos;
+  fdesc->pos = fdesc->init_size;
+  int e = seek_file(fdesc);
+  fdesc->pos = pos;
+  if (e)
+    return -1;
+  struct fat_file *file = &fdesc->desc.file;
+  uint32_t n = size - fdesc->init_size;
+  if (fat_rw(file, FAT_WRITE, NULL, n, file, NULL) != n)
+    return -1;
+  fdesc->init_size = size;
+  return 0;
+}
+
 int close(int fildes)
 {
   struct file_desc *fdesc = get_desc(fildes);
   if (!fdesc)
     return -1;
+  int r = init_file(fdesc, fdesc->desc.file.size);
   delete_desc(fdesc->desc.fildes);
+  if (r)
+    return r;
   /* flush data to disk */
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 int read(int fildes, void *buf, unsigned int nbyte)
@@ -424,13 +797,29 @@ int read(int fildes, void *buf, unsigned int nbyte)
   }
   if (nbyte == 0)
     return 0;
-  /* seek */
-  if (seek_file(fdesc))
-    return -1;
-  /* read data and advance pointer */
-  uint32_t n = fat_rw(&fdesc->desc.file, FAT_READ, buf, nbyte,
-                      &fdesc->desc.file, NULL);
-  fdesc->pos += n;
+  /* read initialized data */
+  uint32_t n = 0;
+  if (fdesc->pos < fdesc->init_size) {
+    uint32_t n_init = fdesc->init_size - fdesc->pos;
+    if (n_init > nbyte)
+      n_init = nbyte;
+    int r = read_data(fdesc, buf, n_init);
+    if (r == -1)
+      return -1;
+    n = r;
+    if (n != n_init)
+      return n;
+  }
+  /* preallocated data reads as zero */
+  uint32_t size = fdesc->desc.file.size;
+  if (n < nbyte && fdesc->pos < size) {
+    uint32_t n_zero = size - fdesc->pos;
+    if (n_zero > nbyte - n)
+      n_zero = nbyte - n;
+    memset((char*)buf + n, 0, n_zero);
+    fdesc->pos += n_zero;
+    n += n_zero;
+  }
   return n;
 }
 
@@ -448,40 +837,212 @@ int write(int fildes, void *buf, unsigned int nbyte)
   }
   if (nbyte == 0)
     return 0;
+  /* drop read-ahead data */
+  fdesc->ra_size = 0;
   /* seek to end if FAPPEND is set */
   if (desc->flags & _FAPPEND)
     fdesc->pos = desc->file.size;
-  /* write zero padding if needed */
-  if (fdesc->pos > desc->file.size) {
-    uint32_t size = desc->file.size;
-    /* resize file */
-    if (fat_resize(entry, fdesc->pos + nbyte, &desc->file))
-      return -1;
-    /* seek and clear */
-    uint32_t adv = size - desc->file.p_off;
-    if (fat_advance(&desc->file, adv, NULL) != adv)
-      return -1;
-    uint32_t n = fdesc->pos - size;
-    if (fat_rw(&desc->file, FAT_WRITE, NULL, n, &desc->file, NULL) != n)
-      return -1;
-  }
-  else {
-    /* resize file if needed */
-    uint32_t new_off = fdesc->pos + nbyte;
-    if (new_off > desc->file.size) {
-      if (fat_resize(entry, new_off, &desc->file))
-        return -1;
-    }
-    /* seek */
-    if (seek_file(fdesc))
+  /* resize file if needed */
+  uint32_t new_off = fdesc->pos + nbyte;
+  if (new_off > desc->file.size) {
+    if (fat_resize(entry, new_off, &desc->file))
       return -1;
   }
+  /* write zero padding if needed */
+  if (init_file(fdesc, fdesc->pos))
+    return -1;
+  /* seek */
+  if (seek_file(fdesc))
+    return -1;
   /* write data and advance pointer */
   uint32_t n = fat_rw(&desc->file, FAT_WRITE, buf, nbyte, &desc->file, NULL);
   fdesc->pos += n;
+  if (fdesc->pos > fdesc->init_size)
+    fdesc->init_size = fdesc->pos;
   return n;
 }
 
+int posix_fallocate(int fildes, off_t offset, off_t len)
+{
+  int e = errno;
+  struct file_desc *fdesc = get_desc(fildes);
+  if (!fdesc) {
+    int r = errno;
+    errno = e;
+    return r;
+  }
+  struct desc *desc = &fdesc->desc;
+  if (!(desc->flags & _FWRITE))
+    return EBADF;
+  if (offset < 0 || len <= 0)
+    return EINVAL;
+  if (desc->file.is_dir)
+    return ENODEV;
+  /* reserve a contiguous run of clusters for the new file size,
+     the new space is left uninitialized until written or closed */
+  uint32_t size = offset + len;
+  if (size < offset)
+    return EFBIG;
+  int r = 0;
+  if (fat_prealloc(fat_path_target(desc->fp), size, &desc->file))
+    r = errno;
+  errno = e;
+  return r;
+}
+
+int posix_fadvise(int fildes, off_t offset, off_t len, int advice)
+{
+  int e = errno;
+  struct file_desc *fdesc = get_desc(fildes);
+  if (!fdesc) {
+    int r = errno;
+    errno = e;
+    return r;
+  }
+  if (fdesc->desc.file.is_dir)
+    return ESPIPE;
+  if (offset < 0 || len < 0)
+    return EINVAL;
+  switch (advice) {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_NOREUSE: {
+      fdesc->advice = advice;
+      break;
+    }
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_DONTNEED: {
+      if (advice == POSIX_FADV_RANDOM)
+        fdesc->advice = advice;
+      if (fdesc->ra_buf) {
+        free(fdesc->ra_buf);
+        fdesc->ra_buf = NULL;
+      }
+      fdesc->ra_size = 0;
+      break;
+    }
+    case POSIX_FADV_WILLNEED: {
+      /* load the start of the range into the read-ahead buffer */
+      if (offset >= fdesc->init_size)
+        break;
+      uint32_t pos = fdesc->pos;
+      fdesc->pos = offset;
+      fill_ra(fdesc, len == 0 ? SYS_RA_SIZE : len);
+      fdesc->pos = pos;
+      break;
+    }
+    default:
+      return EINVAL;
+  }
+  errno = e;
+  return 0;
+}
+
+/* map `len` bytes of an open file, starting at `offset`. the mapping
+   must be released with sys_munmap before the file is closed */
+struct sys_map *sys_mmap(int fildes, off_t offset, size_t len)
+{
+  struct file_desc *fdesc = get_desc(fildes);
+  if (!fdesc)
+    return NULL;
+  if (fdesc->desc.file.is_dir) {
+    errno = ENODEV;
+    return NULL;
+  }
+  if (!(fdesc->desc.flags & _FREAD)) {
+    errno = EACCES;
+    return NULL;
+  }
+  if (offset < 0 || len == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (offset + len > fdesc->desc.file.size) {
+    errno = ENXIO;
+    return NULL;
+  }
+  struct sys_map *map = malloc(sizeof(*map));
+  if (!map) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  map->window = malloc(SYS_MAP_WINDOW);
+  if (!map->window) {
+    free(map);
+    errno = ENOMEM;
+    return NULL;
+  }
+  map->fildes = fildes;
+  map->offset = offset;
+  map->length = len;
+  map->win_off = 0;
+  map->win_size = 0;
+  return map;
+}
+
+/* get a pointer to `len` bytes at `offset` in a mapping, loading the
+   window if needed. the pointer is valid until the next call */
+const void *sys_mmap_at(struct sys_map *map, off_t offset, size_t len)
+{
+  if (offset < 0 || len > SYS_MAP_WINDOW || offset + len > map->length) {
+    errno = EINVAL;
+    return NULL;
+  }
+  uint32_t pos = map->offset + offset;
+  if (pos < map->win_off || pos + len > map->win_off + map->win_size) {
+    struct file_desc *fdesc = get_desc(map->fildes);
+    if (!fdesc)
+      return NULL;
+    /* start the window at a sector boundary of the file, so that whole
+       sectors can be transferred directly. the window may begin before
+       the mapping, but does not extend past its end. */
+    uint32_t win_off = pos & ~(uint32_t)0x1FF;
+    if (pos + len > win_off + SYS_MAP_WINDOW)
+      win_off = pos;
+    uint32_t n = map->offset + map->length - win_off;
+    if (n > SYS_MAP_WINDOW)
+      n = SYS_MAP_WINDOW;
+    /* read through a copy of the file pointer, leaving the file position
+       and read-ahead state alone */
+    uint32_t n_init = 0;
+    if (win_off < fdesc->init_size) {
+      n_init = fdesc->init_size - win_off;
+      if (n_init > n)
+        n_init = n;
+    }
+    struct fat_file file = fdesc->desc.file;
+    map->win_size = 0;
+    if (n_init > 0) {
+      if (win_off < file.p_off)
+        fat_rewind(&file);
+      int e = errno;
+      errno = 0;
+      fat_advance(&file, win_off - file.p_off, NULL);
+      uint32_t n_read = 0;
+      if (errno == 0)
+        n_read = fat_rw(&file, FAT_READ, map->window, n_init, NULL, NULL);
+      if (n_read != n_init) {
+        if (errno == 0)
+          errno = EIO;
+        return NULL;
+      }
+      errno = e;
+    }
+    /* preallocated data reads as zero */
+    memset(&map->window[n_init], 0, n - n_init);
+    map->win_off = win_off;
+    map->win_size = n;
+  }
+  return &map->window[pos - map->win_off];
+}
+
+int sys_munmap(struct sys_map *map)
+{
+  free(map->window);
+  free(map);
+  return 0;
+}
+
 int truncate(const char *path, off_t length)
 {
   if (init_fat())
@@ -515,7 +1076,7 @@ int truncate(const char *path, off_t length)
     if (fat_rw(&file, FAT_WRITE, NULL, n, NULL, NULL) != n)
       return -1;
   }
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 int rename(const char *old_path, const char *new_path)
@@ -538,7 +1099,7 @@ int rename(const char *old_path, const char *new_path)
     fat_free(fp);
   }
   if (r == 0)
-    return fat_flush(&fat);
+    return flush_fat();
   else
     return r;
 }
@@ -563,7 +1124,7 @@ int chmod(const char *path, mode_t mode)
     attrib |= FAT_ATTRIB_READONLY;
   if (fat_attrib(&entry, attrib))
     return -1;
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 int unlink(const char *path)
@@ -581,7 +1142,7 @@ int unlink(const char *path)
     return -1;
   if (fat_remove(&entry))
     return -1;
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 DIR *opendir(const char *dirname)
@@ -682,7 +1243,7 @@ int mkdir(const char *path, mode_t mode)
   struct fat_path *fp = get_origin(path, &tail);
   if (fat_create(&fat, fat_path_target(fp), tail, attrib, NULL))
     return -1;
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 int rmdir(const char *path)
@@ -700,7 +1261,7 @@ int rmdir(const char *path)
     return -1;
   if (fat_remove(&entry))
     return -1;
-  return fat_flush(&fat);
+  return flush_fat();
 }
 
 int stat(const char *path, struct stat *buf)
@@ -787,8 +1348,35 @@ int sys_io_mode(int mode)
   return p_mode;
 }
 
+struct fat *sys_fat(void)
+{
+  if (!fat_ready)
+    return NULL;
+  return &fat;
+}
+
+/* get the everdrive sd card statistics, if that is the device in use */
+int sys_sd_stats(struct ed_sd_stats *stats)
+{
+  if (blkdev != &ed_blkdev) {
+    errno = ENODEV;
+    return -1;
+  }
+  ed_sd_get_stats(stats);
+  return 0;
+}
+
 void sys_reset(void)
 {
+  if (blkdev && blkdev->sync)
+    blkdev->sync(blkdev);
+  /* probe for the sd card device again on the next access */
+  if (!blkdev_set)
+    blkdev = NULL;
+  hb_ra_n = 0;
+  /* the file system is mounted again on the next access */
+  if (fat_ready)
+    fat_destroy(&fat);
   fat_ready = 0;
   for (int i = 0; i < OPEN_MAX; ++i) {
     if (desc_list[i])
@@ -799,3 +1387,51 @@ void sys_reset(void)
     wd = 0;
   }
 }
+
+/* select the block device that holds the file system. a null device
+   selects the sd card device that is found by probing */
+void sys_set_blkdev(struct sys_blkdev *dev)
+{
+  sys_reset();
+  blkdev = dev;
+  blkdev_set = dev != NULL;
+}
+
+/* set up a ram disk in `size` bytes of memory at `mem`. the disk is
+   formatted when selected, unless it already holds a file system */
+int sys_ramdisk(struct sys_blkdev *dev, void *mem, uint32_t size)
+{
+  if (size / 0x200 < 0x40) {
+    errno = EINVAL;
+    return -1;
+  }
+  dev->init = ram_dev_init;
+  dev->read = ram_dev_read;
+  dev->write = ram_dev_write;
+  dev->sync = NULL;
+  dev->data = mem;
+  dev->n_blocks = size / 0x200;
+  return 0;
+}
+
+#ifdef SYS_HOST
+/* set up a block device on a disk image file */
+int sys_imgdev(struct sys_blkdev *dev, const char *path)
+{
+  FILE *f = fopen(path, "r+b");
+  if (!f)
+    return -1;
+  if (fseek(f, 0, SEEK_END)) {
+    fclose(f);
+    errno = EIO;
+    return -1;
+  }
+  dev->init = img_dev_init;
+  dev->read = img_dev_read;
+  dev->write = img_dev_write;
+  dev->sync = img_dev_sync;
+  dev->data = f;
+  dev->n_blocks = ftell(f) / 0x200;
+  return 0;
+}
+#endif
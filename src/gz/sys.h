@@ -2,12 +2,26 @@
 #define SYS_H
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#ifndef POSIX_FADV_NORMAL
+#define POSIX_FADV_NORMAL     0
+#define POSIX_FADV_RANDOM     1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED   3
+#define POSIX_FADV_DONTNEED   4
+#define POSIX_FADV_NOREUSE    5
+#endif
+
 typedef void *DIR;
 
+struct ed_sd_stats;
+struct fat;
+struct sys_map;
+
 struct dirent
 {
   ino_t   d_ino;
@@ -25,6 +39,20 @@ enum sys_io_mode
   SYS_IO_DMA,
 };
 
+/* block device holding the file system, in 512-byte blocks. `sync` is
+   optional. writes with a null `buf` must write zeros */
+struct sys_blkdev
+{
+  int     (*init)(struct sys_blkdev *dev);
+  int     (*read)(struct sys_blkdev *dev, uint32_t lba, uint32_t n_blocks,
+                  void *buf);
+  int     (*write)(struct sys_blkdev *dev, uint32_t lba, uint32_t n_blocks,
+                   void *buf);
+  int     (*sync)(struct sys_blkdev *dev);
+  void     *data;
+  uint32_t  n_blocks;
+};
+
 int             open(const char *path, int oflags, ...);
 int             creat(const char *path, mode_t mode);
 int             fstat(int fildes, struct stat *buf);
@@ -35,6 +63,9 @@ off_t           lseek(int fildes, off_t offset, int whence);
 int             close(int fildes);
 int             read(int fildes, void *buf, unsigned int nbyte);
 int             write(int fildes, void *buf, unsigned int nbyte);
+int             posix_fallocate(int fildes, off_t offset, off_t len);
+int             posix_fadvise(int fildes, off_t offset, off_t len,
+                              int advice);
 int             truncate(const char *path, off_t length);
 int             rename(const char *old_path, const char *new_path);
 int             chmod(const char *path, mode_t mode);
@@ -53,6 +84,16 @@ int             chdir(const char *path);
 char           *getcwd(char *buf, size_t size);
 time_t          time(time_t *tloc);
 int             sys_io_mode(int mode);
+struct sys_map *sys_mmap(int fildes, off_t offset, size_t len);
+const void     *sys_mmap_at(struct sys_map *map, off_t offset, size_t len);
+int             sys_munmap(struct sys_map *map);
+struct fat     *sys_fat(void);
+int             sys_sd_stats(struct ed_sd_stats *stats);
 void            sys_reset(void);
+void            sys_set_blkdev(struct sys_blkdev *dev);
+int             sys_ramdisk(struct sys_blkdev *dev, void *mem, uint32_t size);
+#ifdef SYS_HOST
+int             sys_imgdev(struct sys_blkdev *dev, const char *path);
+#endif
 
 #endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "crc16.h"
+
+/* checks the table driven crc16_wide against the bit by bit kernel it
+   replaced, on random blocks of every length up to a sector and on random
+   full sectors */
+
+#define N_SECTORS 0x1000
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+static uint16_t *ref_crc16_table(void)
+{
+  static uint16_t crc_table[256];
+  static _Bool generate_table = 1;
+  if (generate_table) {
+    const uint16_t p = 0x1021;
+    for (int i = 0; i < 256; ++i) {
+      uint16_t crc = 0;
+      uint16_t c = i;
+      for (int j = 0; j < 8; ++j) {
+        if ((crc ^ (c << 1)) & 0x0100)
+          crc = (crc << 1) ^ p;
+        else
+          crc <<= 1;
+        c <<= 1;
+      }
+      crc_table[i] = crc;
+    }
+    generate_table = 0;
+  }
+  return crc_table;
+}
+
+static void ref_crc16_wide(void *data, int size, uint16_t *crc)
+{
+  uint16_t *crc_table = ref_crc16_table();
+  uint8_t *p = data;
+  uint16_t crc_buf[4] = {0, 0, 0, 0};
+  while (size > 0) {
+    uint8_t dat[4] = {0, 0, 0, 0};
+    /* deserialize lines */
+    for (int i = 3; i >= 0; --i) {
+      uint8_t d = size > i ? p[i] : 0;
+      for (int j = 0; j < 8; ++j) {
+        dat[j % 4] >>= 1;
+        dat[j % 4] |= (d & 1) << 7;
+        d >>= 1;
+      }
+    }
+    for (int i = 0; i < 4; ++i) {
+      uint16_t c = crc_buf[i];
+      crc_buf[i] = crc_table[(c >> 8) ^ dat[i]] ^ (c << 8);
+    }
+    p += 4;
+    size -= 4;
+  }
+  /* serialize lines */
+  for (int i = 0; i < 4; i++)
+    crc[i] = 0;
+  for (int i = 0; i < 4 * 16; ++i) {
+    crc[3 - i / 16] >>= 1;
+    crc[3 - i / 16] |= (crc_buf[i % 4] & 1) << 15;
+    crc_buf[i % 4] >>= 1;
+  }
+}
+
+static int check(uint8_t *data, int size)
+{
+  uint16_t crc[4];
+  uint16_t ref_crc[4];
+  crc16_wide(data, size, crc);
+  ref_crc16_wide(data, size, ref_crc);
+  if (memcmp(crc, ref_crc, sizeof(crc)) != 0) {
+    fprintf(stderr, "crc16_wide mismatch for %i bytes: "
+            "%04X %04X %04X %04X, expected %04X %04X %04X %04X\n", size,
+            crc[0], crc[1], crc[2], crc[3],
+            ref_crc[0], ref_crc[1], ref_crc[2], ref_crc[3]);
+    return -1;
+  }
+  return 0;
+}
+
+int main(void)
+{
+  static uint8_t data[0x200];
+  memset(data, 0x00, sizeof(data));
+  if (check(data, sizeof(data)))
+    return 1;
+  memset(data, 0xFF, sizeof(data));
+  for (int i = 0; i <= 0x200; ++i)
+    if (check(data, i))
+      return 1;
+  for (int i = 0; i <= 0x200; ++i) {
+    for (int j = 0; j < i; ++j)
+      data[j] = rand_next();
+    if (check(data, i))
+      return 1;
+  }
+  for (int i = 0; i < N_SECTORS; ++i) {
+    for (int j = 0; j < 0x200; ++j)
+      data[j] = rand_next();
+    if (check(data, 0x200))
+      return 1;
+  }
+  printf("crc16_wide: ok\n");
+  return 0;
+}
@@ -0,0 +1,656 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "fat.h"
+
+/* host tests and benchmarks for the fat driver, run on a disk image.
+   usage: fat-test [-b] [-v] <image>
+   without -b, the create/resize/rename/remove tests are run.
+   with -b, directory listing, sequential transfers and random seeks are
+   timed, and the device io they cause is counted.
+   -v gives the driver vectored io procs, like the everdrive and homeboy
+   backends have. the image is left as it was found on success. */
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%i: check failed: %s (errno %i, %s)\n",     \
+              __FILE__, __LINE__, #cond, errno, strerror(errno));     \
+      return -1;                                                      \
+    }                                                                 \
+  } while (0)
+
+#define BENCH_FILES     0x100
+#define BENCH_SEEKS     0x800
+#define BENCH_CHUNK     0x1000
+#define BENCH_DATA_MAX  0x400000
+
+static FILE      *img;
+static _Bool      use_iov;
+static uint32_t   rand_state = 1;
+
+static int img_read(uint32_t lba, uint32_t n_block, void *buf)
+{
+  if (fseek(img, (long)lba * 0x200, SEEK_SET) ||
+      fread(buf, 0x200, n_block, img) != n_block)
+  {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int img_write(uint32_t lba, uint32_t n_block, void *buf)
+{
+  static const char zero[0x200];
+  if (fseek(img, (long)lba * 0x200, SEEK_SET)) {
+    errno = EIO;
+    return -1;
+  }
+  /* a null buffer means the blocks are to be zeroed */
+  if (buf) {
+    if (fwrite(buf, 0x200, n_block, img) != n_block) {
+      errno = EIO;
+      return -1;
+    }
+  }
+  else {
+    for (uint32_t i = 0; i < n_block; ++i)
+      if (fwrite(zero, 0x200, 1, img) != 1) {
+        errno = EIO;
+        return -1;
+      }
+  }
+  return 0;
+}
+
+static int img_readv(const struct fat_iovec *iov, int n_iov)
+{
+  for (int i = 0; i < n_iov; ++i)
+    if (img_read(iov[i].lba, iov[i].n_block, iov[i].buf))
+      return -1;
+  return 0;
+}
+
+static int img_writev(const struct fat_iovec *iov, int n_iov)
+{
+  for (int i = 0; i < n_iov; ++i)
+    if (img_write(iov[i].lba, iov[i].n_block, iov[i].buf))
+      return -1;
+  return 0;
+}
+
+static int mount(struct fat *fat)
+{
+  if (fat_init(fat, img_read, img_write, 0, 0))
+    return -1;
+  if (use_iov)
+    fat_set_iov(fat, img_readv, img_writev);
+  return 0;
+}
+
+/* commit everything and mount again, so that later checks see what is
+   actually on the disk */
+static int remount(struct fat *fat)
+{
+  if (fat_flush(fat))
+    return -1;
+  fat_destroy(fat);
+  if (fflush(img))
+    return -1;
+  return mount(fat);
+}
+
+static uint32_t rand_next(void)
+{
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+static uint8_t pattern(uint32_t key, uint32_t off)
+{
+  return (off * 31 + key * 7 + (off >> 9)) & 0xFF;
+}
+
+static void fill(void *buf, uint32_t key, uint32_t off, uint32_t n_byte)
+{
+  uint8_t *p = buf;
+  for (uint32_t i = 0; i < n_byte; ++i)
+    p[i] = pattern(key, off + i);
+}
+
+static _Bool match(const void *buf, uint32_t key, uint32_t off,
+                   uint32_t n_byte)
+{
+  const uint8_t *p = buf;
+  for (uint32_t i = 0; i < n_byte; ++i)
+    if (p[i] != pattern(key, off + i))
+      return 0;
+  return 1;
+}
+
+static uint32_t fat_entry_value(struct fat *fat, const uint8_t *tab,
+                                uint32_t clust)
+{
+  switch (fat->type) {
+    case FAT12: {
+      uint32_t off = clust + clust / 2;
+      uint32_t v = tab[off] | (tab[off + 1] << 8);
+      return clust & 1 ? v >> 4 : v & 0x0FFF;
+    }
+    case FAT16:
+      return tab[clust * 2] | (tab[clust * 2 + 1] << 8);
+    default:
+      return (tab[clust * 4] | (tab[clust * 4 + 1] << 8) |
+              (tab[clust * 4 + 2] << 16) |
+              ((uint32_t)tab[clust * 4 + 3] << 24)) & 0x0FFFFFFF;
+  }
+}
+
+/* count free clusters by reading the FAT directly from the image, and
+   check that the mirrors agree with it */
+static int count_free(struct fat *fat, uint32_t *n_free)
+{
+  CHECK(fat_flush(fat) == 0);
+  CHECK(fflush(img) == 0);
+  size_t tab_size = (size_t)fat->n_fat_sect * 0x200;
+  uint8_t *tab = malloc(tab_size);
+  uint8_t *mirror = malloc(tab_size);
+  CHECK(tab && mirror);
+  int r = 0;
+  if (img_read(fat->fat_lba, fat->n_fat_sect, tab))
+    r = -1;
+  for (int i = 1; r == 0 && fat->fat_mirror && i < fat->n_fat; ++i) {
+    if (img_read(fat->fat_lba + fat->n_fat_sect * i, fat->n_fat_sect,
+                 mirror) ||
+        memcmp(tab, mirror, tab_size) != 0)
+    {
+      fprintf(stderr, "fat copy %i differs from the active fat\n", i);
+      r = -1;
+    }
+  }
+  if (r == 0) {
+    *n_free = 0;
+    for (uint32_t i = 2; i < fat->max_clust; ++i)
+      if (fat_entry_value(fat, tab, i) == 0)
+        ++*n_free;
+    /* a known free count must be exact after a flush */
+    if (fat->n_free != FAT_FREE_UNKNOWN && fat->n_free != *n_free) {
+      fprintf(stderr, "free count is %u, fat has %u free clusters\n",
+              (unsigned)fat->n_free, (unsigned)*n_free);
+      r = -1;
+    }
+  }
+  free(tab);
+  free(mirror);
+  return r;
+}
+
+/* fill a file with the pattern for `key` */
+static int write_file(struct fat_entry *entry, uint32_t key)
+{
+  uint8_t *buf = malloc(entry->size + 1);
+  CHECK(buf);
+  fill(buf, key, 0, entry->size);
+  struct fat_file file;
+  fat_begin(entry, &file);
+  uint32_t n = fat_rw(&file, FAT_WRITE, buf, entry->size, NULL, NULL);
+  free(buf);
+  CHECK(n == entry->size);
+  return 0;
+}
+
+/* check the first `n_byte` bytes of a file against the pattern for `key`,
+   reading in odd sized pieces to cross sector and cluster boundaries */
+static int check_file(struct fat_entry *entry, uint32_t key, uint32_t n_byte)
+{
+  uint8_t *buf = malloc(n_byte + 1);
+  CHECK(buf);
+  struct fat_file file;
+  fat_begin(entry, &file);
+  uint32_t off = 0;
+  int r = 0;
+  while (r == 0 && off < n_byte) {
+    uint32_t n = rand_next() % 0x900 + 1;
+    if (n > n_byte - off)
+      n = n_byte - off;
+    if (fat_rw(&file, FAT_READ, &buf[off], n, &file, NULL) != n)
+      r = -1;
+    off += n;
+  }
+  if (r == 0 && !match(buf, key, 0, n_byte))
+    r = -1;
+  free(buf);
+  CHECK(r == 0);
+  return 0;
+}
+
+static int find(struct fat *fat, const char *path, struct fat_entry *entry)
+{
+  return fat_find(fat, NULL, path, entry);
+}
+
+/* number of entries in a directory, not counting dot entries */
+static int count_entries(struct fat *fat, const char *path, int *n_entry)
+{
+  struct fat_entry dir;
+  CHECK(find(fat, path, &dir) == 0);
+  struct fat_file file;
+  fat_begin(&dir, &file);
+  struct fat_entry entry;
+  *n_entry = 0;
+  while (fat_dir(&file, &entry) == 0)
+    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0)
+      ++*n_entry;
+  return 0;
+}
+
+static int test_create(struct fat *fat)
+{
+  struct fat_entry entry;
+  CHECK(fat_create(fat, NULL, "test", FAT_ATTRIB_DIRECTORY, &entry) == 0);
+  CHECK(entry.attrib & FAT_ATTRIB_DIRECTORY);
+  errno = 0;
+  CHECK(fat_create(fat, NULL, "TEST", FAT_ATTRIB_DIRECTORY, NULL) != 0 &&
+        errno == EEXIST);
+  CHECK(fat_create(fat, NULL, "test/short.txt", FAT_ATTRIB_DEFAULT,
+                   &entry) == 0);
+  CHECK(entry.size == 0 && entry.clust == 0);
+  CHECK(fat_create(fat, NULL, "test/A file with a long name.data",
+                   FAT_ATTRIB_DEFAULT, NULL) == 0);
+  errno = 0;
+  CHECK(fat_create(fat, NULL, "missing/file", FAT_ATTRIB_DEFAULT,
+                   NULL) != 0 && errno == ENOENT);
+  errno = 0;
+  CHECK(fat_create(fat, NULL, "test/", FAT_ATTRIB_DEFAULT, NULL) != 0 &&
+        errno == EINVAL);
+  /* enough entries to grow the directory past its first cluster */
+  for (int i = 0; i < 0x60; ++i) {
+    char name[64];
+    sprintf(name, "test/entry number %03i.bin", i);
+    CHECK(fat_create(fat, NULL, name, FAT_ATTRIB_DEFAULT, NULL) == 0);
+  }
+  CHECK(remount(fat) == 0);
+  CHECK(find(fat, "TEST/SHORT.TXT", &entry) == 0);
+  CHECK(strcmp(entry.name, "short.txt") == 0);
+  CHECK(find(fat, "test/a file with a long name.data", &entry) == 0);
+  CHECK(strcmp(entry.name, "A file with a long name.data") == 0);
+  CHECK(find(fat, "test/entry number 096.bin", &entry) != 0);
+  CHECK(find(fat, "test/entry number 095.bin", &entry) == 0);
+  int n_entry;
+  CHECK(count_entries(fat, "test", &n_entry) == 0);
+  CHECK(n_entry == 0x62);
+  return 0;
+}
+
+static int test_resize(struct fat *fat)
+{
+  uint32_t c = fat->n_clust_byte;
+  uint32_t sizes[] =
+  {
+    1, 0x200, c - 1, c, c + 1, c * 5 + 7, 0x9C40, c * 3, 0x10000 + 3,
+    0x40000 + 5, 0, 0x4000,
+  };
+  uint32_t n_free;
+  CHECK(count_free(fat, &n_free) == 0);
+  struct fat_entry entry;
+  CHECK(find(fat, "test/short.txt", &entry) == 0);
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    CHECK(fat_resize(&entry, sizes[i], NULL) == 0);
+    CHECK(entry.size == sizes[i]);
+    /* the part that was kept must be unchanged */
+    uint32_t n_kept = size < sizes[i] ? size : sizes[i];
+    CHECK(check_file(&entry, i - 1, n_kept) == 0);
+    CHECK(write_file(&entry, i) == 0);
+    size = sizes[i];
+    if (i % 4 == 3) {
+      CHECK(remount(fat) == 0);
+      CHECK(find(fat, "test/short.txt", &entry) == 0);
+      CHECK(entry.size == size);
+    }
+    CHECK(check_file(&entry, i, size) == 0);
+    uint32_t n_used = (size + c - 1) / c;
+    uint32_t n_now;
+    CHECK(count_free(fat, &n_now) == 0);
+    CHECK(n_now == n_free - n_used);
+  }
+  /* interleave the growth of two files */
+  struct fat_entry other;
+  CHECK(find(fat, "test/a file with a long name.data", &other) == 0);
+  for (int i = 1; i <= 8; ++i) {
+    CHECK(fat_resize(&entry, size + c * i, NULL) == 0);
+    CHECK(fat_resize(&other, c * i, NULL) == 0);
+    /* the free count is only confirmed or counted once per mount */
+    CHECK(fat->free_scanned || fat->free_checked);
+  }
+  CHECK(write_file(&entry, 100) == 0);
+  CHECK(write_file(&other, 101) == 0);
+  CHECK(remount(fat) == 0);
+  CHECK(find(fat, "test/short.txt", &entry) == 0);
+  CHECK(find(fat, "test/a file with a long name.data", &other) == 0);
+  CHECK(check_file(&entry, 100, entry.size) == 0);
+  CHECK(check_file(&other, 101, other.size) == 0);
+  /* a file that can never fit must fail without losing any clusters */
+  errno = 0;
+  CHECK(fat_resize(&other, 0xFFFFFFFF, NULL) != 0 && errno == ENOSPC);
+  CHECK(check_file(&other, 101, other.size) == 0);
+  CHECK(fat_resize(&other, 0, NULL) == 0);
+  uint32_t n_now;
+  CHECK(count_free(fat, &n_now) == 0);
+  CHECK(n_now == n_free - (entry.size + c - 1) / c);
+  return 0;
+}
+
+static int rename_path(struct fat *fat, const char *old_path,
+                       const char *new_path, struct fat_entry *new_entry)
+{
+  errno = 0;
+  struct fat_path *fp = fat_path(fat, NULL, old_path, NULL);
+  if (!fp)
+    return -1;
+  int r = -1;
+  if (errno == 0)
+    r = fat_rename(fat, fp, NULL, new_path, new_entry);
+  fat_free(fp);
+  return r;
+}
+
+static int test_rename(struct fat *fat)
+{
+  struct fat_entry entry;
+  CHECK(find(fat, "test/short.txt", &entry) == 0);
+  uint32_t size = entry.size;
+  uint32_t clust = entry.clust;
+  /* rename in place, to a name that needs lfn entries */
+  CHECK(rename_path(fat, "test/short.txt", "test/Renamed to a long name.txt",
+                    &entry) == 0);
+  CHECK(entry.size == size && entry.clust == clust);
+  errno = 0;
+  CHECK(find(fat, "test/short.txt", &entry) != 0 && errno == ENOENT);
+  CHECK(find(fat, "test/renamed to a long name.txt", &entry) == 0);
+  CHECK(check_file(&entry, 100, size) == 0);
+  /* move to another directory */
+  CHECK(fat_create(fat, NULL, "test/sub", FAT_ATTRIB_DIRECTORY, NULL) == 0);
+  CHECK(rename_path(fat, "test/Renamed to a long name.txt", "test/sub/MOVED",
+                    NULL) == 0);
+  CHECK(remount(fat) == 0);
+  errno = 0;
+  CHECK(find(fat, "test/Renamed to a long name.txt", &entry) != 0 &&
+        errno == ENOENT);
+  CHECK(find(fat, "test/sub/moved", &entry) == 0);
+  CHECK(entry.size == size && entry.clust == clust);
+  CHECK(check_file(&entry, 100, size) == 0);
+  /* the destination must not exist */
+  errno = 0;
+  CHECK(rename_path(fat, "test/sub/MOVED", "test/entry number 000.bin",
+                    NULL) != 0 && errno == EEXIST);
+  CHECK(find(fat, "test/sub/moved", &entry) == 0);
+  /* a directory can't be moved into itself */
+  errno = 0;
+  CHECK(rename_path(fat, "test/sub", "test/sub/sub", NULL) != 0 &&
+        errno == EINVAL);
+  /* renaming a directory keeps its contents */
+  CHECK(rename_path(fat, "test/sub", "test/Sub Directory", NULL) == 0);
+  CHECK(find(fat, "test/sub directory/moved", &entry) == 0);
+  CHECK(check_file(&entry, 100, size) == 0);
+  CHECK(find(fat, "test/sub directory/..", &entry) == 0);
+  CHECK(strcmp(entry.name, "..") == 0);
+  return 0;
+}
+
+static int test_remove(struct fat *fat, uint32_t n_free)
+{
+  struct fat_entry entry;
+  CHECK(find(fat, "test/sub directory", &entry) == 0);
+  errno = 0;
+  CHECK(fat_remove(&entry) != 0 && errno == ENOTEMPTY);
+  CHECK(find(fat, "test/sub directory/moved", &entry) == 0);
+  CHECK(fat_remove(&entry) == 0);
+  errno = 0;
+  CHECK(find(fat, "test/sub directory/moved", &entry) != 0 &&
+        errno == ENOENT);
+  CHECK(find(fat, "test/sub directory", &entry) == 0);
+  CHECK(fat_remove(&entry) == 0);
+  CHECK(remount(fat) == 0);
+  int n_entry;
+  CHECK(count_entries(fat, "test", &n_entry) == 0);
+  CHECK(n_entry == 0x61);
+  /* remove every other entry, then create new ones in the gaps */
+  for (int i = 0; i < 0x60; i += 2) {
+    char name[64];
+    sprintf(name, "test/entry number %03i.bin", i);
+    CHECK(find(fat, name, &entry) == 0);
+    CHECK(fat_remove(&entry) == 0);
+  }
+  for (int i = 0; i < 0x10; ++i) {
+    char name[64];
+    sprintf(name, "test/new %i", i);
+    CHECK(fat_create(fat, NULL, name, FAT_ATTRIB_DEFAULT, NULL) == 0);
+  }
+  CHECK(remount(fat) == 0);
+  CHECK(count_entries(fat, "test", &n_entry) == 0);
+  CHECK(n_entry == 0x61 - 0x30 + 0x10);
+  /* empty the directory and remove it */
+  struct fat_entry dir;
+  CHECK(find(fat, "test", &dir) == 0);
+  struct fat_file file;
+  fat_begin(&dir, &file);
+  while (fat_dir(&file, &entry) == 0) {
+    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0)
+      CHECK(fat_remove(&entry) == 0);
+  }
+  CHECK(find(fat, "test", &dir) == 0);
+  CHECK(fat_remove(&dir) == 0);
+  errno = 0;
+  CHECK(find(fat, "test", &dir) != 0 && errno == ENOENT);
+  CHECK(remount(fat) == 0);
+  uint32_t n_now;
+  CHECK(count_free(fat, &n_now) == 0);
+  CHECK(n_now == n_free);
+  return 0;
+}
+
+static int run_tests(struct fat *fat)
+{
+  uint32_t n_free;
+  CHECK(count_free(fat, &n_free) == 0);
+  CHECK(test_create(fat) == 0);
+  printf("create: ok\n");
+  CHECK(test_resize(fat) == 0);
+  printf("resize: ok\n");
+  CHECK(test_rename(fat) == 0);
+  printf("rename: ok\n");
+  CHECK(test_remove(fat, n_free) == 0);
+  printf("remove: ok\n");
+  return 0;
+}
+
+struct bench
+{
+  const char       *name;
+  struct timespec   start;
+};
+
+static void bench_start(struct fat *fat, struct bench *bench,
+                        const char *name)
+{
+  bench->name = name;
+  fat_reset_stats(fat);
+  clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+static void bench_end(struct fat *fat, struct bench *bench)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - bench->start.tv_sec) * 1e3 +
+              (end.tv_nsec - bench->start.tv_nsec) / 1e6;
+  uint32_t n_hit = 0;
+  uint32_t n_miss = 0;
+  for (int i = 0; i < FAT_CACHE_MAX; ++i) {
+    n_hit += fat->cache[i].n_hit;
+    n_miss += fat->cache[i].n_miss;
+  }
+  printf("%-14s %10.3f %8u %8u %8u %8u %8u %8u\n", bench->name, ms,
+         (unsigned)fat->n_read, (unsigned)fat->n_read_sect,
+         (unsigned)fat->n_write, (unsigned)fat->n_write_sect,
+         (unsigned)n_hit, (unsigned)n_miss);
+}
+
+static int bench_dir(struct fat *fat)
+{
+  CHECK(fat_create(fat, NULL, "bench", FAT_ATTRIB_DIRECTORY, NULL) == 0);
+  for (int i = 0; i < BENCH_FILES; ++i) {
+    char name[64];
+    sprintf(name, "bench/benchmark file %03i.dat", i);
+    CHECK(fat_create(fat, NULL, name, FAT_ATTRIB_DEFAULT, NULL) == 0);
+  }
+  CHECK(remount(fat) == 0);
+  struct bench bench;
+  bench_start(fat, &bench, "dir list");
+  int n_entry;
+  CHECK(count_entries(fat, "bench", &n_entry) == 0);
+  bench_end(fat, &bench);
+  CHECK(n_entry == BENCH_FILES);
+  bench_start(fat, &bench, "dir lookup");
+  for (int i = 0; i < BENCH_FILES; ++i) {
+    char name[64];
+    sprintf(name, "bench/benchmark file %03i.dat",
+            (int)(rand_next() % BENCH_FILES));
+    struct fat_entry entry;
+    CHECK(find(fat, name, &entry) == 0);
+  }
+  bench_end(fat, &bench);
+  return 0;
+}
+
+static int bench_data(struct fat *fat)
+{
+  uint32_t n_free;
+  CHECK(count_free(fat, &n_free) == 0);
+  /* use at most half of the free space */
+  uint32_t size = n_free / 2 * fat->n_clust_byte;
+  if (size > BENCH_DATA_MAX)
+    size = BENCH_DATA_MAX;
+  size &= ~(BENCH_CHUNK - 1);
+  CHECK(size > 0);
+  static uint8_t buf[BENCH_CHUNK];
+  struct fat_entry entry;
+  CHECK(fat_create(fat, NULL, "bench/sequential.dat", FAT_ATTRIB_DEFAULT,
+                   &entry) == 0);
+  struct bench bench;
+  struct fat_file file;
+  bench_start(fat, &bench, "seq write");
+  CHECK(fat_resize(&entry, size, NULL) == 0);
+  fat_begin(&entry, &file);
+  for (uint32_t off = 0; off < size; off += BENCH_CHUNK) {
+    fill(buf, 0, off, BENCH_CHUNK);
+    CHECK(fat_rw(&file, FAT_WRITE, buf, BENCH_CHUNK, &file,
+                 NULL) == BENCH_CHUNK);
+  }
+  CHECK(fat_flush(fat) == 0);
+  bench_end(fat, &bench);
+  CHECK(remount(fat) == 0);
+  CHECK(find(fat, "bench/sequential.dat", &entry) == 0);
+  bench_start(fat, &bench, "seq read");
+  fat_begin(&entry, &file);
+  for (uint32_t off = 0; off < size; off += BENCH_CHUNK) {
+    CHECK(fat_rw(&file, FAT_READ, buf, BENCH_CHUNK, &file,
+                 NULL) == BENCH_CHUNK);
+    CHECK(match(buf, 0, off, BENCH_CHUNK));
+  }
+  bench_end(fat, &bench);
+  /* seek from the start of the file each time, like lseek does */
+  for (int i = 0; i < 2; ++i) {
+    struct fat_extmap extmap;
+    uint32_t seed = rand_state;
+    bench_start(fat, &bench, i == 0 ? "random seek" : "seek (extmap)");
+    for (int j = 0; j < BENCH_SEEKS; ++j) {
+      uint32_t off = rand_next() % (size - 0x200 + 1);
+      fat_begin(&entry, &file);
+      if (i == 1) {
+        if (j == 0)
+          fat_extmap_init(&file, &extmap);
+        else
+          file.extmap = &extmap;
+      }
+      CHECK(fat_advance(&file, off, NULL) == off);
+      CHECK(fat_rw(&file, FAT_READ, buf, 0x200, NULL, NULL) == 0x200);
+      CHECK(match(buf, 0, off, 0x200));
+    }
+    bench_end(fat, &bench);
+    if (i == 1)
+      fat_extmap_destroy(&extmap);
+    rand_state = seed;
+  }
+  return 0;
+}
+
+static int bench_cleanup(struct fat *fat)
+{
+  struct fat_entry dir;
+  CHECK(find(fat, "bench", &dir) == 0);
+  struct fat_file file;
+  fat_begin(&dir, &file);
+  struct fat_entry entry;
+  while (fat_dir(&file, &entry) == 0) {
+    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0)
+      CHECK(fat_remove(&entry) == 0);
+  }
+  CHECK(find(fat, "bench", &dir) == 0);
+  CHECK(fat_remove(&dir) == 0);
+  return remount(fat);
+}
+
+static int run_bench(struct fat *fat)
+{
+  static const char *type_name[] = {"FAT12", "FAT16", "FAT32"};
+  printf("%s, %u byte clusters%s\n", type_name[fat->type],
+         (unsigned)fat->n_clust_byte, use_iov ? ", vectored io" : "");
+  printf("%-14s %10s %8s %8s %8s %8s %8s %8s\n", "", "ms", "reads",
+         "sectors", "writes", "sectors", "hits", "misses");
+  CHECK(bench_dir(fat) == 0);
+  CHECK(bench_data(fat) == 0);
+  CHECK(bench_cleanup(fat) == 0);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  _Bool bench = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "bv")) != -1) {
+    if (opt == 'b')
+      bench = 1;
+    else if (opt == 'v')
+      use_iov = 1;
+    else
+      goto usage;
+  }
+  if (optind != argc - 1)
+    goto usage;
+  img = fopen(argv[optind], "r+b");
+  if (!img) {
+    perror(argv[optind]);
+    return 1;
+  }
+  static struct fat fat;
+  if (mount(&fat)) {
+    fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+    fclose(img);
+    return 1;
+  }
+  int r = bench ? run_bench(&fat) : run_tests(&fat);
+  fat_destroy(&fat);
+  fclose(img);
+  return r ? 1 : 0;
+usage:
+  fprintf(stderr, "usage: %s [-b] [-v] <image>\n", argv[0]);
+  return 1;
+}
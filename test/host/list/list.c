@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "list.h"
+
+struct list_node
+{
+  struct list_node *prev;
+  struct list_node *next;
+  /* keep the element data aligned like malloc would */
+  long long         align;
+};
+
+static struct list_node *node_of(const void *element)
+{
+  return (struct list_node *)element - 1;
+}
+
+static void *element_of(struct list_node *node)
+{
+  return node ? node + 1 : NULL;
+}
+
+void list_init(struct list *list, size_t element_size)
+{
+  list->element_size = element_size;
+  list->first = NULL;
+  list->last = NULL;
+}
+
+void *list_prev(const void *element)
+{
+  return element_of(node_of(element)->prev);
+}
+
+void *list_next(const void *element)
+{
+  return element_of(node_of(element)->next);
+}
+
+void *list_push_back(struct list *list, const void *data)
+{
+  struct list_node *node = malloc(sizeof(*node) + list->element_size);
+  if (!node)
+    return NULL;
+  node->prev = list->last ? node_of(list->last) : NULL;
+  node->next = NULL;
+  if (node->prev)
+    node->prev->next = node;
+  else
+    list->first = element_of(node);
+  list->last = element_of(node);
+  if (data)
+    memcpy(element_of(node), data, list->element_size);
+  return element_of(node);
+}
+
+void list_erase(struct list *list, void *element)
+{
+  struct list_node *node = node_of(element);
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    list->first = element_of(node->next);
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    list->last = element_of(node->prev);
+  free(node);
+}
+
+void list_destroy(struct list *list)
+{
+  while (list->first)
+    list_erase(list, list->first);
+}
@@ -0,0 +1,21 @@
+#ifndef LIST_H
+#define LIST_H
+#include <stddef.h>
+
+/* host build of the doubly linked list from the n64 tools (liblist) */
+
+struct list
+{
+  size_t  element_size;
+  void   *first;
+  void   *last;
+};
+
+void  list_init(struct list *list, size_t element_size);
+void *list_prev(const void *element);
+void *list_next(const void *element);
+void *list_push_back(struct list *list, const void *data);
+void  list_erase(struct list *list, void *element);
+void  list_destroy(struct list *list);
+
+#endif
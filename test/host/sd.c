@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include "ed.h"
+#include "hb.h"
+
+/* host stand-ins for the sd card drivers. no card is ever found, so the
+   sys layer only uses the devices selected with sys_set_blkdev */
+
+enum ed_error ed_sd_init(void)
+{
+  return ED_ERROR_SD_INIT_TIMEOUT;
+}
+
+enum ed_error ed_sd_read(uint32_t lba, uint32_t n_blocks, void *dst)
+{
+  return ED_ERROR_SD_RD_TIMEOUT;
+}
+
+enum ed_error ed_sd_write(uint32_t lba, uint32_t n_blocks, void *src)
+{
+  return ED_ERROR_SD_WR_TIMEOUT;
+}
+
+enum ed_error ed_sd_read_dma(uint32_t lba, uint32_t n_blocks, void *dst)
+{
+  return ED_ERROR_SD_RD_TIMEOUT;
+}
+
+enum ed_error ed_sd_write_dma(uint32_t lba, uint32_t n_blocks, void *src)
+{
+  return ED_ERROR_SD_WR_TIMEOUT;
+}
+
+void ed_sd_get_stats(struct ed_sd_stats *stats)
+{
+}
+
+int hb_sd_init(void)
+{
+  return -1;
+}
+
+int hb_sd_read(uint32_t lba, uint32_t n_blocks, void *dst)
+{
+  return -1;
+}
+
+int hb_sd_write(uint32_t lba, uint32_t n_blocks, void *src)
+{
+  return -1;
+}
+
+int hb_sd_submit(uint32_t lba, uint32_t n_blocks, void *buf, _Bool write)
+{
+  return -1;
+}
+
+int hb_sd_poll(void)
+{
+  return -1;
+}
+
+int hb_sd_sync(void)
+{
+  return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef SYS_HOST_H
+#define SYS_HOST_H
+
+/* included before everything else in host builds of sys.c and its tests.
+   the posix functions that sys.c implements are renamed so that they don't
+   clash with the host libc, and the newlib definitions that sys.c relies
+   on are supplied */
+
+#define SYS_HOST
+
+#define open            gz_open
+#define creat           gz_creat
+#define fstat           gz_fstat
+#define fstatat         gz_fstatat
+#define isatty          gz_isatty
+#define lseek           gz_lseek
+#define close           gz_close
+#define read            gz_read
+#define write           gz_write
+#define truncate        gz_truncate
+#define rename          gz_rename
+#define chmod           gz_chmod
+#define unlink          gz_unlink
+#define opendir         gz_opendir
+#define closedir        gz_closedir
+#define readdir         gz_readdir
+#define seekdir         gz_seekdir
+#define telldir         gz_telldir
+#define rewinddir       gz_rewinddir
+#define mkdir           gz_mkdir
+#define rmdir           gz_rmdir
+#define stat            gz_stat
+#define lstat           gz_lstat
+#define chdir           gz_chdir
+#define getcwd          gz_getcwd
+#define time            gz_time
+#define posix_fallocate gz_posix_fallocate
+#define posix_fadvise   gz_posix_fadvise
+
+#define OPEN_MAX        16
+#define _FREAD          0x0001
+#define _FWRITE         0x0002
+#define _FAPPEND        O_APPEND
+
+/* the host headers declare some arguments as nonnull */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wnonnull-compare"
+#endif
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vector.h"
+
+static char *element_at(const struct vector *vector, size_t position)
+{
+  return (char *)vector->begin + position * vector->element_size;
+}
+
+static void update_ptrs(struct vector *vector)
+{
+  if (vector->begin) {
+    vector->end = element_at(vector, vector->size);
+    vector->rbegin = element_at(vector, vector->size) - vector->element_size;
+    vector->rend = element_at(vector, 0) - vector->element_size;
+  }
+  else {
+    vector->end = NULL;
+    vector->rbegin = NULL;
+    vector->rend = NULL;
+  }
+}
+
+void vector_init(struct vector *vector, size_t element_size)
+{
+  vector->element_size = element_size;
+  vector->size = 0;
+  vector->capacity = 0;
+  vector->begin = NULL;
+  update_ptrs(vector);
+}
+
+void *vector_at(const struct vector *vector, size_t position)
+{
+  if (position >= vector->size)
+    return NULL;
+  return element_at(vector, position);
+}
+
+int vector_reserve(struct vector *vector, size_t num)
+{
+  if (num <= vector->capacity)
+    return 1;
+  void *begin = realloc(vector->begin, num * vector->element_size);
+  if (!begin)
+    return 0;
+  vector->begin = begin;
+  vector->capacity = num;
+  update_ptrs(vector);
+  return 1;
+}
+
+void *vector_insert(struct vector *vector, size_t position, size_t num,
+                    const void *data)
+{
+  if (position > vector->size)
+    return NULL;
+  if (vector->size + num > vector->capacity &&
+      !vector_reserve(vector, (vector->size + num) * 2))
+  {
+    return NULL;
+  }
+  size_t n_move = vector->size - position;
+  memmove(element_at(vector, position + num), element_at(vector, position),
+          n_move * vector->element_size);
+  if (data)
+    memcpy(element_at(vector, position), data, num * vector->element_size);
+  vector->size += num;
+  update_ptrs(vector);
+  return element_at(vector, position);
+}
+
+void *vector_push_back(struct vector *vector, size_t num, const void *data)
+{
+  return vector_insert(vector, vector->size, num, data);
+}
+
+int vector_erase(struct vector *vector, size_t position, size_t num)
+{
+  if (position + num > vector->size)
+    return 0;
+  size_t n_move = vector->size - position - num;
+  memmove(element_at(vector, position), element_at(vector, position + num),
+          n_move * vector->element_size);
+  vector->size -= num;
+  update_ptrs(vector);
+  return 1;
+}
+
+int vector_shrink_to_fit(struct vector *vector)
+{
+  if (vector->size == vector->capacity)
+    return 1;
+  if (vector->size == 0) {
+    free(vector->begin);
+    vector->begin = NULL;
+    vector->capacity = 0;
+    update_ptrs(vector);
+    return 1;
+  }
+  void *begin = realloc(vector->begin, vector->size * vector->element_size);
+  if (!begin)
+    return 0;
+  vector->begin = begin;
+  vector->capacity = vector->size;
+  update_ptrs(vector);
+  return 1;
+}
+
+void vector_clear(struct vector *vector)
+{
+  vector->size = 0;
+  update_ptrs(vector);
+}
+
+void vector_destroy(struct vector *vector)
+{
+  free(vector->begin);
+  vector_init(vector, vector->element_size);
+}
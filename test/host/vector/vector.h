@@ -0,0 +1,29 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+#include <stddef.h>
+
+/* host build of the dynamic array from the n64 tools (libvector) */
+
+struct vector
+{
+  size_t  element_size;
+  size_t  size;
+  size_t  capacity;
+  void   *begin;
+  void   *end;
+  void   *rbegin;
+  void   *rend;
+};
+
+void  vector_init(struct vector *vector, size_t element_size);
+void *vector_at(const struct vector *vector, size_t position);
+int   vector_reserve(struct vector *vector, size_t num);
+void *vector_insert(struct vector *vector, size_t position, size_t num,
+                    const void *data);
+void *vector_push_back(struct vector *vector, size_t num, const void *data);
+int   vector_erase(struct vector *vector, size_t position, size_t num);
+int   vector_shrink_to_fit(struct vector *vector);
+void  vector_clear(struct vector *vector);
+void  vector_destroy(struct vector *vector);
+
+#endif
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "bgio.h"
+#include "sys.h"
+
+/* host tests for the posix layer in sys.c.
+   usage: sys-test <image>
+   the tests are run on the image, through the image file backend, and on
+   a ram disk. the image is left as it was found on success. */
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%i: check failed: %s (errno %i, %s)\n",     \
+              __FILE__, __LINE__, #cond, errno, strerror(errno));     \
+      return -1;                                                      \
+    }                                                                 \
+  } while (0)
+
+#define DATA_SIZE   100000
+#define RAMDISK_SIZE 0x100000
+
+static uint8_t    data[DATA_SIZE];
+static uint32_t   rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+static off_t file_size(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st))
+    return -1;
+  return st.st_size;
+}
+
+static _Bool dir_has(const char *dir_path, const char *name)
+{
+  DIR *dir = opendir(dir_path);
+  if (!dir)
+    return 0;
+  _Bool found = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)))
+    if (strcmp(ent->d_name, name) == 0)
+      found = 1;
+  closedir(dir);
+  return found;
+}
+
+static int test_dirs(void)
+{
+  char cwd[256];
+  CHECK(mkdir("test", 0777) == 0);
+  errno = 0;
+  CHECK(mkdir("test", 0777) != 0 && errno == EEXIST);
+  CHECK(mkdir("test/sub", 0777) == 0);
+  CHECK(chdir("test/sub") == 0);
+  CHECK(getcwd(cwd, sizeof(cwd)) && strcmp(cwd, "/test/sub") == 0);
+  CHECK(chdir("..") == 0);
+  CHECK(getcwd(cwd, sizeof(cwd)) && strcmp(cwd, "/test") == 0);
+  CHECK(dir_has("/test", "sub"));
+  CHECK(dir_has(".", "sub"));
+  return 0;
+}
+
+static int test_rw(void)
+{
+  /* write in odd sized pieces */
+  int f = open("data.bin", O_RDWR | O_CREAT | O_TRUNC, 0666);
+  CHECK(f >= 0);
+  for (uint32_t off = 0; off < DATA_SIZE; ) {
+    uint32_t n = rand_next() % 5000 + 1;
+    if (n > DATA_SIZE - off)
+      n = DATA_SIZE - off;
+    CHECK(write(f, &data[off], n) == n);
+    off += n;
+  }
+  struct stat st;
+  CHECK(fstat(f, &st) == 0 && st.st_size == DATA_SIZE);
+  /* small sequential reads are served by read-ahead */
+  uint8_t buf[0x1000];
+  CHECK(lseek(f, 0, SEEK_SET) == 0);
+  for (uint32_t off = 0; off < DATA_SIZE; ) {
+    uint32_t n = rand_next() % 300 + 1;
+    if (n > DATA_SIZE - off)
+      n = DATA_SIZE - off;
+    CHECK(read(f, buf, n) == n && memcmp(buf, &data[off], n) == 0);
+    off += n;
+  }
+  CHECK(read(f, buf, 1) == 0);
+  /* random reads, and a write into data that is in the read-ahead buffer */
+  for (int i = 0; i < 200; ++i) {
+    uint32_t off = rand_next() % DATA_SIZE;
+    uint32_t n = rand_next() % sizeof(buf) + 1;
+    if (n > DATA_SIZE - off)
+      n = DATA_SIZE - off;
+    CHECK(lseek(f, off, SEEK_SET) == off);
+    CHECK(read(f, buf, n) == n && memcmp(buf, &data[off], n) == 0);
+  }
+  CHECK(lseek(f, 1000, SEEK_SET) == 1000);
+  CHECK(read(f, buf, 10) == 10);
+  for (int i = 0; i < 10; ++i)
+    data[1010 + i] ^= 0xFF;
+  CHECK(write(f, &data[1010], 10) == 10);
+  CHECK(lseek(f, 1000, SEEK_SET) == 1000);
+  CHECK(read(f, buf, 30) == 30 && memcmp(buf, &data[1000], 30) == 0);
+  CHECK(close(f) == 0);
+  /* append */
+  f = open("data.bin", O_WRONLY | O_APPEND);
+  CHECK(f >= 0);
+  CHECK(lseek(f, 0, SEEK_SET) == 0);
+  CHECK(write(f, "appended", 8) == 8);
+  CHECK(close(f) == 0);
+  CHECK(file_size("data.bin") == DATA_SIZE + 8);
+  /* the data must be on the disk after a reset */
+  sys_reset();
+  f = open("/test/data.bin", O_RDONLY);
+  CHECK(f >= 0);
+  static uint8_t back[DATA_SIZE + 8];
+  CHECK(read(f, back, sizeof(back)) == sizeof(back));
+  CHECK(memcmp(back, data, DATA_SIZE) == 0);
+  CHECK(memcmp(&back[DATA_SIZE], "appended", 8) == 0);
+  errno = 0;
+  CHECK(write(f, back, 1) == -1 && errno == EBADF);
+  CHECK(close(f) == 0);
+  CHECK(chdir("/test") == 0);
+  /* truncate */
+  CHECK(truncate("data.bin", 5000) == 0);
+  CHECK(file_size("data.bin") == 5000);
+  return 0;
+}
+
+static int test_prealloc(void)
+{
+  int f = open("prealloc.bin", O_RDWR | O_CREAT | O_EXCL, 0666);
+  CHECK(f >= 0);
+  CHECK(write(f, data, 1000) == 1000);
+  CHECK(posix_fallocate(f, 0, 50000) == 0);
+  CHECK(file_size("prealloc.bin") == 50000);
+  /* preallocated data reads as zero, through read and a mapping */
+  uint8_t buf[0x1000];
+  CHECK(lseek(f, 900, SEEK_SET) == 900);
+  CHECK(read(f, buf, 200) == 200);
+  CHECK(memcmp(buf, &data[900], 100) == 0);
+  for (int i = 100; i < 200; ++i)
+    CHECK(buf[i] == 0);
+  struct sys_map *map = sys_mmap(f, 700, 49300);
+  CHECK(map);
+  const uint8_t *p = sys_mmap_at(map, 0, 0x1000);
+  CHECK(p && memcmp(p, &data[700], 300) == 0);
+  for (int i = 300; i < 0x1000; ++i)
+    CHECK(p[i] == 0);
+  /* the mapping doesn't move the file position */
+  CHECK(read(f, buf, 10) == 10);
+  CHECK(lseek(f, 0, SEEK_CUR) == 1110);
+  errno = 0;
+  CHECK(!sys_mmap_at(map, 49290, 11) && errno == EINVAL);
+  CHECK(sys_munmap(map) == 0);
+  CHECK(close(f) == 0);
+  errno = 0;
+  CHECK(open("prealloc.bin", O_RDWR | O_CREAT | O_EXCL, 0666) == -1 &&
+        errno == EEXIST);
+  return 0;
+}
+
+static int test_mmap(void)
+{
+  int f = open("map.bin", O_RDWR | O_CREAT | O_TRUNC, 0666);
+  CHECK(f >= 0);
+  CHECK(write(f, data, DATA_SIZE) == DATA_SIZE);
+  CHECK(lseek(f, 123, SEEK_SET) == 123);
+  struct sys_map *map = sys_mmap(f, 1000, DATA_SIZE - 1000);
+  CHECK(map);
+  uint8_t buf[100];
+  uint32_t pos = 123;
+  for (int i = 0; i < 2000; ++i) {
+    /* interleave sequential reads of the descriptor */
+    if (i % 3 == 0) {
+      CHECK(read(f, buf, sizeof(buf)) == sizeof(buf));
+      CHECK(memcmp(buf, &data[pos], sizeof(buf)) == 0);
+      pos += sizeof(buf);
+    }
+    uint32_t len = rand_next() % 0x4001;
+    uint32_t off = rand_next() % (DATA_SIZE - 1000 - len + 1);
+    const uint8_t *p = sys_mmap_at(map, off, len);
+    CHECK(p && memcmp(p, &data[1000 + off], len) == 0);
+  }
+  CHECK(sys_munmap(map) == 0);
+  errno = 0;
+  CHECK(!sys_mmap(f, 0, DATA_SIZE + 1) && errno == ENXIO);
+  CHECK(close(f) == 0);
+  return 0;
+}
+
+static int test_remove(void)
+{
+  CHECK(rename("map.bin", "/moved.bin") == 0);
+  errno = 0;
+  CHECK(file_size("map.bin") == -1 && errno == ENOENT);
+  CHECK(file_size("/moved.bin") == DATA_SIZE);
+  CHECK(dir_has("/", "moved.bin"));
+  errno = 0;
+  CHECK(rename("/moved.bin", "data.bin") != 0 && errno == EEXIST);
+  CHECK(unlink("/moved.bin") == 0);
+  CHECK(!dir_has("/", "moved.bin"));
+  CHECK(chdir("/") == 0);
+  errno = 0;
+  CHECK(rmdir("test") != 0 && errno == ENOTEMPTY);
+  CHECK(unlink("test/data.bin") == 0);
+  CHECK(unlink("test/prealloc.bin") == 0);
+  CHECK(rmdir("test/sub") == 0);
+  CHECK(rmdir("test") == 0);
+  CHECK(!dir_has("/", "test"));
+  return 0;
+}
+
+static int bgio_error;
+static int bgio_n_done;
+
+static void bgio_done(int error, void *data)
+{
+  bgio_error = error;
+  ++bgio_n_done;
+}
+
+static int test_bgio(void)
+{
+  /* jobs advance one step per update, in order */
+  bgio_n_done = 0;
+  CHECK(bgio_write_file("bg1.bin", data, DATA_SIZE, bgio_done, NULL) == 0);
+  CHECK(bgio_write_file("bg2.bin", data, 10, bgio_done, NULL) == 0);
+  CHECK(bgio_busy() && bgio_progress() == 0);
+  bgio_update();
+  bgio_update();
+  CHECK(bgio_n_done == 0 && bgio_progress() > 0 && bgio_progress() < 100);
+  /* the file system can be used between steps */
+  CHECK(file_size("data.bin") == 5000);
+  while (bgio_n_done == 0)
+    bgio_update();
+  CHECK(bgio_error == 0 && file_size("bg1.bin") == DATA_SIZE);
+  bgio_sync();
+  CHECK(!bgio_busy() && bgio_n_done == 2 && bgio_error == 0);
+  CHECK(file_size("bg2.bin") == 10);
+  int f = open("bg1.bin", O_RDONLY);
+  static uint8_t back[DATA_SIZE];
+  CHECK(f >= 0 && read(f, back, DATA_SIZE) == DATA_SIZE && close(f) == 0);
+  CHECK(memcmp(back, data, DATA_SIZE) == 0);
+  /* errors are passed to the callback */
+  CHECK(bgio_write_file("/none/bg.bin", data, 10, bgio_done, NULL) == 0);
+  bgio_sync();
+  CHECK(bgio_n_done == 3 && bgio_error == ENOENT);
+  CHECK(unlink("bg1.bin") == 0 && unlink("bg2.bin") == 0);
+  return 0;
+}
+
+static int run_tests(const char *name)
+{
+  CHECK(test_dirs() == 0);
+  CHECK(test_rw() == 0);
+  CHECK(test_prealloc() == 0);
+  CHECK(test_bgio() == 0);
+  CHECK(test_mmap() == 0);
+  CHECK(test_remove() == 0);
+  printf("%s: ok\n", name);
+  return 0;
+}
+
+static int test_ramdisk(void)
+{
+  struct sys_blkdev dev;
+  uint8_t *mem = calloc(RAMDISK_SIZE, 1);
+  CHECK(mem);
+  errno = 0;
+  CHECK(sys_ramdisk(&dev, mem, 0x1000) != 0 && errno == EINVAL);
+  CHECK(sys_ramdisk(&dev, mem, RAMDISK_SIZE) == 0);
+  sys_set_blkdev(&dev);
+  /* the disk is formatted when it is first used */
+  CHECK(run_tests("ram disk") == 0);
+  CHECK(mem[0x1FE] == 0x55 && mem[0x1FF] == 0xAA);
+  /* and keeps its contents when it is selected again */
+  int f = open("/keep.bin", O_WRONLY | O_CREAT, 0666);
+  CHECK(f >= 0 && write(f, data, 1000) == 1000 && close(f) == 0);
+  sys_set_blkdev(NULL);
+  sys_set_blkdev(&dev);
+  CHECK(file_size("/keep.bin") == 1000);
+  /* without a selected device, the sd card is probed and not found */
+  sys_set_blkdev(NULL);
+  errno = 0;
+  CHECK(open("/keep.bin", O_RDONLY) == -1 && errno == ENODEV);
+  free(mem);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <image>\n", argv[0]);
+    return 1;
+  }
+  for (int i = 0; i < DATA_SIZE; ++i)
+    data[i] = rand_next();
+  struct sys_blkdev dev;
+  if (sys_imgdev(&dev, argv[1])) {
+    perror(argv[1]);
+    return 1;
+  }
+  sys_set_blkdev(&dev);
+  if (run_tests("image") || test_ramdisk())
+    return 1;
+  return 0;
+}